@@ -110,10 +110,17 @@ def validate_model(ctx, param, value):
               type=int,
               default=4, show_default=True,
               help="Number of categories used in ancestral reconstruction.")
+@click.option('--ar-partitions',
+              type=click.IntRange(min=1),
+              default=1, show_default=True,
+              help="""Splits the extended alignment into this number of column partitions and 
+              runs RAxML-NG on them concurrently, each with a share of :option:`--threads`.""")
 @click.option('-k', '--k',
-             type=int,
-             default=8, show_default=True,
-             help="k-mer length used. Must be a value in [2, 31].")
+             type=str,
+             default="8", show_default=True,
+             help="""k-mer length used. Must be a value in [2, 31]. A comma-separated list, 
+             e.g. 6,8,10, builds a database for every value in one run; the output file 
+             name gets the suffix _k<k>_o<omega>.""")
 @click.option('-m', '--model', type=click.UNPROCESSED, callback=validate_model, required=False,
              help="Phylogenetic model used for ancestral state reconstruction.\n\n"
                   "Must be one of the following:\n\n"
@@ -133,11 +140,11 @@ def validate_model(ctx, param, value):
               help="""Ratio for alignment reduction. 
               Sites holding a higher percentage of gaps than this value will be removed.""")
 @click.option('--omega',
-              type=float,
-              default=1.5, show_default=True,
+              type=str,
+              default="1.5", show_default=True,
               help="""Score threshold modifier. Determines the 
               minimal phylo-k-mer score considered according to the following formula:
-              (omega / #states)^k""")
+              (omega / #states)^k. A comma-separated list builds a database for every value in one run.""")
 @click.option('--filter',
               callback=validate_filter,
               default="mif0", show_default=True,
@@ -193,24 +200,82 @@ def validate_model(ctx, param, value):
              type=int,
              default=1, 
              show_default=True,
-             help="Number of threads used to compute phylo-k-mers.")
+             help="Number of threads used for ancestral reconstruction and to compute phylo-k-mers.")
 @click.option('--output', '-o',
               help="""Output file name""")
 @click.option('--on-disk',
              is_flag=True,
              default=False, show_default=True,
              help="""If set, builds the database on disk (slower but takes minimal RAM).""")
+@click.option('--resume',
+             is_flag=True,
+             default=False, show_default=True,
+             help="""Continues an interrupted :option:`--on-disk` build in the same working directory. 
+             Ancestral reconstruction and the completed branches are not computed again.""")
+@click.option('--shard',
+              type=str,
+              help="""i/N: computes phylo-k-mers only for the shard i (0 <= i < N) of the branches 
+              and keeps them in the working directory. Requires :option:`--on-disk`. 
+              Shards computed on different machines are merged with `merge-shards`.""")
+@click.option('--keep-groups',
+             is_flag=True,
+             default=False, show_default=True,
+             help="""Keeps the phylo-k-mers of every branch in the working directory of an 
+             :option:`--on-disk` build, so that the database can be updated with :option:`--update-from`.""")
+@click.option('--update-from',
+              type=click.Path(exists=True, dir_okay=True, file_okay=False),
+              help="""The working directory of a previous :option:`--on-disk` build made with 
+              :option:`--keep-groups` and the same parameters. Branches whose ancestral probabilities 
+              did not change are copied instead of being computed again.""")
+@click.option('--spill-codec',
+              type=click.Choice(['archive', 'delta', 'quantized']),
+              default='archive', show_default=True,
+              help="""The encoding of temporary files of :option:`--on-disk` builds. delta stores 
+              sorted k-mers as delta-encoded varints. quantized also stores scores in 16 bits, 
+              which is lossy.""")
+@click.option('--max-ram',
+              type=str,
+              help="""The memory budget, e.g. 512M or 16G. A build in RAM that exceeds it 
+              continues on disk, and on-disk batches that would exceed it are merged in parts. 
+              Memory is estimated.""")
+@click.option('--schedule',
+              type=click.Choice(['tree', 'longest-first']),
+              default='longest-first', show_default=True,
+              help="""The order in which branches are processed with several threads. 
+              longest-first estimates the cost of every branch and starts with the most expensive ones.""")
+@click.option('--format',
+              type=click.Choice(['ipk', 'flat', 'blocks']),
+              default='ipk', show_default=True,
+              help="""The layout of the output database. flat is memory-mapped and 
+              queried without parsing. blocks is compressed by blocks in parallel.""")
+@click.option('--compression-level',
+              type=click.IntRange(0, 9),
+              default=6, show_default=True,
+              help="""The zlib compression level of the blocks layout. 0 disables compression.""")
+@click.option('--metrics-json',
+              type=click.Path(dir_okay=False, file_okay=True),
+              help="""If set, writes per-stage construction metrics (wall and CPU time, 
+              phylo-k-mer counts, I/O volume, peak memory) in JSON to the specified file.""")
+@click.option('--profile',
+              type=click.Path(dir_okay=False, file_okay=True),
+              help="""If set, writes the construction cost of every branch group (windows, 
+              phylo-k-mers emitted and kept, time) in JSON to the specified file and prints 
+              the most expensive groups.""")
+@click.option('--profile-top',
+              type=int,
+              default=10, show_default=True,
+              help="""The number of the most expensive branch groups to report with :option:`--profile`.""")
 def build(ar,
           refalign, reftree, states,
           verbosity,
           workdir, write_reduction, #dbfilename,
-          alpha, categories,
+          alpha, categories, ar_partitions,
           k, model, convert_uo, #gap_jump_thresh,
           no_reduction, reduction_ratio, omega,
           filter, mu, ghosts, use_unrooted, merge_branches,
           ar_dir, ar_only, ar_config,
           keep_positions, uncompressed,
-          threads, output, on_disk):
+          threads, output, on_disk, resume, shard, keep_groups, update_from, schedule, format, compression_level, spill_codec, max_ram, metrics_json, profile, profile_top):
     """
     Computes a database of phylo-k-mers.
     """
@@ -221,13 +286,13 @@ def build(ar,
                    refalign, reftree, states,
                    verbosity,
                    workdir, write_reduction, #dbfilename,
-                   alpha, categories,
+                   alpha, categories, ar_partitions,
                    k, model, convert_uo, #gap_jump_thresh,
                    no_reduction, reduction_ratio, omega,
                    filter, mu, ghosts, use_unrooted, merge_branches,
                    ar_dir, ar_only, ar_config,
                    keep_positions, uncompressed,
-                   threads, output, on_disk)
+                   threads, output, on_disk, resume, shard, keep_groups, update_from, schedule, format, compression_level, spill_codec, max_ram, metrics_json, profile, profile_top)
 
 
 def find_raxmlng():
@@ -254,14 +319,14 @@ def build_database(ar,
                    refalign, reftree, states,
                    verbosity,
                    workdir, write_reduction, #dbfilename,
-                   alpha, categories,
+                   alpha, categories, ar_partitions,
                    k, model, convert_uo, #gap_jump_thresh,
                    no_reduction, reduction_ratio, omega,
                    filter, mu, ghosts, 
                    use_unrooted, merge_branches,
                    ar_dir, ar_only, ar_config,
                    keep_positions, uncompressed,
-                   threads, output_filename, on_disk):
+                   threads, output_filename, on_disk, resume, shard, keep_groups, update_from, schedule, format, compression_level, spill_codec, max_ram, metrics_json, profile, profile_top):
 
     if not ar:
         ar = find_raxmlng()
@@ -305,10 +370,20 @@ def build_database(ar,
         "--" + ghosts.lower(),
         "-u", str(mu),
         "-j", str(threads),
+        "--schedule", schedule,
+        "--format", format,
+        "--compression-level", str(compression_level),
+        "--spill-codec", spill_codec,
         "-o", output_filename,
         "-v", str(verbosity)
     ]
 
+    if max_ram:
+        command.append("--max-ram")
+        command.append(str(max_ram))
+    if ar_partitions > 1:
+        command.append("--ar-partitions")
+        command.append(str(ar_partitions))
     if ar_only:
         command.append("--ar-only")
     if ar_dir:
@@ -327,6 +402,24 @@ def build_database(ar,
         command.append("--uncompressed")
     if on_disk:
         command.append("--on-disk")
+    if resume:
+        command.append("--resume")
+    if shard:
+        command.append("--shard")
+        command.append(str(shard))
+    if keep_groups:
+        command.append("--keep-groups")
+    if update_from:
+        command.append("--update-from")
+        command.append(str(update_from))
+    if metrics_json:
+        command.append("--metrics-json")
+        command.append(str(metrics_json))
+    if profile:
+        command.append("--profile")
+        command.append(str(profile))
+        command.append("--profile-top")
+        command.append(str(profile_top))
 
     # remove the temporary folder just in case
     hashmaps_dir = f"{workdir}/hashmaps"
@@ -339,8 +432,9 @@ def build_database(ar,
     try:
         p = subprocess.run(command_str, shell=True, check=True)
 
-        # clean after
-        subprocess.call(["rm", "-rf", hashmaps_dir])
+        # clean after. Shards are kept for merge-shards, groups for --update-from
+        if not shard and not keep_groups:
+            subprocess.call(["rm", "-rf", hashmaps_dir])
 
         if p.returncode != 0:
             raise RuntimeError(f"IPK returned error: {p.returncode}")
@@ -350,5 +444,90 @@ def build_database(ar,
 
 
 
+@ipk.command(name="merge-shards")
+@click.option('-s', '--states',
+              type=click.Choice(['nucl', 'amino']),
+              default='nucl', show_default=True,
+              help="States used in analysis.")
+@click.option('-w', '--workdir',
+              required=True,
+              type=click.Path(dir_okay=True, file_okay=False),
+              help="Path to the working directory. Must differ from the shard directories.")
+@click.option('--output', '-o',
+              help="""Output file name""")
+@click.option('--keep-positions',
+              is_flag=True,
+              default=False, show_default=True,
+              help="""Set if the shards were built with :option:`--keep-positions`.""")
+@click.option('--format',
+              type=click.Choice(['ipk', 'flat', 'blocks']),
+              default='ipk', show_default=True,
+              help="""The layout of the output database.""")
+@click.option('--compression-level',
+              type=click.IntRange(0, 9),
+              default=6, show_default=True,
+              help="""The zlib compression level of the blocks layout. 0 disables compression.""")
+@click.option('--uncompressed',
+              is_flag=True,
+              default=False,
+              help="""Disables database compression. Set it if the shards were built with :option:`--uncompressed`, 
+              so that the output matches a single-process build.""")
+@click.option('--resume',
+             is_flag=True,
+             default=False, show_default=True,
+             help="""Continues an interrupted merge in the same working directory.""")
+@click.option('--max-ram',
+              type=str,
+              help="""The memory budget, e.g. 512M or 16G. Batches that would exceed it are merged in parts.""")
+@click.option('--metrics-json',
+              type=click.Path(dir_okay=False, file_okay=True),
+              help="""If set, writes per-stage metrics in JSON to the specified file.""")
+@click.argument('shards', nargs=-1, required=True,
+                type=click.Path(exists=True, dir_okay=True, file_okay=False))
+def merge_shards(states, workdir, output, keep_positions, format, compression_level, uncompressed, resume, max_ram, metrics_json, shards):
+    """
+    Merges phylo-k-mers computed by shard builds (build --shard i/N) into a database.
+
+    SHARDS are the working directories of all the shard builds.
+    """
+    if not output:
+        output = os.path.join(workdir, "DB.ipk")
+
+    Path(workdir).mkdir(parents=True, exist_ok=True)
+    current_dir = os.path.dirname(os.path.realpath(__file__))
+    ipk_bin_dir = f"{current_dir}" if os.path.exists(f"{current_dir}/ipk-dna") else f"{current_dir}/bin/ipk"
+
+    if states == 'nucl':
+        if keep_positions:
+            raise RuntimeError("--keep-positions is not supported for DNA.")
+        bin = f"{ipk_bin_dir}/ipk-dna"
+    else:
+        bin = f"{ipk_bin_dir}/ipk-aa-pos" if keep_positions else f"{ipk_bin_dir}/ipk-aa"
+
+    command = [
+        bin,
+        "merge-shards",
+        "--shards", *[str(shard) for shard in shards],
+        "-w", str(workdir),
+        "-o", str(output),
+        "--format", format,
+        "--compression-level", str(compression_level)
+    ]
+    if uncompressed:
+        command.append("--uncompressed")
+    if resume:
+        command.append("--resume")
+    if max_ram:
+        command.append("--max-ram")
+        command.append(str(max_ram))
+    if metrics_json:
+        command.append("--metrics-json")
+        command.append(str(metrics_json))
+
+    print("Running", " ".join(command))
+    print()
+    subprocess.run(command, check=True)
+
+
 if __name__ == "__main__":
     ipk()
@@ -0,0 +1,402 @@
+/// Micro-benchmarks for the phylo-k-mer enumeration kernels.
+///
+/// Builds synthetic probability matrices with controlled per-column entropy
+/// and times the kernels of the construction algorithm separately.
+/// The results are printed in JSON.
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <functional>
+#include <boost/program_options.hpp>
+#include <i2l/phylo_kmer_db.h>
+#include "window.h"
+#include "pk_compute.h"
+#include "branch_group.h"
+#include "filter.h"
+#include "json.h"
+
+namespace po = boost::program_options;
+using namespace ipk;
+using i2l::phylo_kmer;
+using i2l::seq_traits;
+
+struct bench_parameters
+{
+    size_t width;
+    size_t kmer_size;
+    phylo_kmer::score_type omega;
+    double entropy;
+    double entropy_spread;
+    size_t num_branches;
+    size_t iterations;
+    size_t warmup;
+    unsigned int seed;
+    std::string output;
+};
+
+bench_parameters process_command_line(int argc, const char* argv[])
+{
+    bench_parameters parameters;
+
+    po::options_description desc("Phylo-k-mer kernel benchmark options");
+    desc.add_options()
+        ("help,h", "Show help")
+        ("width", po::value<size_t>(&parameters.width)->default_value(1000),
+            "Number of columns of every synthetic matrix")
+        ("k", po::value<size_t>(&parameters.kmer_size)->default_value(8),
+            "k-mer length")
+        ("omega", po::value<phylo_kmer::score_type>(&parameters.omega)->default_value(1.5f),
+            "Score threshold parameter")
+        ("entropy", po::value<double>(&parameters.entropy)->default_value(0.5),
+            "Normalized Shannon entropy of a column, in [0, 1]")
+        ("entropy-spread", po::value<double>(&parameters.entropy_spread)->default_value(0.0),
+            "Column entropies are drawn uniformly from [entropy - spread, entropy + spread]")
+        ("branches", po::value<size_t>(&parameters.num_branches)->default_value(16),
+            "Number of synthetic branches used to build the database for the filter benchmark")
+        ("iterations", po::value<size_t>(&parameters.iterations)->default_value(20),
+            "Number of timed iterations per kernel")
+        ("warmup", po::value<size_t>(&parameters.warmup)->default_value(2),
+            "Number of untimed iterations per kernel")
+        ("seed", po::value<unsigned int>(&parameters.seed)->default_value(42),
+            "Random seed")
+        ("output,o", po::value<std::string>(&parameters.output)->default_value(""),
+            "Output JSON file. Prints to stdout if not set");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        std::exit(0);
+    }
+
+    if (parameters.kmer_size < 2 || parameters.kmer_size > seq_traits::max_kmer_length)
+    {
+        throw std::runtime_error("k must be in [2, " + std::to_string(seq_traits::max_kmer_length) + "]");
+    }
+    if (parameters.width < 2 * parameters.kmer_size)
+    {
+        throw std::runtime_error("The matrix width must be at least 2k");
+    }
+    if (parameters.iterations == 0)
+    {
+        throw std::runtime_error("The number of iterations must be positive");
+    }
+    return parameters;
+}
+
+/// Normalized Shannon entropy of a column where the best state has the probability p,
+/// and the rest is distributed uniformly among other states
+double column_entropy(double p)
+{
+    const auto n = static_cast<double>(seq_traits::alphabet_size);
+    const auto q = (1.0 - p) / (n - 1);
+    double h = - p * std::log(p);
+    if (q > 0)
+    {
+        h -= (n - 1) * q * std::log(q);
+    }
+    return h / std::log(n);
+}
+
+/// Finds the probability of the best state that gives the normalized entropy h.
+/// The entropy decreases monotonically for p in [1/n, 1], so we bisect
+double best_probability(double h)
+{
+    double lo = 1.0 / static_cast<double>(seq_traits::alphabet_size);
+    double hi = 1.0 - 1e-6;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        const auto mid = (lo + hi) / 2;
+        if (column_entropy(mid) > h)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+/// Generates a matrix of log-probabilities the same way ar::reader does
+ipk::matrix make_matrix(const bench_parameters& parameters, std::mt19937& generator, const std::string& label)
+{
+    const auto min_entropy = std::max(0.0, parameters.entropy - parameters.entropy_spread);
+    const auto max_entropy = std::min(1.0, parameters.entropy + parameters.entropy_spread);
+    std::uniform_real_distribution<double> entropy_distribution(min_entropy, max_entropy);
+    std::uniform_int_distribution<size_t> state_distribution(0, seq_traits::alphabet_size - 1);
+
+    std::vector<ipk::matrix::column> data(parameters.width);
+    for (auto& column : data)
+    {
+        const auto p = best_probability(entropy_distribution(generator));
+        const auto q = (1.0 - p) / static_cast<double>(seq_traits::alphabet_size - 1);
+        column.fill(static_cast<phylo_kmer::score_type>(std::log10(q)));
+        column[state_distribution(generator)] = static_cast<phylo_kmer::score_type>(std::log10(p));
+    }
+    return { std::move(data), label };
+}
+
+struct kernel_result
+{
+    std::string name;
+    /// The number of items produced by one iteration. Used to detect changes of the output
+    size_t items;
+    std::vector<double> times_ms;
+};
+
+/// Runs the kernel warmup + iterations times. The kernel returns the number of items produced
+kernel_result run_kernel(const std::string& name, const bench_parameters& parameters,
+                         const std::function<size_t()>& kernel)
+{
+    kernel_result result{ name, 0, {} };
+    for (size_t i = 0; i < parameters.warmup; ++i)
+    {
+        result.items = kernel();
+    }
+
+    result.times_ms.reserve(parameters.iterations);
+    for (size_t i = 0; i < parameters.iterations; ++i)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        result.items = kernel();
+        const auto end = std::chrono::steady_clock::now();
+        result.times_ms.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+
+    std::cerr << name << ": " << result.items << " items, "
+              << *std::min_element(result.times_ms.begin(), result.times_ms.end()) << " ms (min)" << std::endl;
+    return result;
+}
+
+size_t bench_as_column(const ipk::matrix& matrix, size_t k, phylo_kmer::score_type log_threshold)
+{
+    size_t count = 0;
+    for (const auto& window : to_windows(&matrix, k))
+    {
+        /// The same bound DCLA uses for the first column of the window
+        const auto eps = log_threshold - window.range_max_product(1, k - 1);
+        count += as_column(window, 0, eps).size();
+    }
+    return count;
+}
+
+size_t bench_dcla(const ipk::matrix& matrix, size_t k, phylo_kmer::score_type log_threshold)
+{
+    size_t count = 0;
+    for (const auto& window : to_windows(&matrix, k))
+    {
+        auto alg = ipk::DCLA(window, k);
+        alg.run(log_threshold);
+        count += alg.get_result().size();
+    }
+    return count;
+}
+
+namespace ipk
+{
+    /// Grants the benchmarks access to DCCW::run
+    struct kernel_bench
+    {
+        static void run(DCCW& alg, phylo_kmer::score_type omega)
+        {
+            alg.run(omega);
+        }
+    };
+}
+
+size_t bench_dccw(const ipk::matrix& matrix, size_t k, phylo_kmer::score_type log_threshold)
+{
+    /// An impossible bound for the ends of a chain: there is no window to share strings with
+    const auto no_bound = -std::numeric_limits<phylo_kmer::score_type>::infinity();
+    const auto suffix_size = k - k / 2;
+
+    size_t count = 0;
+    std::vector<uphylo_kmer> prefixes;
+    for (auto&& [previous, window, next] : chain_windows(&matrix, k))
+    {
+        /// Windows of a chain are shifted by the suffix length. Otherwise, a new chain
+        /// has started, and the prefixes of the last one are not valid anymore
+        const bool continues_chain = !previous.empty()
+            && previous.get_position() + suffix_size == window.get_position();
+        const bool chain_goes_on = !next.empty()
+            && window.get_position() + suffix_size == next.get_position();
+        if (!continues_chain)
+        {
+            prefixes.clear();
+        }
+
+        const auto lookbehind = continues_chain ? previous.range_max_product(0, k / 2) : no_bound;
+        const auto lookahead = chain_goes_on ? next.range_max_product(k / 2, suffix_size) : no_bound;
+
+        auto alg = ipk::DCCW(window, prefixes, k, lookbehind, lookahead);
+        ipk::kernel_bench::run(alg, log_threshold);
+        count += alg.get_result().size();
+        prefixes = alg.get_suffixes();
+    }
+    return count;
+}
+
+std::vector<uphylo_kmer> explore(const ipk::matrix& matrix, size_t k, phylo_kmer::score_type log_threshold)
+{
+    std::vector<uphylo_kmer> kmers;
+    for (const auto& window : to_windows(&matrix, k))
+    {
+        auto alg = ipk::DCLA(window, k);
+        alg.run(log_threshold);
+        const auto& result = alg.get_result();
+        kmers.insert(kmers.end(), result.begin(), result.end());
+    }
+    return kmers;
+}
+
+size_t bench_put(const std::vector<uphylo_kmer>& kmers)
+{
+    group_hash_map map;
+    for (const auto& kmer : kmers)
+    {
+        ipk::put(map, kmer);
+    }
+    return map.size();
+}
+
+/// Builds a database of phylo-k-mers for a number of synthetic branches
+i2l::phylo_kmer_db make_database(const bench_parameters& parameters, std::mt19937& generator,
+                                 phylo_kmer::score_type log_threshold)
+{
+    i2l::phylo_kmer_db db{ parameters.kmer_size, parameters.omega, seq_type::name, "" };
+    for (size_t branch = 0; branch < parameters.num_branches; ++branch)
+    {
+        const auto matrix = make_matrix(parameters, generator, std::to_string(branch));
+
+        group_hash_map map;
+        for (const auto& kmer : explore(matrix, parameters.kmer_size, log_threshold))
+        {
+            ipk::put(map, kmer);
+        }
+
+        for (const auto& [key, score] : map)
+        {
+            db.unsafe_insert(key, { static_cast<phylo_kmer::branch_type>(branch), score });
+        }
+    }
+    return db;
+}
+
+void print_report(std::ostream& out, const bench_parameters& parameters, const std::vector<kernel_result>& results)
+{
+    json_writer json(out);
+    json.begin_object();
+    json.field("benchmark", "ipk-kernels");
+    json.field("sequence_type", seq_type::name);
+
+    json.key("parameters").begin_object()
+        .field("width", parameters.width)
+        .field("k", parameters.kmer_size)
+        .field("omega", static_cast<double>(parameters.omega))
+        .field("entropy", parameters.entropy)
+        .field("entropy_spread", parameters.entropy_spread)
+        .field("branches", parameters.num_branches)
+        .field("iterations", parameters.iterations)
+        .field("warmup", parameters.warmup)
+        .field("seed", parameters.seed)
+        .end_object();
+
+    json.key("kernels").begin_array();
+    for (const auto& result : results)
+    {
+        auto times = result.times_ms;
+        std::sort(times.begin(), times.end());
+        const auto mean = std::accumulate(times.begin(), times.end(), 0.0) / static_cast<double>(times.size());
+        const auto median = (times.size() % 2 == 1)
+            ? times[times.size() / 2]
+            : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+
+        json.begin_object()
+            .field("name", result.name)
+            .field("items", result.items)
+            .field("iterations", times.size())
+            .field("min_ms", times.front())
+            .field("median_ms", median)
+            .field("mean_ms", mean)
+            .field("max_ms", times.back());
+        json.key("times_ms").begin_array();
+        for (const auto time : result.times_ms)
+        {
+            json.value(time);
+        }
+        json.end_array();
+        json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+}
+
+int main(int argc, const char* argv[])
+{
+    try
+    {
+        const auto parameters = process_command_line(argc, argv);
+        const auto k = parameters.kmer_size;
+        const auto log_threshold = std::log10(i2l::score_threshold(parameters.omega, k));
+
+        std::mt19937 generator(parameters.seed);
+        const auto matrix = make_matrix(parameters, generator, "bench");
+
+        std::vector<kernel_result> results;
+        results.push_back(run_kernel("as_column", parameters,
+                                     [&]() { return bench_as_column(matrix, k, log_threshold); }));
+        results.push_back(run_kernel("DCLA::run", parameters,
+                                     [&]() { return bench_dcla(matrix, k, log_threshold); }));
+
+        /// Chained windows share prefixes and suffixes for even k only. DCCW is not used by
+        /// db_builder, and it explores only the windows of the chains: its items are not
+        /// comparable with those of DCLA::run
+        if (k % 2 == 0)
+        {
+            results.push_back(run_kernel("DCCW", parameters,
+                                         [&]() { return bench_dccw(matrix, k, log_threshold); }));
+        }
+        else
+        {
+            std::cerr << "DCCW: skipped, supported for even k only" << std::endl;
+        }
+
+        const auto kmers = explore(matrix, k, log_threshold);
+        results.push_back(run_kernel("ipk::put", parameters,
+                                     [&]() { return bench_put(kmers); }));
+
+        const auto db = make_database(parameters, generator, log_threshold);
+        const auto threshold = i2l::score_threshold(parameters.omega, k);
+        const auto filter = ipk::make_filter(filter_type::mif0, parameters.num_branches, "", 1, threshold);
+        results.push_back(run_kernel("mif0_filter::calc_filter_values", parameters,
+                                     [&]() { return filter->calc_filter_values(db).size(); }));
+
+        if (parameters.output.empty())
+        {
+            print_report(std::cout, parameters, results);
+        }
+        else
+        {
+            std::ofstream out(parameters.output);
+            print_report(out, parameters, results);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -2,7 +2,12 @@
 #define RAPPAS_BUILD_ALIGNMENT_H
 
 #include <vector>
+#include <deque>
 #include <string>
+#include <string_view>
+#include <optional>
+#include <iterator>
+#include <unordered_map>
 #include <memory>
 #include <i2l/seq.h>
 #include <i2l/seq_record.h>
@@ -23,14 +28,59 @@ namespace ipk
     {
         friend alignment extend_alignment(alignment original_alignment, const i2l::phylo_tree& tree);
     public:
-        using iterator = std::vector<seq_record>::iterator;
-        using const_iterator = std::vector<seq_record>::const_iterator;
+        /// A row of the alignment. Views are valid while the alignment exists
+        class row
+        {
+        public:
+            row(std::string_view header, std::string_view sequence) noexcept;
+
+            [[nodiscard]]
+            std::string_view header() const noexcept;
+            [[nodiscard]]
+            std::string_view sequence() const noexcept;
+
+        private:
+            std::string_view _header;
+            std::string_view _sequence;
+        };
+
+        /// Iterates over the rows: the sequences, then the gap-only sequences
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = row;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const row*;
+            using reference = row;
+
+            const_iterator(const alignment& alignment, size_t index) noexcept;
+
+            [[nodiscard]]
+            reference operator*() const;
+            [[nodiscard]]
+            pointer operator->() const;
+
+            const_iterator& operator++();
+            const_iterator operator++(int);
+
+            bool operator==(const const_iterator& other) const noexcept;
+            bool operator!=(const const_iterator& other) const noexcept;
+
+        private:
+            const alignment* _alignment;
+            size_t _index;
+
+            /// The row pointed by operator->
+            mutable std::optional<row> _row;
+        };
 
     public:
         /// ctors
-        /// The vector is passed by value and moved
-        explicit alignment(std::vector<seq_record> sequences);
-        alignment(const alignment&) = default;
+        /// Headers and sequences are passed by value and moved
+        alignment(std::deque<std::string> headers, std::vector<std::string> sequences);
+        /// The header index is rebuilt for the copy
+        alignment(const alignment& other);
         alignment(alignment&&) noexcept = default;
         ~alignment() noexcept = default;
         alignment& operator=(const alignment&) = delete;
@@ -42,30 +92,56 @@ namespace ipk
         [[nodiscard]]
         size_t height() const noexcept;
 
-        /// iterators
+        /// lookup
         [[nodiscard]]
-        iterator begin();
+        bool contains(std::string_view header) const;
+
+        /// Returns the row with the index in the order of iteration
         [[nodiscard]]
-        iterator end();
+        row at(size_t index) const;
+
+        /// modifiers
+        /// \brief Keeps only the given columns, in place. The columns must be sorted
+        /// \details Rows are compacted by num_threads threads
+        void keep_columns(const std::vector<size_t>& columns, size_t num_threads);
+
+        /// iterators
         [[nodiscard]]
         const_iterator begin() const;
         [[nodiscard]]
         const_iterator end() const;
     private:
-        std::vector<seq_record> _sequences;
+        /// Appends a sequence of gaps. All of them share one buffer
+        void add_gap_sequence(const std::string& header);
+
+        /// Indexes the headers of all rows
+        void build_index();
+
+        /// Headers of all rows, the rows with sequences first. A deque does not move
+        /// the headers, so the views in the index stay valid
+        std::deque<std::string> _headers;
+
+        /// Sequences of the first rows. The other rows are gap-only
+        std::vector<std::string> _sequences;
+
+        /// The sequence of every gap-only row
+        std::string _gaps;
+
+        /// Row indices by header. The keys are views of the headers of the rows
+        std::unordered_map<std::string_view, size_t> _index;
 
         size_t _width;
-        size_t _height;
     };
 
     /// \brief Read and preprocess the reference alignment.
     /// Performs several check on the sequence content and filters out
-    /// columns that have gap ratio >= reduction_ratio
+    /// columns that have gap ratio >= reduction_ratio. Gaps are counted by num_threads threads
     alignment preprocess_alignment(const std::string& working_dir,
                                    const std::string& alignment_file,
                                    double reduction_ratio,
                                    bool no_reduction,
-                                   int verbose);
+                                   int verbose,
+                                   size_t num_threads);
 
     alignment extend_alignment(alignment original_alignment, const i2l::phylo_tree& tree);
 
@@ -78,6 +154,16 @@ namespace ipk
 
     void save_alignment(const alignment& alignment, const std::string& filename,
                         alignment_format format);
+
+    /// Saves the alignment in FASTA and PHYLIP at once, in two threads
+    void save_alignment(const alignment& alignment, const std::string& fasta_file,
+                        const std::string& phylip_file);
+
+    /// \brief Saves the alignment in PHYLIP as num_partitions files of consecutive columns
+    /// of (almost) equal width, named phylip_file.part<i>.
+    /// \return The names of the files, in the order of the columns
+    std::vector<std::string> save_partitions(const alignment& alignment, const std::string& phylip_file,
+                                             size_t num_partitions);
 }
 
 
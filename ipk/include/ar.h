@@ -1,8 +1,11 @@
 #ifndef IPK_AR_H
 #define IPK_AR_H
 
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <memory>
 #include "row.h"
 
@@ -15,6 +18,7 @@ namespace ipk
 {
     class proba_matrix;
     class matrix;
+    class build_metrics;
 
     namespace cli
     {
@@ -23,9 +27,21 @@ namespace ipk
 
     namespace ar
     {
-        /// Ancestral Reconstruction software uses their own name conventions
-        /// to name internal nodes of the tree. This type maps IPK's internal node names to them
-        using mapping = std::unordered_map<std::string, std::string>;
+        /// \brief A dense id of a node of the extended tree: its post-order id. The AR tree has
+        /// the same topology, so the node has the same id in both trees
+        using node_id = uint32_t;
+
+        /// \brief Ancestral Reconstruction software uses their own name conventions
+        /// to name internal nodes of the tree. This type maps the nodes of the extended tree
+        /// to them by id. Labels are kept only to read and write files
+        struct mapping
+        {
+            /// Labels of the nodes of the extended tree by id
+            std::vector<std::string> extended_labels;
+
+            /// Labels of the nodes of the AR tree by id
+            std::vector<std::string> ar_labels;
+        };
 
         /// Supported tools for ancestral reconstruction
         enum class software
@@ -73,7 +89,11 @@ namespace ipk
             std::string binary_file;
             std::string tree_file;
             std::string alignment_file;
-            std::string num_threads;
+            size_t num_threads;
+
+            /// Column partitions of the alignment (see save_partitions), reconstructed
+            /// concurrently if there are several of them
+            std::vector<std::string> partition_files;
 
             /// User-defined arguments for the AR software
             std::string ar_parameters;
@@ -89,12 +109,17 @@ namespace ipk
                                                                 const std::string& ext_tree_file,
                                                                 const std::string& alignment_phylip);
 
+        /// Returns true if the results of ancestral reconstruction of the alignment files,
+        /// made by a previous run, are next to every one of them
+        bool has_results(ar::software software, const std::vector<std::string>& alignment_files);
+
         /// Run ancestral reconstruction
         std::tuple<proba_matrix, i2l::phylo_tree> ancestral_reconstruction(ar::software software,
-                                                                           const ar::parameters& parameters);
+                                                                           const ar::parameters& parameters,
+                                                                           build_metrics& metrics);
 
-        /// Maps node labels of the extended tree to the node labels of the AR tree
-        /// This mapping is needed to query proba_matrix.
+        /// Maps nodes of the extended tree to the node labels of the AR tree
+        /// This mapping is needed to query proba_matrix, see proba_matrix::index
         ar::mapping map_nodes(const i2l::phylo_tree& extended_tree, const i2l::phylo_tree& ar_tree);
 
         /// \brief Interface for lazy readers of ancestral reconstruction output.
@@ -106,6 +131,27 @@ namespace ipk
             virtual ipk::matrix read_node(const std::string& node_label) = 0;
         };
 
+        /// Creates a reader for the source: a file name, a command, etc. depending on the reader
+        using reader_factory = std::function<std::unique_ptr<reader>(const std::string& source)>;
+
+        /// \brief Registers a reader under the name, replacing the reader of the same name.
+        /// \details Built-in readers (see readers.h):
+        ///     phyml, raxml-ng     the outputs of ancestral reconstruction software
+        ///     matrix-cache        the binary matrix cache
+        ///     stream              the RAxML-NG format from a file, a named pipe or the standard input
+        ///     process             the RAxML-NG format from the standard output of a command
+        /// Thread-safe.
+        void register_reader(const std::string& name, reader_factory factory);
+
+        /// Creates the reader registered under the name
+        std::unique_ptr<reader> make_reader(const std::string& name, const std::string& source);
+
+        /// Creates the reader for the output of the software
+        std::unique_ptr<reader> make_reader(ar::software software, const std::string& filename);
+
+        /// The names of the registered readers, sorted
+        std::vector<std::string> reader_names();
+
     }
 
 }
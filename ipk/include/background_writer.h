@@ -0,0 +1,73 @@
+#ifndef IPK_BACKGROUND_WRITER_H
+#define IPK_BACKGROUND_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace ipk
+{
+    /// \brief Runs write tasks in a background thread, in the order of submission.
+    /// \details Every task declares the amount of memory it holds until it completes.
+    /// push blocks while the queued and running tasks hold more than max_bytes, so that
+    /// producers can not run ahead of the disk by more than that. A task larger than the
+    /// limit is accepted when the queue is empty. The first exception thrown by a task
+    /// is rethrown by push and finish; the tasks after it are discarded. Tasks are run one
+    /// by one as they are: writes of different tasks are not coalesced.
+    class background_writer
+    {
+    public:
+        using task = std::function<void()>;
+
+        /// Called with the memory of the tasks that did not complete: the failed one and
+        /// the discarded ones. Called from the writer, it must not call the writer
+        using discard_callback = std::function<void(size_t bytes)>;
+
+        explicit background_writer(size_t max_bytes, discard_callback on_discard = nullptr);
+        background_writer(const background_writer&) = delete;
+        background_writer(background_writer&&) = delete;
+        background_writer& operator=(const background_writer&) = delete;
+        background_writer& operator=(background_writer&&) = delete;
+
+        /// Waits for the running task. Queued tasks are discarded
+        ~background_writer() noexcept;
+
+        /// Enqueues the task. Blocks while the queue is full. The task is discarded if
+        /// a previous one failed
+        void push(size_t bytes, task write_task);
+
+        /// Waits for all the tasks to complete
+        void finish();
+
+    private:
+        void run();
+
+        void check_error() const;
+
+        /// Discards the queued tasks
+        void discard();
+
+        size_t _max_bytes;
+        discard_callback _on_discard;
+
+        mutable std::mutex _mutex;
+        std::condition_variable _not_full;
+        std::condition_variable _not_empty;
+        std::condition_variable _empty;
+
+        std::deque<std::pair<size_t, task>> _tasks;
+
+        /// Memory held by the queued tasks and the running one
+        size_t _bytes = 0;
+        bool _running = false;
+        bool _stopped = false;
+        std::exception_ptr _error;
+
+        std::thread _thread;
+    };
+}
+
+#endif
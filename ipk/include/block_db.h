@@ -0,0 +1,127 @@
+#ifndef IPK_BLOCK_DB_H
+#define IPK_BLOCK_DB_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <i2l/phylo_kmer.h>
+#include "flat_db.h"
+
+namespace ipk::blocks
+{
+    /// \brief The block database layout. All sections are aligned to 8 bytes:
+    ///     header
+    ///     tree          newick, header.tree_size bytes
+    ///     tree index    flat::node_record[header.tree_index_size]
+    ///     blocks        header.num_blocks blocks, each compressed separately
+    ///     block index   block_record[header.num_blocks]
+    /// A block holds consecutive k-mers in the order of filter values. Uncompressed,
+    /// it is a sequence of records
+    ///     key, filter value (float), number of entries (uint32), flat::entry[number of entries]
+    /// without padding. Blocks are independent, so they can be decompressed in parallel.
+    constexpr char magic[8] = { 'I', 'P', 'K', 'B', 'L', 'O', 'C', 'K' };
+    constexpr uint32_t version = 1;
+
+    /// The default size of uncompressed blocks
+    constexpr size_t default_block_size = 1 << 20;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+
+        char sequence_type[16];
+        uint32_t kmer_size;
+        float omega;
+        uint32_t keep_positions;
+
+        /// The zlib compression level, or zero if blocks are stored uncompressed
+        uint32_t compression_level;
+
+        uint64_t num_kmers;
+        uint64_t num_entries;
+
+        uint64_t tree_offset;
+        uint64_t tree_size;
+        uint64_t tree_index_offset;
+        uint64_t tree_index_size;
+        uint64_t blocks_offset;
+        uint64_t num_blocks;
+        uint64_t block_index_offset;
+    };
+
+    struct block_record
+    {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t uncompressed_size;
+        uint64_t num_kmers;
+    };
+
+    /// A k-mer read from a block
+    struct kmer_record
+    {
+        i2l::phylo_kmer::key_type key;
+        float filter_value;
+        std::vector<flat::entry> entries;
+    };
+
+    /// Compresses a block with zlib. Level zero returns the data as is
+    std::vector<char> compress(const std::vector<char>& data, int level);
+
+    /// Decompresses a block compressed with the level, see compress
+    std::vector<char> decompress(const char* data, size_t size, size_t uncompressed_size, int level);
+}
+
+namespace ipk
+{
+    /// \brief A read-only database in the block layout (see blocks::header), memory-mapped.
+    /// \details Blocks are decompressed on demand. read_block is thread-safe, so blocks
+    /// can be read by several threads at once.
+    class block_db
+    {
+    public:
+        explicit block_db(const std::string& filename);
+        block_db(const block_db&) = delete;
+        block_db(block_db&&) = delete;
+        block_db& operator=(const block_db&) = delete;
+        block_db& operator=(block_db&&) = delete;
+        ~block_db() noexcept = default;
+
+        /// Decompresses and parses the block
+        [[nodiscard]]
+        std::vector<blocks::kmer_record> read_block(size_t block_index) const;
+
+        [[nodiscard]]
+        size_t num_blocks() const noexcept;
+
+        [[nodiscard]]
+        const blocks::block_record& block(size_t block_index) const;
+
+        [[nodiscard]]
+        size_t size() const noexcept;
+
+        [[nodiscard]]
+        size_t kmer_size() const noexcept;
+
+        [[nodiscard]]
+        i2l::phylo_kmer::score_type omega() const noexcept;
+
+        [[nodiscard]]
+        std::string_view tree() const noexcept;
+
+        [[nodiscard]]
+        const flat::node_record* tree_index() const noexcept;
+
+    private:
+        boost::iostreams::mapped_file_source _file;
+
+        const blocks::header* _header;
+        const blocks::block_record* _blocks;
+    };
+}
+
+#endif
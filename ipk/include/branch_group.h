@@ -1,6 +1,11 @@
 #ifndef XPAS_BRANCH_GROUP_H
 #define XPAS_BRANCH_GROUP_H
 
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <i2l/hash_map.h>
 #include <i2l/phylo_kmer.h>
 #include <i2l/phylo_kmer_db.h>
@@ -23,19 +28,115 @@ namespace ipk
     using group_hash_map = hash_map<phylo_kmer::key_type, phylo_kmer::score_type>;
 #endif
 
-    void save_group_map(const group_hash_map& map, const std::string& filename);
+    /// The encoding of group hashmaps in spill files
+    enum class spill_codec
+    {
+        /// The Boost archive of the hashmap
+        archive,
+        /// Sorted keys as varint-encoded deltas, scores as floats
+        delta,
+        /// As delta, but scores are quantized to 16 bits between the threshold and zero.
+        /// Lossy: the error of a score is at most |log-threshold| / 131070
+        quantized
+    };
 
-    group_hash_map load_group_map(const std::string& filename);
+    /// Parses a codec name: "archive", "delta" or "quantized"
+    spill_codec parse_spill_codec(const std::string& name);
+
+    /// \brief Serializes a hash map.
+    /// \param log_threshold The lowest possible score, used by spill_codec::quantized
+    std::string save_group_map(const group_hash_map& map, spill_codec codec = spill_codec::archive,
+                               phylo_kmer::score_type log_threshold = 0);
+
+    /// Deserializes a hash map serialized by save_group_map with any codec
+    group_hash_map load_group_map(const char* data, size_t size);
+
+    /// Estimated memory of a hash map in bytes
+    size_t memory_usage(const group_hash_map& map);
 
     std::string get_groups_dir(const std::string& working_dir);
 
-    /// \brief Returns a filename of the group hashmap
-    std::string get_group_map_file(const std::string& working_dir,
-                                   const phylo_kmer::branch_type& group, size_t batch_idx);
+    /// \brief Returns the filename of the spill file of the batch, see spill_file
+    std::string get_spill_file(const std::string& working_dir, size_t batch_idx);
+
+    /// The serialized hashmap of one group in a spill file
+    struct spill_segment
+    {
+        phylo_kmer::branch_type group;
+        uint64_t offset;
+        uint64_t size;
+
+        /// The number of k-mers in the hashmap
+        uint64_t num_entries;
+    };
+
+    /// Segments of a spill file by group
+    using spill_index = std::unordered_map<phylo_kmer::branch_type, spill_segment>;
+
+    /// \brief An append-only file of the group hashmaps of one batch.
+    /// \details Every group is one segment of the file. Segments are listed in the index file
+    /// next to it (the spill file name + ".index"), one line "group offset size entries" per segment, written after the
+    /// segment. A segment written partially by an interrupted run is not in the index and is
+    /// ignored. Hashmaps are serialized by the caller, and only the append is serialized
+    /// between threads: one unbuffered write of the segment, then its line of the index,
+    /// flushed. Thread-safe.
+    class spill_file
+    {
+    public:
+        /// Opens the spill file of the batch. If resume is false, the file is truncated
+        spill_file(const std::string& filename, bool resume);
+        spill_file(const spill_file&) = delete;
+        spill_file(spill_file&&) = delete;
+        spill_file& operator=(const spill_file&) = delete;
+        spill_file& operator=(spill_file&&) = delete;
+        ~spill_file() noexcept = default;
+
+        /// Appends a serialized hashmap of the group with num_entries k-mers
+        /// \return The number of bytes written
+        size_t append(phylo_kmer::branch_type group, const std::string& data, size_t num_entries);
 
-    /// Merges hashmaps of the same index into a database
+    private:
+        std::mutex _mutex;
+        std::ofstream _data;
+        std::ofstream _index;
+        uint64_t _size;
+    };
+
+    /// \brief Loads the index of a spill file. If a group has several segments, the last one
+    /// is taken
+    spill_index load_spill_index(const std::string& filename);
+
+    /// Reads the segment of the group from a spill file
+    std::string read_segment(const std::string& filename, const spill_segment& segment);
+
+    /// \brief The total size in bytes and the total number of entries of the segments of the
+    /// batch. Segments of the group group_ids[i] are taken from working_dirs[i]
+    std::pair<size_t, size_t> get_spill_size(const std::vector<std::string>& working_dirs,
+                                             const std::vector<phylo_kmer::branch_type>& group_ids,
+                                             size_t batch_idx);
+
+    /// \brief A part of a batch. A batch that does not fit in memory is split in parts
+    /// by the k-mer value: (key / num_batches) % num_parts
+    struct batch_part
+    {
+        size_t num_batches = 1;
+        size_t index = 0;
+        size_t num_parts = 1;
+
+        [[nodiscard]]
+        bool contains(phylo_kmer::key_type key) const;
+    };
+
+    /// Merges hashmaps of the same index into a database. Only the k-mers of the part are taken
     i2l::phylo_kmer_db merge_batch(const std::string& working_dir,
-                                    const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx);
+                                    const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx,
+                                    const batch_part& part = {});
+
+    /// Merges hashmaps of the same index into a database. Hashmaps of the group
+    /// group_ids[i] are taken from working_dirs[i]. Only the k-mers of the part are taken
+    i2l::phylo_kmer_db merge_batch(const std::vector<std::string>& working_dirs,
+                                    const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx,
+                                    const batch_part& part = {});
 
     /// Puts a kmer in the hash. Takes a maximum score between the existing value
     /// of the k-mer (if any) and the provided value.
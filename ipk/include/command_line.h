@@ -4,6 +4,7 @@
 #include <exception>
 #include <string>
 #include <map>
+#include <vector>
 #include <i2l/phylo_kmer.h>
 #include <pk_compute.h>
 
@@ -12,7 +13,8 @@ namespace ipk::cli
     enum class action_t
     {
         build = 0,
-        help = 2
+        help = 2,
+        merge_shards = 3
     };
 
     struct parameters
@@ -31,6 +33,8 @@ namespace ipk::cli
         std::string ar_model;
         double ar_alpha;
         int ar_categories;
+        /// The number of column partitions of the alignment reconstructed concurrently
+        size_t ar_partitions;
         bool ar_only;
         /// Arbitrary AR parameters passed transparently to the software
         std::string ar_parameters;
@@ -38,8 +42,9 @@ namespace ipk::cli
         /// Main parameters
         double reduction_ratio;
         bool no_reduction;
-        size_t kmer_size;
-        i2l::phylo_kmer::score_type omega;
+        /// A database is built for every combination of k and omega
+        std::vector<size_t> kmer_sizes;
+        std::vector<i2l::phylo_kmer::score_type> omegas;
         size_t num_threads;
 
         bool merge_branches;
@@ -82,6 +87,46 @@ namespace ipk::cli
 
         // output verbosity
         bool verbose;
+
+        // a file to write construction metrics in JSON, if not empty
+        std::string metrics_json;
+
+        // a file to write the per-group cost profile in JSON, if not empty
+        std::string profile;
+
+        // the number of the most expensive groups to report in the profile
+        size_t profile_top;
+
+        // the order of parallel exploration of branch groups: tree, longest-first
+        std::string schedule;
+
+        // continue an interrupted on-disk build in the same working directory
+        bool resume;
+
+        // explore only the shard shard_index of num_shards (--shard i/N). Zero shards means all branches
+        size_t shard_index;
+        size_t num_shards;
+
+        // the layout of the output database: ipk, flat, blocks
+        std::string format;
+
+        // the zlib compression level of the blocks layout
+        int compression_level;
+
+        // the encoding of spill files of on-disk builds: archive, delta, quantized
+        std::string spill_codec;
+
+        // the memory budget in bytes (--max-ram), zero for none
+        size_t max_ram;
+
+        // keep group hashmaps of an on-disk build for a later update
+        bool keep_groups;
+
+        // the working directory of a previous on-disk build to update, if not empty
+        std::string update_from;
+
+        // working directories of the shard builds to merge (merge-shards)
+        std::vector<std::string> shard_directories;
     };
 
     std::string get_option_list();
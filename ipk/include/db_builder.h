@@ -2,9 +2,13 @@
 #define IPK_DB_BUILDER_H
 
 #include <string>
+#include <vector>
 #include <i2l/phylo_kmer_db.h>
 #include "extended_tree.h"
 #include "ar.h"
+#include "scheduler.h"
+#include "db_writer.h"
+#include "branch_group.h"
 
 namespace i2l
 {
@@ -18,15 +22,94 @@ namespace ipk
     enum class filter_type;
     enum class algorithm;
     enum class ghost_strategy;
+    class build_metrics;
 
+    /// \brief Options of the database construction that have reasonable defaults
+    struct build_options
+    {
+        /// The order in which groups of ghost nodes are explored in parallel
+        schedule_policy schedule = schedule_policy::longest_first;
+
+        /// The layout of the output database
+        db_format format = db_format::ipk;
+
+        /// The zlib compression level of the block layout, from 1 to 9. Zero stores blocks
+        /// uncompressed
+        int compression_level = 6;
+
+        /// The maximum amount of memory held by group hashmaps waiting to be written
+        /// on disk. Exploration threads wait when it is reached
+        size_t write_buffer_size = size_t(256) << 20;
+
+        /// The encoding of group hashmaps in spill files of the on-disk construction
+        spill_codec spill = spill_codec::archive;
+
+        /// The memory budget in bytes, zero for none. A build in RAM that exceeds it continues
+        /// on disk, and batches of the on-disk merge that would exceed it are split in parts.
+        /// Memory is estimated, see memory_tracker
+        size_t max_ram = 0;
+
+        /// Skip the groups and batches completed by a previous run with the same
+        /// parameters. Only for the on-disk construction
+        bool resume = false;
+
+        /// Explore only the groups of the shard shard_index out of num_shards. The groups
+        /// are distributed round-robin in the order of the tree traversal. A shard build
+        /// keeps the group hashmaps in the working directory and does not write a database,
+        /// see merge_shards. Zero shards means a regular build
+        size_t shard_index = 0;
+        size_t num_shards = 0;
+
+        /// Keep the group hashmaps and the journal of an on-disk build in the working
+        /// directory, so that the database can be updated later, see update_from
+        bool keep_groups = false;
+
+        /// The working directory of a previous on-disk build with the same parameters and
+        /// kept group hashmaps. Groups whose probability matrices did not change are not
+        /// explored again: their hashmaps are copied from the previous build
+        std::string update_from;
+    };
+
+    /// \brief Builds a database for every combination of k and omega.
+    /// \details The probability matrices are loaded once for all databases. If there are several
+    /// databases, each of them is written to the output file name with the suffix _k<k>_o<omega>
+    /// and uses the subdirectory k<k>_o<omega> of the working directory.
     void build(const std::string& working_directory, const std::string& output_filename,
                const i2l::phylo_tree& original_tree, const i2l::phylo_tree& extended_tree,
                proba_matrix& matrix,
                const ghost_mapping& mapping, const ar::mapping& ar_mapping, bool merge_branches,
                ipk::algorithm algorithm, ipk::ghost_strategy strategy,
-               size_t kmer_size, i2l::phylo_kmer::score_type omega,
+               const std::vector<size_t>& kmer_sizes, const std::vector<i2l::phylo_kmer::score_type>& omegas,
                filter_type filter, double mu,
-               size_t num_threads, bool on_disk);
+               size_t num_threads, bool on_disk,
+               const build_options& options, build_metrics& metrics);
+
+    /// \brief Merges the group hashmaps computed by shard builds (see build_options::num_shards)
+    /// into a database.
+    /// \details Every shard directory is the working directory of a completed shard build.
+    /// The shards must be built with the same parameters and cover all the shards 0..N-1.
+    /// Parameters of the database are taken from the shard journals.
+    void merge_shards(const std::vector<std::string>& shard_directories,
+                      const std::string& working_directory, const std::string& output_filename,
+                      const build_options& options, build_metrics& metrics);
+
+    /// \brief Builds one database for the k and omega without an output file.
+    /// \details If there is no sink, the database is returned with the k-mers sorted by filter
+    /// values (see phylo_kmer_db::kmer_order) and nothing is written on disk. Otherwise,
+    /// the database is written to the sink and an empty database is returned. The filesystem
+    /// is used only to spill: with a sink and a working directory, a build that exceeds
+    /// the memory budget continues on disk in the working directory, as build does.
+    /// Shards, resuming and updating builds are not supported.
+    i2l::phylo_kmer_db build_in_memory(const std::string& working_directory,
+                                       const i2l::phylo_tree& original_tree, const i2l::phylo_tree& extended_tree,
+                                       proba_matrix& matrix,
+                                       const ghost_mapping& mapping, const ar::mapping& ar_mapping,
+                                       bool merge_branches,
+                                       ipk::algorithm algorithm, ipk::ghost_strategy strategy,
+                                       size_t kmer_size, i2l::phylo_kmer::score_type omega,
+                                       filter_type filter, double mu, size_t num_threads,
+                                       const build_options& options, build_metrics& metrics,
+                                       db_writer* sink);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef IPK_DB_WRITER_H
+#define IPK_DB_WRITER_H
+
+#include <memory>
+#include <string>
+#include <i2l/phylo_kmer_db.h>
+#include <i2l/serialization.h>
+
+namespace ipk
+{
+    /// The layout of the output database
+    enum class db_format
+    {
+        /// The Boost archive of i2l, loaded with i2l::load
+        ipk,
+        /// The flat layout to be memory-mapped and queried without parsing, see flat_db
+        flat,
+        /// Blocks of k-mers compressed independently in parallel, see block_db
+        blocks
+    };
+
+    /// Parses a format name: "ipk", "flat" or "blocks"
+    db_format parse_db_format(const std::string& name);
+
+    /// \brief Serializes a database: the header first, then k-mers in the order of filter values
+    class db_writer
+    {
+    public:
+        virtual ~db_writer() noexcept = default;
+
+        virtual void write_header(const i2l::ipk_header& header) = 0;
+
+        virtual void write_kmer(i2l::phylo_kmer::key_type key, float filter_value,
+                                const i2l::pkdb_value_vector& entries) = 0;
+
+        /// Finishes the output. Returns its size in bytes
+        virtual size_t close() = 0;
+    };
+
+    /// \brief Opens the output file for writing.
+    /// \details The block layout is compressed with the zlib level (zero means no compression)
+    /// by up to num_threads threads. Other layouts ignore both parameters.
+    std::unique_ptr<db_writer> make_db_writer(db_format format, const std::string& filename,
+                                              size_t num_threads, int compression_level);
+}
+
+#endif
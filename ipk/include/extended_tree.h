@@ -1,17 +1,47 @@
 #ifndef XPAS_TREE_H
 #define XPAS_TREE_H
 
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
 #include <i2l/phylo_kmer.h>
 #include <i2l/phylo_tree.h>
 
 
 namespace ipk
 {
-    using ghost_mapping = std::unordered_map<std::string, i2l::phylo_kmer::branch_type>;
+    /// The kind of a node of the extended tree
+    enum class ghost_kind : uint8_t
+    {
+        /// A node of the original tree, or one of the X2, X3 leaves
+        none,
+        /// X0, inserted on the original branch
+        inner,
+        /// X1, the root of the ghost subtree
+        outer
+    };
+
+    /// \brief Maps the ghost nodes of the extended tree to the original tree. Vectors are indexed
+    /// by the post-order id of the node in the extended tree
+    struct ghost_mapping
+    {
+        static constexpr i2l::phylo_kmer::branch_type no_original_id =
+            std::numeric_limits<i2l::phylo_kmer::branch_type>::max();
+
+        std::vector<ghost_kind> kinds;
+
+        /// The post-order id of the original node of the branch of a ghost node (X0, X1),
+        /// no_original_id for other nodes
+        std::vector<i2l::phylo_kmer::branch_type> original_ids;
+    };
 
     /// Read and preprocess a phylogentic tree
     std::tuple<i2l::phylo_tree, i2l::phylo_tree, ghost_mapping> preprocess_tree(const std::string& filename, bool use_unrooted);
 
+    /// Preprocess a phylogenetic tree loaded by the caller
+    std::tuple<i2l::phylo_tree, i2l::phylo_tree, ghost_mapping> preprocess_tree(i2l::phylo_tree tree, bool use_unrooted);
+
     /// Reroot tree if needed
     /// changes the tree from (a, b, c); to ((b, c), a);
     void reroot_tree(i2l::phylo_tree& tree);
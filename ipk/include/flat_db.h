@@ -0,0 +1,151 @@
+#ifndef IPK_FLAT_DB_H
+#define IPK_FLAT_DB_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <i2l/phylo_kmer.h>
+
+namespace ipk::flat
+{
+    /// \brief The flat database layout. All sections are aligned to 8 bytes:
+    ///     header
+    ///     tree          newick, header.tree_size bytes
+    ///     tree index    node_record[header.tree_index_size]
+    ///     entries       entry[header.num_entries], grouped by k-mer in the order of filter values
+    ///     index         index_record[header.num_kmers], sorted by k-mer
+    /// Since the entries are in the order of filter values, the entries of the best
+    /// k-mers form a prefix of the entries section.
+    constexpr char magic[8] = { 'I', 'P', 'K', 'F', 'L', 'A', 'T', '\0' };
+    constexpr uint32_t version = 1;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+
+        char sequence_type[16];
+        uint32_t kmer_size;
+        float omega;
+        uint32_t keep_positions;
+        uint32_t reserved;
+
+        uint64_t num_kmers;
+        uint64_t num_entries;
+
+        uint64_t tree_offset;
+        uint64_t tree_size;
+        uint64_t tree_index_offset;
+        uint64_t tree_index_size;
+        uint64_t entries_offset;
+        uint64_t index_offset;
+    };
+
+    /// See i2l::phylo_node::node_index
+    struct node_record
+    {
+        uint64_t subtree_num_nodes;
+        double subtree_total_length;
+    };
+
+    struct index_record
+    {
+        i2l::phylo_kmer::key_type key;
+
+        /// The index of the first entry of the k-mer in the entries section
+        uint64_t first_entry;
+        uint32_t num_entries;
+        float filter_value;
+    };
+
+    struct entry
+    {
+        i2l::phylo_kmer::branch_type branch;
+        i2l::phylo_kmer::score_type score;
+#ifdef KEEP_POSITIONS
+        i2l::phylo_kmer::pos_type position;
+#endif
+    };
+
+    /// Entries of one k-mer
+    class entry_range
+    {
+    public:
+        entry_range(const entry* first, const entry* last) noexcept;
+
+        [[nodiscard]]
+        const entry* begin() const noexcept;
+
+        [[nodiscard]]
+        const entry* end() const noexcept;
+
+        [[nodiscard]]
+        size_t size() const noexcept;
+
+        [[nodiscard]]
+        bool empty() const noexcept;
+
+    private:
+        const entry* _first;
+        const entry* _last;
+    };
+}
+
+namespace ipk
+{
+    /// \brief A read-only database in the flat layout (see flat::header), memory-mapped.
+    /// \details Opening the database only checks the header, nothing is parsed or copied.
+    /// K-mers are searched in the index by binary search, and the index record of the k-mer
+    /// found is checked against the entries section.
+    class flat_db
+    {
+    public:
+        explicit flat_db(const std::string& filename);
+        flat_db(const flat_db&) = delete;
+        flat_db(flat_db&&) = delete;
+        flat_db& operator=(const flat_db&) = delete;
+        flat_db& operator=(flat_db&&) = delete;
+        ~flat_db() noexcept = default;
+
+        /// Returns the entries of the k-mer, or an empty range if it is not in the database
+        [[nodiscard]]
+        flat::entry_range search(i2l::phylo_kmer::key_type key) const;
+
+        /// K-mers sorted by key. Records are not checked, see search
+        [[nodiscard]]
+        const flat::index_record* begin() const noexcept;
+
+        [[nodiscard]]
+        const flat::index_record* end() const noexcept;
+
+        /// All entries in the order of filter values of k-mers
+        [[nodiscard]]
+        flat::entry_range entries() const noexcept;
+
+        [[nodiscard]]
+        size_t size() const noexcept;
+
+        [[nodiscard]]
+        size_t kmer_size() const noexcept;
+
+        [[nodiscard]]
+        i2l::phylo_kmer::score_type omega() const noexcept;
+
+        [[nodiscard]]
+        std::string_view tree() const noexcept;
+
+        [[nodiscard]]
+        const flat::node_record* tree_index() const noexcept;
+
+    private:
+        boost::iostreams::mapped_file_source _file;
+
+        const flat::header* _header;
+        const flat::index_record* _index;
+        const flat::entry* _entries;
+    };
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef IPK_JOURNAL_H
+#define IPK_JOURNAL_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <i2l/phylo_kmer.h>
+
+namespace ipk
+{
+    /// \brief A journal of the on-disk database construction. Records the parameters of the
+    /// build, the groups whose hashmaps are completely saved in the spill files and
+    /// the batches whose databases are completely saved (<batch>.ipk, and <batch>_<part>.ipk
+    /// if the batch is split in parts).
+    /// \details The journal is a text file, one record per line:
+    ///     param <name> <value>
+    ///     group <postorder id> <number of explored phylo-k-mers> <digest of the matrices in hex>
+    ///     batch <batch id> <number of k-mers> <number of entries> <number of parts>
+    /// Every record is flushed as soon as it is written, so that an interrupted build can be
+    /// resumed from the last completed group or batch. Incomplete lines are ignored.
+    /// Adding records is thread-safe.
+    class build_journal
+    {
+    public:
+        using branch_type = i2l::phylo_kmer::branch_type;
+        using parameter_list = std::vector<std::pair<std::string, std::string>>;
+
+        struct batch_record
+        {
+            size_t num_kmers;
+            size_t num_entries;
+            size_t num_parts;
+        };
+
+        build_journal() = default;
+        build_journal(const build_journal&) = delete;
+        build_journal(build_journal&&) = delete;
+        build_journal& operator=(const build_journal&) = delete;
+        build_journal& operator=(build_journal&&) = delete;
+        ~build_journal() noexcept = default;
+
+        /// \brief Opens the journal file.
+        /// \details If resume is set and the file exists, loads the records and checks that
+        /// the parameters are the same. Throws std::runtime_error otherwise. If resume is not set,
+        /// starts a new journal.
+        /// \return true if some finished work was found
+        bool open(const std::string& filename, const parameter_list& parameters, bool resume);
+
+        /// \brief Loads the records of an existing journal without opening it for writing
+        void read(const std::string& filename);
+
+        /// Parameters of the build, as read by read()
+        [[nodiscard]]
+        const parameter_list& parameters() const;
+
+        /// Completed groups and the numbers of explored phylo-k-mers
+        [[nodiscard]]
+        const std::unordered_map<branch_type, size_t>& groups() const;
+
+        /// Digests of the probability matrices of completed groups
+        [[nodiscard]]
+        const std::unordered_map<branch_type, uint64_t>& digests() const;
+
+        /// Returns the number of explored phylo-k-mers if the group is completed
+        [[nodiscard]]
+        std::optional<size_t> get_group(branch_type postorder_id) const;
+
+        void add_group(branch_type postorder_id, size_t num_explored, uint64_t digest);
+
+        /// Returns the counts of the batch if it is completed
+        [[nodiscard]]
+        std::optional<batch_record> get_batch(size_t batch_id) const;
+
+        void add_batch(size_t batch_id, size_t num_kmers, size_t num_entries, size_t num_parts = 1);
+
+        [[nodiscard]]
+        size_t num_groups() const;
+
+        [[nodiscard]]
+        size_t num_batches() const;
+
+    private:
+        void load(const std::string& filename);
+
+        /// Throws if the parameters are different from those loaded
+        void check(const std::string& filename, const parameter_list& parameters) const;
+
+        void write(const std::string& record);
+
+        std::ofstream _out;
+        mutable std::mutex _mutex;
+
+        parameter_list _parameters;
+        std::unordered_map<branch_type, size_t> _groups;
+        std::unordered_map<branch_type, uint64_t> _digests;
+        std::unordered_map<size_t, batch_record> _batches;
+    };
+
+    /// 64-bit FNV-1a hash, used to fingerprint inputs of the build
+    uint64_t fnv1a(const std::string& data);
+
+    /// 64-bit FNV-1a hash of raw bytes. Continues the hash of preceding data if given
+    uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef IPK_JSON_H
+#define IPK_JSON_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+namespace ipk
+{
+    /// \brief A minimal streaming JSON writer for machine-readable reports.
+    /// \details Takes care of commas, indentation and string escaping. It does not
+    /// validate the structure of the document: it is up to the caller to
+    /// balance begin_* / end_* calls and to call key() inside objects only.
+    class json_writer
+    {
+    public:
+        explicit json_writer(std::ostream& out);
+        json_writer(const json_writer&) = delete;
+        json_writer(json_writer&&) = delete;
+        json_writer& operator=(const json_writer&) = delete;
+        json_writer& operator=(json_writer&&) = delete;
+        ~json_writer() noexcept = default;
+
+        json_writer& begin_object();
+        json_writer& end_object();
+
+        json_writer& begin_array();
+        json_writer& end_array();
+
+        /// Writes the name of the next field of the current object
+        json_writer& key(const std::string& name);
+
+        json_writer& value(const std::string& value);
+        json_writer& value(const char* value);
+        json_writer& value(bool value);
+        json_writer& value(double value);
+
+        template<class T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+        json_writer& value(T value)
+        {
+            before_value();
+            _out << value;
+            return *this;
+        }
+
+        /// A shortcut for key(name).value(value)
+        template<class T>
+        json_writer& field(const std::string& name, const T& value)
+        {
+            key(name);
+            return this->value(value);
+        }
+
+    private:
+        /// Writes a separator and indentation if needed
+        void before_value();
+
+        void indent();
+
+        void write_string(const std::string& value);
+
+        std::ostream& _out;
+
+        /// For every open object or array, whether it has no elements yet
+        std::vector<bool> _first;
+
+        /// True if the last thing written was a key
+        bool _after_key;
+    };
+}
+
+#endif
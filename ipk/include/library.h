@@ -0,0 +1,115 @@
+#ifndef IPK_LIBRARY_H
+#define IPK_LIBRARY_H
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <i2l/phylo_kmer_db.h>
+#include <i2l/phylo_tree.h>
+#include "ar.h"
+#include "db_builder.h"
+#include "db_writer.h"
+#include "extended_tree.h"
+#include "filter.h"
+#include "metrics.h"
+#include "pk_compute.h"
+
+namespace ipk
+{
+    /// \brief Parameters of database_builder. The defaults are the defaults of the command line
+    struct library_parameters
+    {
+        size_t kmer_size = 8;
+        i2l::phylo_kmer::score_type omega = 1.5;
+
+        filter_type filter = filter_type::mif0;
+        double mu = 0.8;
+
+        ipk::algorithm algorithm = ipk::algorithm::DCCW;
+        ipk::ghost_strategy ghost_strategy = ipk::ghost_strategy::BOTH;
+        bool merge_branches = false;
+
+        /// Accept unrooted reference trees
+        bool use_unrooted = false;
+
+        size_t num_threads = 1;
+
+        /// The order in which groups of ghost nodes are explored in parallel
+        schedule_policy schedule = schedule_policy::longest_first;
+
+        /// The memory budget in bytes, zero for none. See build_options::max_ram
+        size_t max_ram = 0;
+
+        /// The directory to spill to if max_ram is exceeded while building into a sink.
+        /// Empty means the filesystem is never used and the budget is not enforced
+        std::string spill_directory;
+
+        /// The encoding of group hashmaps in the spill directory
+        spill_codec spill = spill_codec::archive;
+
+        /// The maximum amount of memory held by group hashmaps waiting to be spilled
+        size_t write_buffer_size = build_options{}.write_buffer_size;
+    };
+
+    /// \brief Builds databases in memory, for programs that link IPK as a library.
+    /// \details The reference tree is extended with ghost nodes on construction. The caller
+    /// runs ancestral reconstruction on extended_tree() with an alignment extended accordingly
+    /// (see extend_alignment), and gives the results to build as an ar::reader. Nothing is
+    /// written on disk, unless a spill directory is set.
+    class database_builder
+    {
+    public:
+        database_builder(i2l::phylo_tree tree, library_parameters parameters);
+        database_builder(const database_builder&) = delete;
+        database_builder(database_builder&&) = delete;
+        database_builder& operator=(const database_builder&) = delete;
+        database_builder& operator=(database_builder&&) = delete;
+        ~database_builder() noexcept = default;
+
+        /// The reference tree, as it is given
+        [[nodiscard]]
+        const i2l::phylo_tree& original_tree() const noexcept;
+
+        /// The tree to run ancestral reconstruction on
+        [[nodiscard]]
+        const i2l::phylo_tree& extended_tree() const noexcept;
+
+        /// \brief Builds the database and returns it, with k-mers sorted by filter values.
+        /// \param reader Reads the matrices of the nodes of ar_tree by their labels
+        /// \param ar_tree The tree output by the ancestral reconstruction. Its topology is the one
+        /// of extended_tree(), but inner nodes can be renamed
+        [[nodiscard]]
+        i2l::phylo_kmer_db build(std::unique_ptr<ar::reader> reader, i2l::phylo_tree& ar_tree);
+
+        /// Same as above for the readers that take the labels of extended_tree()
+        [[nodiscard]]
+        i2l::phylo_kmer_db build(std::unique_ptr<ar::reader> reader);
+
+        /// \brief Builds the database and writes it to the sink. Only the sink builds can spill,
+        /// see library_parameters::spill_directory
+        void build(std::unique_ptr<ar::reader> reader, i2l::phylo_tree& ar_tree, db_writer& sink);
+
+        /// Same as above for the readers that take the labels of extended_tree()
+        void build(std::unique_ptr<ar::reader> reader, db_writer& sink);
+
+        /// Metrics of the last build
+        [[nodiscard]]
+        const build_metrics& metrics() const noexcept;
+
+    private:
+        database_builder(std::tuple<i2l::phylo_tree, i2l::phylo_tree, ghost_mapping> trees,
+                         library_parameters parameters);
+
+        i2l::phylo_kmer_db run(std::unique_ptr<ar::reader> reader, const i2l::phylo_tree& ar_tree, db_writer* sink);
+
+        library_parameters _parameters;
+
+        i2l::phylo_tree _original_tree;
+        i2l::phylo_tree _extended_tree;
+        ghost_mapping _ghost_mapping;
+
+        std::unique_ptr<build_metrics> _metrics;
+    };
+}
+
+#endif
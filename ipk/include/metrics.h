@@ -0,0 +1,272 @@
+#ifndef IPK_METRICS_H
+#define IPK_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace ipk
+{
+    /// Top-level stages of the database construction
+    enum class stage
+    {
+        ancestral_reconstruction = 0,
+        computation = 1,
+        filtering = 2,
+        merge = 3
+    };
+
+    /// Sub-stages of the database construction. The same sub-stage
+    /// can be a part of different stages, e.g. temp_io
+    enum class substage
+    {
+        /// The stage itself
+        total = 0,
+        ar_run = 1,
+        ar_indexing = 2,
+        matrix_parse = 3,
+        enumeration = 4,
+        hashing = 5,
+        temp_io = 6,
+        filter = 7,
+        sort = 8,
+        serialize = 9
+    };
+
+    /// Major consumers of memory of the database construction
+    enum class memory_component
+    {
+        /// Probability matrices loaded from the results of ancestral reconstruction
+        matrices = 0,
+        /// Group hashmaps explored, but not yet inserted in the database or written on disk
+        group_maps = 1,
+        /// The database in RAM, or the database of a batch
+        database = 2,
+        /// Filter values of k-mers, see phylo_kmer_db::kmer_order
+        kmer_order = 3,
+        /// Spill files of a batch mapped to memory for the merge
+        merge_buffers = 4
+    };
+
+    /// \brief Memory used by the major consumers, with the peak per component and in total.
+    /// \details Sizes are estimated by callers from the number of elements, they are not
+    /// measured allocations. A budget, if any, is not enforced here: callers check
+    /// over_budget() and available() to adapt. Thread-safe.
+    class memory_tracker
+    {
+    public:
+        static constexpr size_t num_components = 5;
+
+        memory_tracker() = default;
+        memory_tracker(const memory_tracker&) = delete;
+        memory_tracker(memory_tracker&&) = delete;
+        memory_tracker& operator=(const memory_tracker&) = delete;
+        memory_tracker& operator=(memory_tracker&&) = delete;
+        ~memory_tracker() noexcept = default;
+
+        void add(memory_component component, size_t bytes);
+        void release(memory_component component, size_t bytes);
+
+        /// The total memory in use
+        [[nodiscard]]
+        size_t current() const;
+
+        [[nodiscard]]
+        size_t current(memory_component component) const;
+
+        [[nodiscard]]
+        size_t peak() const;
+
+        [[nodiscard]]
+        size_t peak(memory_component component) const;
+
+        /// Sets the budget in bytes. Zero means no budget
+        void set_budget(size_t bytes);
+
+        [[nodiscard]]
+        size_t budget() const;
+
+        /// Returns true if there is a budget and the memory in use exceeds it
+        [[nodiscard]]
+        bool over_budget() const;
+
+        /// The memory left within the budget. The maximum of size_t if there is no budget
+        [[nodiscard]]
+        size_t available() const;
+
+    private:
+        std::array<std::atomic<size_t>, num_components> _current{};
+        std::array<std::atomic<size_t>, num_components> _peak{};
+        std::atomic<size_t> _total = 0;
+        std::atomic<size_t> _peak_total = 0;
+        std::atomic<size_t> _budget = 0;
+    };
+
+    /// \brief Construction cost of a group of ghost nodes that correspond to one original node
+    struct group_record
+    {
+        /// Post-order id of the original node
+        size_t postorder_id;
+
+        /// The number of ghost nodes in the group
+        size_t num_nodes;
+
+        /// The number of windows explored over all ghost nodes
+        size_t num_windows;
+
+        /// Phylo-k-mers produced by the enumeration
+        size_t num_emitted;
+
+        /// Distinct k-mers of the group after taking the maximum score, see ipk::put
+        size_t num_distinct;
+
+        /// Total time of the group exploration, including the matrix load time
+        std::chrono::nanoseconds time;
+
+        /// Time to load the probability matrices of the group
+        std::chrono::nanoseconds matrix_load_time;
+    };
+
+    /// \brief Machine-readable metrics of the database construction: wall and CPU time
+    /// per stage and sub-stage, phylo-k-mer counters, I/O volume and peak memory.
+    /// \details Counters are always collected since they are cheap. Timings of
+    /// fine-grained sub-stages (per window) are collected only if the metrics are enabled.
+    /// Stage timings use the process CPU time, sub-stage timings use the CPU time of the
+    /// calling thread and are summed up over threads. Accumulation is thread-safe.
+    class build_metrics
+    {
+    public:
+        /// \brief Measures the time of the scope it lives in
+        class timer
+        {
+        public:
+            timer(build_metrics* metrics, ipk::stage stage, ipk::substage substage);
+            timer(const timer&) = delete;
+            timer(timer&& other) noexcept;
+            timer& operator=(const timer&) = delete;
+            timer& operator=(timer&&) = delete;
+            ~timer() noexcept;
+
+            /// Stops the timer before the end of the scope
+            void stop();
+
+        private:
+            build_metrics* _metrics;
+            ipk::stage _stage;
+            ipk::substage _substage;
+            std::chrono::steady_clock::time_point _wall_begin;
+            std::chrono::nanoseconds _cpu_begin;
+        };
+
+        static constexpr size_t num_stages = 4;
+        static constexpr size_t num_substages = 10;
+
+        explicit build_metrics(bool enabled);
+        build_metrics(const build_metrics&) = delete;
+        build_metrics(build_metrics&&) = delete;
+        build_metrics& operator=(const build_metrics&) = delete;
+        build_metrics& operator=(build_metrics&&) = delete;
+        ~build_metrics() noexcept = default;
+
+        /// Returns true if fine-grained timings are collected
+        [[nodiscard]]
+        bool enabled() const;
+
+        /// Starts a timer for the stage (substage::total) or a sub-stage of it
+        [[nodiscard]]
+        timer measure(ipk::stage stage, ipk::substage substage = substage::total);
+
+        void add_time(ipk::stage stage, ipk::substage substage,
+                      std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu);
+
+        /// Phylo-k-mers produced by the enumeration, before any deduplication
+        void add_explored(size_t num_kmers);
+
+        /// Phylo-k-mers left after taking the maximum score per k-mer in every group
+        void add_hashed(size_t num_kmers);
+
+        /// K-mers and entries in the resulting database of the target. A build of several
+        /// combinations of k and omega has a target per database, see get_target_name
+        void set_stored(const std::string& target, size_t num_kmers, size_t num_entries);
+
+        void set_num_batches(const std::string& target, size_t num_batches);
+        void set_batch(const std::string& target, size_t batch_id, size_t num_kmers, size_t num_entries);
+
+        void add_bytes_written(size_t bytes);
+        void add_bytes_read(size_t bytes);
+
+        void add_group(const group_record& record);
+
+        [[nodiscard]]
+        memory_tracker& memory();
+
+        [[nodiscard]]
+        const memory_tracker& memory() const;
+
+        /// Writes the metrics in JSON
+        void save(const std::string& filename) const;
+
+        /// Writes per-group records in JSON: all of them in the order of exploration and
+        /// the top most expensive ones
+        void save_profile(const std::string& filename, size_t top) const;
+
+        /// Prints a human-readable table of the top most expensive groups
+        void print_profile(std::ostream& out, size_t top) const;
+
+        /// Prints the peak memory of every component
+        void print_memory(std::ostream& out) const;
+
+    private:
+        struct timing
+        {
+            std::atomic<int64_t> wall_ns = 0;
+            std::atomic<int64_t> cpu_ns = 0;
+        };
+
+        struct batch_counts
+        {
+            size_t num_kmers = 0;
+            size_t num_entries = 0;
+        };
+
+        /// Counters of one database of the build
+        struct target_counts
+        {
+            size_t num_stored_kmers = 0;
+            size_t num_stored_entries = 0;
+            std::vector<batch_counts> batches;
+        };
+
+        bool _enabled;
+
+        std::array<std::array<timing, num_substages>, num_stages> _timings;
+
+        std::atomic<size_t> _num_explored = 0;
+        std::atomic<size_t> _num_hashed = 0;
+
+        std::atomic<size_t> _bytes_written = 0;
+        std::atomic<size_t> _bytes_read = 0;
+
+        std::map<std::string, target_counts> _targets;
+        mutable std::mutex _targets_mutex;
+
+        std::vector<group_record> _groups;
+        mutable std::mutex _groups_mutex;
+
+        memory_tracker _memory;
+
+        /// Returns the records of the top most expensive groups, the most expensive first
+        [[nodiscard]]
+        std::vector<group_record> top_groups(size_t top) const;
+    };
+
+    /// Returns the peak resident set size of the process in bytes
+    size_t peak_rss();
+}
+
+#endif
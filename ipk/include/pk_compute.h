@@ -31,6 +31,9 @@ namespace ipk
 
     using uphylo_kmer = i2l::unpositioned_phylo_kmer;
 
+    /// Creates a vector of 1-mers from a column of PP matrix
+    std::vector<uphylo_kmer> as_column(const window& window, size_t j, phylo_kmer::score_type eps);
+
     /// Divide-and-conquer with the lookahead trick
     class DCLA
     {
@@ -62,13 +65,15 @@ namespace ipk
         DCCW(const window& window, std::vector<uphylo_kmer>& prefixes,
              size_t k, phylo_kmer::score_type lookbehind, phylo_kmer::score_type lookahead);
 
-
         const std::vector<uphylo_kmer>& get_result() const;
 
         std::vector<uphylo_kmer>&& get_suffixes();
 
 
     private:
+        /// The micro-benchmarks of bench/kernels.cpp drive the kernel directly
+        friend struct kernel_bench;
+
         void run(phylo_kmer::score_type omega);
 
         std::vector<uphylo_kmer> DC(phylo_kmer::score_type omega, size_t j, size_t h, phylo_kmer::score_type eps);
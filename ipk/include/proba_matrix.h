@@ -1,8 +1,13 @@
 #ifndef IPK_PROBA_MATRIX_H
 #define IPK_PROBA_MATRIX_H
 
-#include <unordered_map>
+#include <vector>
+#include <string>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include <i2l/phylo_kmer.h>
 #include "ar.h"
 #include "window.h"
@@ -15,26 +20,32 @@ namespace ipk
     /// - #branch_nodes is the number of non-leaf nodes of input tree
     /// - #sites is the size of input alignment,
     /// - #variants is the alphabet size.
+    /// Matrices are indexed by the dense node ids of ar::mapping and loaded lazily by get().
+    /// get() and release() are thread-safe; references to loaded matrices stay valid until
+    /// they are released. Matrices are parsed one at a time, but loaded ones are available
+    /// to other threads meanwhile.
     class proba_matrix final
     {
     public:
         using branch_type = i2l::phylo_kmer::branch_type;
         static const branch_type NOT_A_LABEL = std::numeric_limits<branch_type>::max();
 
-        /// to map node labels into corresponding matrices
-        using storage = std::unordered_map<std::string, matrix>;
-        using iterator = typename storage::iterator;
-        using const_iterator = typename storage::const_iterator;
-        using mapped_type = storage::mapped_type;
+        /// matrices by node id
+        using storage = std::vector<matrix>;
+        using mapped_type = storage::value_type;
 
         proba_matrix(std::unique_ptr<ipk::ar::reader> reader);
         proba_matrix(const proba_matrix&) = delete;
-        proba_matrix(proba_matrix&& other) = default;
+        proba_matrix(proba_matrix&& other) noexcept;
         proba_matrix& operator=(const proba_matrix&) = delete;
         proba_matrix& operator=(proba_matrix&&) = delete;
         ~proba_matrix() = default;
 
+        /// Sets the AR labels of node ids. Labels are only used to read matrices
+        void index(const ar::mapping& mapping);
+
         /// capacity
+        /// The number of loaded matrices
         [[nodiscard]]
         size_t num_branches() const;
 
@@ -42,31 +53,84 @@ namespace ipk
         size_t num_sites() const;
 
         // Lookup
+        /// Returns the matrix of the node, loaded if needed
         [[nodiscard]]
-        mapped_type& operator[](const std::string& ar_label);
+        mapped_type& get(ar::node_id id);
 
-        [[nodiscard]]
-        const mapped_type& at(const std::string& ar_label) const;
+        /// Frees the memory of a matrix. It will be loaded again by the next get()
+        void release(ar::node_id id);
 
-        [[nodiscard]]
-        iterator find(const std::string& ar_label);
+    private:
+        storage _data;
+        std::vector<bool> _loaded;
+        std::vector<std::string> _labels;
+        std::unique_ptr<ipk::ar::reader> _reader;
 
-        /// iterators
-        [[nodiscard]]
-        iterator begin();
+        /// Guards _data and _loaded
+        mutable std::mutex _mutex;
 
-        [[nodiscard]]
-        iterator end();
+        /// Guards _reader. Taken before _mutex if both are needed
+        std::mutex _reader_mutex;
+    };
 
-        [[nodiscard]]
-        const_iterator begin() const;
+    /// \brief Loads the matrices of groups of nodes in a background thread, ahead of
+    /// the threads that explore them.
+    /// \details Groups are loaded in the given order, which is the order the groups are
+    /// expected to be taken in. The loader stays at most max_ahead loaded groups ahead of
+    /// the consumers, which bounds the memory of prefetched matrices. A consumer takes a group
+    /// with take(): if the group is not loaded yet, the consumer loads it itself, so that
+    /// the groups taken out of order do not wait for the loader. If loading fails, the loader
+    /// stops and the consumers get the error when they load the group themselves.
+    class matrix_loader
+    {
+    public:
+        using group = std::vector<ar::node_id>;
 
-        [[nodiscard]]
-        const_iterator end() const;
+        /// Called by the loader with the memory of every loaded group
+        using load_callback = std::function<void(size_t bytes)>;
+
+        matrix_loader(proba_matrix& matrix, std::vector<group> groups, const std::vector<size_t>& order,
+                      size_t max_ahead, load_callback on_load);
+        matrix_loader(const matrix_loader&) = delete;
+        matrix_loader(matrix_loader&&) = delete;
+        matrix_loader& operator=(const matrix_loader&) = delete;
+        matrix_loader& operator=(matrix_loader&&) = delete;
+
+        /// Stops the loader. Loaded groups that were not taken stay in the matrix
+        ~matrix_loader() noexcept;
+
+        /// Takes the group by its index. Waits if the group is being loaded.
+        /// \return true if the matrices of the group were loaded by the loader,
+        /// false if the caller has to load them
+        bool take(size_t group_index);
 
     private:
-        storage _data;
-        std::unique_ptr<ipk::ar::reader> _reader;
+        enum class group_state
+        {
+            pending,
+            loading,
+            loaded,
+            taken
+        };
+
+        void run(std::vector<size_t> order);
+
+        proba_matrix& _matrix;
+        std::vector<group> _groups;
+        size_t _max_ahead;
+        load_callback _on_load;
+
+        std::mutex _mutex;
+        std::condition_variable _loaded;
+        std::condition_variable _taken;
+
+        std::vector<group_state> _states;
+
+        /// The number of loaded groups that are not taken yet
+        size_t _num_ready = 0;
+        bool _stopped = false;
+
+        std::thread _thread;
     };
 }
 
@@ -0,0 +1,86 @@
+#ifndef IPK_READERS_H
+#define IPK_READERS_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ar.h"
+#include "window.h"
+
+namespace ipk::ar
+{
+    /// \brief Matrices given by the caller, e.g. computed in the same process.
+    /// \details Columns hold posterior probabilities (not log-transformed), in the order of
+    /// the states of the i2l encoding. Matrices are copied on every read, so they can be
+    /// read again after proba_matrix::release
+    class memory_reader : public reader
+    {
+    public:
+        using columns = std::vector<matrix::column>;
+
+        memory_reader() = default;
+        explicit memory_reader(std::unordered_map<std::string, columns> probabilities);
+        memory_reader(const memory_reader&) = delete;
+        memory_reader(memory_reader&&) = delete;
+        memory_reader& operator=(const memory_reader&) = delete;
+        memory_reader& operator=(memory_reader&&) = delete;
+        ~memory_reader() noexcept override = default;
+
+        /// Adds or replaces the matrix of the node
+        void add(const std::string& node_label, columns probabilities);
+
+        ipk::matrix read_node(const std::string& node_label) override;
+
+    private:
+        /// log10 of the probabilities by node label
+        std::unordered_map<std::string, columns> _scores;
+    };
+
+    namespace cache
+    {
+        /// \brief The binary matrix cache layout:
+        ///     header
+        ///     matrices    matrix::column[width] for every node, log-transformed
+        ///     index       for every node: uint32 label size, label, uint64 offset, uint64 width
+        /// Matrices are stored as they are used by the construction, so they are read without parsing.
+        constexpr char magic[8] = { 'I', 'P', 'K', 'M', 'T', 'R', 'X', '\0' };
+        constexpr uint32_t version = 1;
+
+        struct header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t alphabet_size;
+            uint64_t num_nodes;
+            uint64_t index_offset;
+        };
+    }
+
+    /// \brief Writes the matrices of the nodes read from the source to a binary matrix cache.
+    /// \return The size of the file in bytes
+    size_t save_matrix_cache(const std::string& filename, reader& source, const std::vector<std::string>& node_labels);
+
+    /// Reads a binary matrix cache, memory-mapped. See save_matrix_cache
+    std::unique_ptr<reader> make_matrix_cache_reader(const std::string& filename);
+
+    /// \brief Reads matrices in the RAxML-NG text format (see raxmlng_reader) from a file,
+    /// a named pipe, or the standard input ("-").
+    /// \details The stream is read once, up to the node that is asked for. Matrices of the nodes
+    /// that come before it are kept in memory until they are asked for. Producers should write
+    /// nodes in the post-order of the extended tree, which is the order they are read in.
+    /// Matrices stay in memory once read, as the stream can not be read again
+    std::unique_ptr<reader> make_stream_reader(const std::string& filename);
+
+    /// Same as make_stream_reader for the standard output of a command, run with the arguments
+    /// separated by spaces. The command is waited for once its output is read
+    std::unique_ptr<reader> make_process_reader(const std::string& command);
+
+    /// \brief Reads the results of ancestral reconstruction run separately on column partitions
+    /// of the alignment (see save_partitions). The matrix of a node is the concatenation of its
+    /// matrices in the partitions, given in the order of the columns
+    std::unique_ptr<reader> make_partitioned_reader(std::vector<std::unique_ptr<reader>> partitions);
+}
+
+#endif
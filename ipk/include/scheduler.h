@@ -0,0 +1,80 @@
+#ifndef IPK_SCHEDULER_H
+#define IPK_SCHEDULER_H
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <i2l/phylo_kmer.h>
+
+namespace ipk
+{
+    class matrix;
+
+    /// The order in which groups of ghost nodes are dispatched to threads
+    enum class schedule_policy
+    {
+        /// In the order of the tree traversal, distributed round-robin
+        tree,
+        /// The most expensive groups first, according to estimate_cost
+        longest_first
+    };
+
+    /// Parses a policy name: "tree" or "longest-first"
+    schedule_policy parse_schedule_policy(const std::string& name);
+
+    /// \brief Estimates the relative cost of the phylo-k-mer exploration for a matrix.
+    /// \details For a window with the best column probabilities p_1..p_k, the number of
+    /// k-mers that score above the threshold t is approximated by the minimum of:
+    ///   - prod(1 / p_j), the exponent of the min-entropy of the window,
+    ///   - 1 / t, an upper bound since scores of all k-mers of the window sum up to one,
+    ///   - the number of possible k-mers.
+    /// It is zero if the best k-mer scores below t. The estimate is the sum of those numbers
+    /// over all windows, plus a constant overhead per window. Best column scores are taken
+    /// from matrix::range_max_sum.
+    double estimate_cost(const matrix& matrix, size_t kmer_size, i2l::phylo_kmer::score_type log_threshold);
+
+    /// \brief Dispatches tasks (indices of groups) to a fixed number of workers.
+    /// \details Every worker has its own queue of tasks, filled on construction according
+    /// to the policy. For longest_first, tasks are sorted by cost in decreasing order and
+    /// assigned greedily to the least loaded worker (LPT). A worker takes the most expensive
+    /// task from its own queue; if the queue is empty, it steals the cheapest task of
+    /// another worker. Thread-safe.
+    ///
+    /// If the window is not zero, longest_first sorts tasks only within consecutive windows
+    /// of task indices, and the tasks of a window are assigned before the next one. A task
+    /// is then dispatched close to its position in the tree order, which bounds the number
+    /// of tasks completed before the tasks of smaller indices.
+    class group_scheduler
+    {
+    public:
+        group_scheduler(const std::vector<double>& costs, size_t num_workers, schedule_policy policy,
+                        size_t window = 0);
+        group_scheduler(const group_scheduler&) = delete;
+        group_scheduler(group_scheduler&&) = delete;
+        group_scheduler& operator=(const group_scheduler&) = delete;
+        group_scheduler& operator=(group_scheduler&&) = delete;
+        ~group_scheduler() noexcept = default;
+
+        /// Returns the next task for the worker, or nothing if all tasks are dispatched
+        [[nodiscard]]
+        std::optional<size_t> next(size_t worker_id);
+
+        /// \brief The order in which tasks are expected to be dispatched: the first tasks
+        /// of all workers, then the second ones, and so on. Exact if no task is stolen
+        [[nodiscard]]
+        std::vector<size_t> dispatch_order() const;
+
+    private:
+        struct worker_queue
+        {
+            mutable std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+
+        std::vector<worker_queue> _queues;
+    };
+}
+
+#endif
@@ -3,6 +3,9 @@
 #include <sstream>
 #include <algorithm>
 #include <fstream>
+#include <array>
+#include <future>
+#include <thread>
 #include <boost/filesystem.hpp>
 
 #include <i2l/phylo_tree.h>
@@ -16,17 +19,110 @@ using namespace i2l;
 using namespace ipk;
 namespace fs = boost::filesystem;
 
+/// Splits [0, size) in at most num_threads contiguous ranges and calls f(range index, first, last)
+/// for each of them in its own thread. The calling thread takes the first range
+template <class Function>
+void parallel_for(size_t size, size_t num_threads, const Function& f)
+{
+    const auto num_ranges = std::max<size_t>(1, std::min(num_threads, size));
+    const auto range_size = (size + num_ranges - 1) / num_ranges;
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_ranges - 1);
+    for (size_t range = 1; range < num_ranges; ++range)
+    {
+        const auto first = std::min(size, range * range_size);
+        const auto last = std::min(size, first + range_size);
+        threads.emplace_back(f, range, first, last);
+    }
+    f(0, 0, std::min(size, range_size));
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
 //------------------------------------------------------------------------------------
 // alignment class
-alignment::alignment(std::vector<seq_record> sequences)
-    : _sequences(std::move(sequences))
+alignment::row::row(std::string_view header, std::string_view sequence) noexcept
+    : _header(header)
+    , _sequence(sequence)
+{}
+
+std::string_view alignment::row::header() const noexcept
+{
+    return _header;
+}
+
+std::string_view alignment::row::sequence() const noexcept
+{
+    return _sequence;
+}
+
+alignment::const_iterator::const_iterator(const alignment& alignment, size_t index) noexcept
+    : _alignment(&alignment)
+    , _index(index)
+{}
+
+alignment::const_iterator::reference alignment::const_iterator::operator*() const
+{
+    return _alignment->at(_index);
+}
+
+alignment::const_iterator::pointer alignment::const_iterator::operator->() const
+{
+    _row = _alignment->at(_index);
+    return &*_row;
+}
+
+alignment::const_iterator& alignment::const_iterator::operator++()
+{
+    ++_index;
+    return *this;
+}
+
+alignment::const_iterator alignment::const_iterator::operator++(int)
+{
+    auto copy = *this;
+    ++_index;
+    return copy;
+}
+
+bool alignment::const_iterator::operator==(const const_iterator& other) const noexcept
+{
+    return _alignment == other._alignment && _index == other._index;
+}
+
+bool alignment::const_iterator::operator!=(const const_iterator& other) const noexcept
+{
+    return !(*this == other);
+}
+
+alignment::alignment(std::deque<std::string> headers, std::vector<std::string> sequences)
+    : _headers(std::move(headers))
+    , _sequences(std::move(sequences))
 {
     if (_sequences.empty())
     {
         throw std::runtime_error("The alignment is empty.");
     }
-    _width = _sequences[0].sequence().size();
-    _height = _sequences.size();
+
+    if (_headers.size() != _sequences.size())
+    {
+        throw std::runtime_error("Internal error: the numbers of headers and sequences differ.");
+    }
+    _width = _sequences[0].size();
+    build_index();
+}
+
+alignment::alignment(const alignment& other)
+    : _headers(other._headers)
+    , _sequences(other._sequences)
+    , _gaps(other._gaps)
+    , _width(other._width)
+{
+    build_index();
 }
 
 size_t alignment::width() const noexcept
@@ -36,154 +132,301 @@ size_t alignment::width() const noexcept
 
 size_t alignment::height() const noexcept
 {
-    return _sequences.size();
+    return _headers.size();
 }
 
-alignment::iterator alignment::begin()
+bool alignment::contains(std::string_view header) const
 {
-    return _sequences.begin();
+    return _index.find(header) != _index.end();
 }
 
-alignment::iterator alignment::end()
+alignment::row alignment::at(size_t index) const
 {
-    return _sequences.end();
+    return { _headers.at(index), index < _sequences.size() ? std::string_view(_sequences[index]) : _gaps };
+}
+
+void alignment::keep_columns(const std::vector<size_t>& columns, size_t num_threads)
+{
+    parallel_for(_sequences.size(), num_threads, [this, &columns](size_t, size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i)
+        {
+            /// Columns are sorted, so a column is never overwritten before it is moved
+            auto& sequence = _sequences[i];
+            for (size_t j = 0; j < columns.size(); ++j)
+            {
+                sequence[j] = sequence[columns[j]];
+            }
+            sequence.resize(columns.size());
+            sequence.shrink_to_fit();
+        }
+    });
+
+    if (!_gaps.empty())
+    {
+        _gaps.resize(columns.size());
+    }
+    _width = columns.size();
 }
 
 alignment::const_iterator alignment::begin() const
 {
-    return _sequences.begin();
+    return { *this, 0 };
 }
 
 alignment::const_iterator alignment::end() const
 {
-    return _sequences.end();
+    return { *this, height() };
+}
+
+void alignment::add_gap_sequence(const std::string& header)
+{
+    if (_gaps.empty())
+    {
+        _gaps.assign(_width, seq_traits::get_gap());
+    }
+
+    _headers.push_back(header);
+    _index.emplace(_headers.back(), height() - 1);
+}
+
+void alignment::build_index()
+{
+    _index.clear();
+    _index.reserve(height());
+    for (size_t i = 0; i < _headers.size(); ++i)
+    {
+        _index.emplace(_headers[i], i);
+    }
 }
 
 //------------------------------------------------------------------------------------
 // miscellaneous functions
 alignment load_alignment(const string& file_name)
 {
-    std::vector<seq_record> sequences;
+    std::deque<std::string> headers;
+    std::vector<std::string> sequences;
     for (const auto& seq : i2l::io::read_fasta(file_name, false))
     {
-        sequences.push_back(seq);
+        headers.emplace_back(seq.header());
+        sequences.emplace_back(seq.sequence());
     }
 
-    return alignment(std::move(sequences));
+    return { std::move(headers), std::move(sequences) };
 }
 
-// save a stream of fasta records to a file
-template <class InputIt>
-void save_fasta(InputIt first, InputIt last, const std::string& file_name)
+/// Formats rows in a reusable buffer and writes it to the file in large blocks
+class buffered_writer
+{
+public:
+    /// The size of the buffer that triggers a write
+    static constexpr size_t buffer_size = 1 << 22;
+
+    explicit buffered_writer(const std::string& file_name)
+        : _file_name(file_name)
+        , _out(file_name, std::ios::binary)
+    {
+        if (!_out)
+        {
+            throw std::runtime_error("Could not open the file: " + file_name);
+        }
+        _buffer.reserve(2 * buffer_size);
+    }
+
+    void append(std::string_view data)
+    {
+        _buffer.append(data.data(), data.size());
+    }
+
+    void append(size_t count, char c)
+    {
+        _buffer.append(count, c);
+    }
+
+    /// Writes the buffer if it is full. Called between rows
+    void flush_if_full()
+    {
+        if (_buffer.size() >= buffer_size)
+        {
+            flush();
+        }
+    }
+
+    void close()
+    {
+        flush();
+        _out.close();
+        if (!_out)
+        {
+            throw std::runtime_error("Could not write the file: " + _file_name);
+        }
+    }
+
+private:
+    void flush()
+    {
+        _out.write(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+        _buffer.clear();
+    }
+
+    std::string _file_name;
+    std::ofstream _out;
+    std::string _buffer;
+};
+
+// save the alignment in fasta
+void save_fasta(const alignment& align, const std::string& file_name)
 {
-    std::ofstream out(file_name);
-    for (auto it = first; it != last; ++it)
+    buffered_writer out(file_name);
+    for (const auto& row : align)
     {
-        out << ">" << it->header() << '\n' << it->sequence() << '\n';
+        out.append(">");
+        out.append(row.header());
+        out.append("\n");
+        out.append(row.sequence());
+        out.append("\n");
+        out.flush_if_full();
     }
+    out.close();
 }
 
-// save a stream of fasta records to a file
-template <class InputIt>
-void save_phylip(InputIt first, InputIt last, const std::string& file_name)
+// save the columns [first, last) of the alignment in phylip: labels padded to a fixed width,
+// sequences in chunks of 10
+void save_phylip(const alignment& align, const std::string& file_name, size_t first, size_t last)
 {
     const size_t allowed_label_size = 250;
+    const size_t chunk_size = 10;
 
-    std::ofstream out(file_name);
+    buffered_writer out(file_name);
 
     /// Header
-    out << '\t' << std::distance(first, last) << '\t' << first->sequence().size() << '\n';
+    out.append("\t" + std::to_string(align.height()) + "\t" + std::to_string(last - first) + "\n");
 
-    for (auto it = first; it != last; ++it)
+    for (const auto& row : align)
     {
         /// Left column
-        out << it->header();
-        for (size_t i = it->header().size(); i < allowed_label_size; ++i)
+        const auto header = row.header();
+        out.append(header);
+        if (header.size() < allowed_label_size)
         {
-            out << ' ';
+            out.append(allowed_label_size - header.size(), ' ');
         }
 
         /// Other columns
-        size_t pos = 0;
-        while (pos < it->sequence().size())
+        const auto sequence = row.sequence().substr(first, last - first);
+        for (size_t pos = 0; pos < sequence.size(); pos += chunk_size)
         {
-            size_t remained = it->sequence().size() - pos;
-            if (remained > 10)
-            {
-                out << it->sequence().substr(pos, 10) << ' ';
-                pos += 10;
-            }
-            else
+            if (pos > 0)
             {
-                out << it->sequence().substr(pos, remained);
-                pos += remained;
+                out.append(1, ' ');
             }
+            out.append(sequence.substr(pos, chunk_size));
         }
-        out << '\n';
-
+        out.append(1, '\n');
+        out.flush_if_full();
     }
+    out.close();
+}
+
+void save_phylip(const alignment& align, const std::string& file_name)
+{
+    save_phylip(align, file_name, 0, align.width());
 }
 
 void ipk::save_alignment(const alignment& align, const string& file_name, alignment_format format)
 {
     if (format == alignment_format::FASTA)
     {
-        save_fasta(std::begin(align), std::end(align), file_name);
+        save_fasta(align, file_name);
     }
     else if (format == alignment_format::PHYLIP)
     {
-        save_phylip(std::begin(align), std::end(align), file_name);
+        save_phylip(align, file_name);
     }
 }
 
-vector<double> calculate_gap_ratio(const alignment& align)
+void ipk::save_alignment(const alignment& align, const std::string& fasta_file, const std::string& phylip_file)
 {
-    auto ratios = vector<double>(align.width(), 0.0f);
+    auto fasta = std::async(std::launch::async, [&align, &fasta_file]() { save_fasta(align, fasta_file); });
+    save_phylip(align, phylip_file);
+    fasta.get();
+}
+
+vector<string> ipk::save_partitions(const alignment& align, const std::string& phylip_file, size_t num_partitions)
+{
+    if (num_partitions == 0 || num_partitions > align.width())
+    {
+        throw std::runtime_error("Can not split an alignment of " + std::to_string(align.width()) +
+                                 " columns into " + std::to_string(num_partitions) + " partitions.");
+    }
+
+    vector<string> files;
+    for (size_t i = 0; i < num_partitions; ++i)
+    {
+        const auto first = align.width() * i / num_partitions;
+        const auto last = align.width() * (i + 1) / num_partitions;
+
+        files.push_back(phylip_file + ".part" + std::to_string(i));
+        save_phylip(align, files.back(), first, last);
+    }
+    return files;
+}
 
-    for (const auto& seq_record : align)
+/// Counts gaps in every column. Every thread counts a range of rows
+vector<size_t> count_gaps(const alignment& align, size_t num_threads)
+{
+    /// A lookup table keeps the inner loop branchless, so that it can be vectorized
+    std::array<uint32_t, 256> is_gap{};
+    for (size_t c = 0; c < is_gap.size(); ++c)
     {
-        const auto& sequence = seq_record.sequence();
-        for (size_t i = 0; i < sequence.size(); ++i)
+        is_gap[c] = seq_traits::is_gap(static_cast<char>(c)) ? 1 : 0;
+    }
+
+    const auto width = align.width();
+    const auto num_ranges = std::max<size_t>(1, std::min(num_threads, align.height()));
+    auto range_counts = vector<vector<uint32_t>>(num_ranges, vector<uint32_t>(width, 0));
+
+    parallel_for(align.height(), num_ranges, [&](size_t range, size_t first, size_t last) {
+        auto& counts = range_counts[range];
+        for (size_t i = first; i < last; ++i)
         {
-            if (seq_traits::is_gap(sequence[i]))
+            const auto sequence = align.at(i).sequence();
+            const auto* data = reinterpret_cast<const unsigned char*>(sequence.data());
+            for (size_t j = 0; j < width; ++j)
             {
-                ratios[i]++;
+                counts[j] += is_gap[data[j]];
             }
         }
-    }
+    });
 
-    for (double& ratio : ratios)
+    auto gaps = vector<size_t>(width, 0);
+    for (const auto& counts : range_counts)
     {
-        ratio /= (double)align.height();
+        for (size_t j = 0; j < width; ++j)
+        {
+            gaps[j] += counts[j];
+        }
     }
-    return ratios;
+    return gaps;
 }
 
-alignment reduce_alignment(const alignment &align, double reduction_ratio)
+void reduce_alignment(alignment& align, double reduction_ratio, size_t num_threads)
 {
-    // figure out which columns should be removed
-    const auto gap_ratios = calculate_gap_ratio(align);
-    vector<bool> pos_to_remove(gap_ratios.size(), false);
-    transform(begin(gap_ratios), end(gap_ratios), pos_to_remove.begin(),
-              [reduction_ratio](double ratio) -> bool { return ratio >= reduction_ratio; });
+    // figure out which columns should be kept
+    const auto gaps = count_gaps(align, num_threads);
+    vector<size_t> columns;
+    columns.reserve(gaps.size());
+    for (size_t j = 0; j < gaps.size(); ++j)
+    {
+        if ((double)gaps[j] / (double)align.height() < reduction_ratio)
+        {
+            columns.push_back(j);
+        }
+    }
 
-    vector<seq_record> reduced_sequences;
-    for (const auto& seq_record : align)
+    if (columns.size() < align.width())
     {
-        auto header = std::string(seq_record.header());
-        auto sequence = std::string(seq_record.sequence());
-
-        // erase-remove idiom: remove the positions, marked as 1 in the pos_to_remove vector
-        size_t index = 0;
-        auto predicate = [&index, pos_to_remove](char) -> bool { return pos_to_remove[index++]; };
-        sequence.erase(
-            remove_if(sequence.begin(), sequence.end(), predicate),
-            sequence.end()
-        );
-
-        reduced_sequences.emplace_back(move(header), move(sequence));
+        align.keep_columns(columns, num_threads);
     }
-    return alignment(move(reduced_sequences));
 }
 
 void check_length(const alignment& align)
@@ -203,7 +446,7 @@ void check_length(const alignment& align)
     }
 }
 
-void check_sequence_states(const seq_record& seq_record)
+void check_sequence_states(const alignment::row& seq_record)
 {
     for (const auto& state : seq_record.sequence())
     {
@@ -245,45 +488,41 @@ void validate_alignment(const alignment& align)
 ipk::alignment _preprocess_alignment(const std::string& working_dir,
                                       const std::string& alignment_file,
                                       double reduction_ratio,
-                                      bool no_reduction)
+                                      bool no_reduction,
+                                      size_t num_threads)
 {
     /// Create working directories
     fs::create_directories(working_dir);
 
     /// Read and process the reference alignment
-    auto raw_alignment = load_alignment(alignment_file);
-    validate_alignment(raw_alignment);
+    auto alignment = load_alignment(alignment_file);
+    validate_alignment(alignment);
 
-    /// Reduce the alignment if needed
-    if (no_reduction)
-    {
-        return raw_alignment;
-    }
-    else
+    /// Reduce the alignment in place if needed
+    if (!no_reduction)
     {
-        auto alignment = reduce_alignment(raw_alignment, reduction_ratio);
-        validate_alignment(alignment);
+        reduce_alignment(alignment, reduction_ratio, num_threads);
 
         /// Save the reduced alignment on disk
         const auto reduced_alignment_file = (fs::path(working_dir) / "align.reduced.fasta").string();
         save_alignment(alignment, reduced_alignment_file, alignment_format::FASTA);
-
-        return alignment;
     }
-
+    return alignment;
 }
 
 ipk::alignment ipk::preprocess_alignment(const std::string& working_dir,
                                          const std::string& alignment_file,
                                          double reduction_ratio,
                                          bool no_reduction,
-                                         int verbose)
+                                         int verbose,
+                                         size_t num_threads)
 {
     if (verbose > 0)
     {
         std::cout << "Loading the reference alignment: " << alignment_file << std::endl;
     }
-    auto alignment = _preprocess_alignment(working_dir, alignment_file, reduction_ratio, no_reduction);
+    auto alignment = _preprocess_alignment(working_dir, alignment_file, reduction_ratio, no_reduction,
+                                           num_threads);
 
     if (verbose > 0)
     {
@@ -292,27 +531,17 @@ ipk::alignment ipk::preprocess_alignment(const std::string& working_dir,
     return alignment;
 }
 
-bool has_sequence(const alignment& alignment, const std::string& seq_header)
-{
-    return std::find_if(alignment.begin(), alignment.end(), [&seq_header](const seq_record& seq_rec) {
-        return seq_rec.header() == seq_header;
-    }) != alignment.end();
-}
-
 alignment ipk::extend_alignment(alignment original_alignment, const phylo_tree& tree)
 {
     alignment extended_alignment = std::move(original_alignment);
 
-    std::string empty_seq(extended_alignment.width(), seq_traits::get_gap());
-
     for (const auto& node : visit_subtree(tree.get_root()))
     {
-        if (node.is_leaf() && !has_sequence(extended_alignment, node.get_label()))
+        if (node.is_leaf() && !extended_alignment.contains(node.get_label()))
         {
-            extended_alignment._sequences.emplace_back(node.get_label(), empty_seq);
-            extended_alignment._height += 1;
+            extended_alignment.add_gap_sequence(node.get_label());
         }
     }
 
     return extended_alignment;
-}
\ No newline at end of file
+}
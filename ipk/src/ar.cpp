@@ -7,12 +7,20 @@
 #include <regex>
 #include <array>
 #include <sstream>
+#include <string_view>
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <boost/algorithm/string/case_conv.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/process.hpp>
+#include <boost/process/extend.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include <csv-parser/csv.h>
 #include <i2l/newick.h>
 #include <i2l/phylo_tree.h>
@@ -20,6 +28,8 @@
 #include "row.h"
 #include "proba_matrix.h"
 #include "command_line.h"
+#include "metrics.h"
+#include "readers.h"
 
 namespace bp = boost::process;
 namespace fs = boost::filesystem;
@@ -27,10 +37,13 @@ namespace fs = boost::filesystem;
 namespace ipk::ar
 {
     /// \brief Reads a PhyML output into a matrix.
+    /// \details The file is indexed in one pass: for every node, the runs of consecutive rows
+    /// of the node. PhyML writes rows by site, so there is usually a run for every site.
+    /// read_node reads only the rows of the node.
     class phyml_reader : public reader
     {
     public:
-        phyml_reader(const std::string& file_name) noexcept;
+        phyml_reader(const std::string& file_name);
         phyml_reader(const phyml_reader&) = delete;
         phyml_reader(phyml_reader&&) = delete;
         phyml_reader& operator=(const phyml_reader&) = delete;
@@ -40,11 +53,20 @@ namespace ipk::ar
         ipk::matrix read_node(const std::string& node_label) override;
 
     private:
-        proba_matrix read_matrix();
+        /// Runs of consecutive rows of a node: the stream position of the first row and the number of rows
+        struct node_runs
+        {
+            std::vector<uint64_t> offsets;
+            std::vector<uint32_t> num_rows;
+        };
+
+        void build_index();
 
         std::string _file_name;
-    };
+        std::ifstream _file_stream;
 
+        std::unordered_map<std::string, node_runs> _index;
+    };
     /// \brief Reads RAXML-NG output into a matrix.
     class raxmlng_reader : public reader
     {
@@ -69,77 +91,129 @@ namespace ipk::ar
         std::unordered_map<std::string, std::streampos> _index;
     };
 
-    phyml_reader::phyml_reader(const std::string& file_name) noexcept
+    phyml_reader::phyml_reader(const std::string& file_name)
         : _file_name{ file_name }
-    {}
-
+    {
+        build_index();
+    }
 
-    ipk::matrix phyml_reader::read_node(const std::string& node_label)
+    /// Returns the node label of a row of the PhyML output: Site, Node, probabilities
+    std::string_view get_phyml_label(std::string_view line)
     {
-        (void)node_label;
-        throw std::runtime_error("PhyML is not supported in this version.");
+        const auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+        auto begin = std::find_if_not(line.begin(), line.end(), is_space);
+        begin = std::find_if(begin, line.end(), is_space);
+        begin = std::find_if_not(begin, line.end(), is_space);
+        const auto end = std::find_if(begin, line.end(), is_space);
+        return line.substr(begin - line.begin(), end - begin);
     }
-/*
-    proba_matrix phyml_reader::read_matrix()
+
+    void phyml_reader::build_index()
     {
-#ifdef SEQ_TYPE_DNA
-        std::ios::sync_with_stdio(false);
+        std::cout << "Indexing " <<  _file_name << "..." << std::endl;
+        _file_stream.open(_file_name);
+        if (!_file_stream)
+        {
+            throw std::runtime_error("Could not open " + _file_name);
+        }
 
-        proba_matrix result;
-        std::ifstream infile(_file_name);
+        std::string line;
+        uint64_t position = 0;
 
+        /// Skip the header. It ends with the line that starts with 'Site'
         bool is_header = true;
+        while (is_header && std::getline(_file_stream, line))
+        {
+            position += line.size() + 1;
+            is_header = !(line.size() > 4 && line.rfind("Site", 0) == 0);
+        }
 
-        string line;
-        while (std::getline(infile, line))
+        if (is_header)
         {
-            if (is_header)
+            throw std::runtime_error("Parsing error: no ancestral probabilities in " + _file_name);
+        }
+
+        node_runs* current_runs = nullptr;
+        std::string current_node;
+        while (std::getline(_file_stream, line))
+        {
+            const auto node_label = get_phyml_label(line);
+            if (!node_label.empty())
             {
-                // if the line starts with 'Site', the header is finished
-                if (line.size() > 4 && line.rfind("Site", 0) == 0)
+                /// A new run starts with a row of another node
+                if (!current_runs || node_label != current_node)
                 {
-                    is_header = false;
+                    current_node = node_label;
+                    current_runs = &_index[current_node];
+                    current_runs->offsets.push_back(position);
+                    current_runs->num_rows.push_back(0);
                 }
+                ++current_runs->num_rows.back();
             }
-            else
+
+            /// getline drops the line separator
+            position += line.size() + 1;
+        }
+        _file_stream.clear();
+    }
+
+    ipk::matrix phyml_reader::read_node(const std::string& node_label)
+    {
+#if defined(SEQ_TYPE_DNA)
+        const auto it = _index.find(node_label);
+        if (it == _index.end())
+        {
+            throw std::runtime_error("Could not read the AR matrix for the node " + node_label);
+        }
+        const auto& runs = it->second;
+
+        ipk::matrix matrix;
+        auto& data = matrix.get_data();
+
+        std::string line;
+        size_t last_site = 0;
+        for (size_t i = 0; i < runs.offsets.size(); ++i)
+        {
+            _file_stream.seekg(static_cast<std::streamoff>(runs.offsets[i]));
+            for (uint32_t row = 0; row < runs.num_rows[i]; ++row)
             {
-                size_t site = 0;
-                std::string node_label;
-                ipk::phylo_kmer::score_type a, c, g, t;
+                if (!std::getline(_file_stream, line))
+                {
+                    throw std::runtime_error("Error while AR indexing: wrong position for node " + node_label);
+                }
 
+                size_t site = 0;
+                std::string row_label;
+                phylo_kmer::score_type a, c, g, t;
                 std::istringstream iss(line);
-                if (!(iss >> site >> node_label >> a >> c >> g >> t))
+                if (!(iss >> site >> row_label >> a >> c >> g >> t))
                 {
                     throw std::runtime_error("Parsing error: could not parse the line " + line);
                 }
 
-                auto new_column = std::array<phylo_kmer::score_type, 4>{ a, c, g, t };
+                if (row_label != node_label || site <= last_site)
+                {
+                    throw std::runtime_error("Error while AR indexing: wrong position for node " + node_label);
+                }
+                last_site = site;
 
                 /// log-transform the probabilities
-                auto log = [](auto value) { return std::log10(value); };
-                std::transform(begin(new_column), end(new_column), begin(new_column), log);
-
-                auto& node_matrix = result[node_label];
-                node_matrix.set_label(node_label);
-                node_matrix.get_data().push_back(new_column);
+                data.push_back({ std::log10(a), std::log10(c), std::log10(g), std::log10(t) });
             }
         }
 
-        for (auto& [label, node_matrix] : result)
-        {
-            (void)label;
-            node_matrix.preprocess();
-        }
-        return result;
-#elif SEQ_TYPE_AA
+        matrix.set_label(node_label);
+        matrix.preprocess();
+        return matrix;
+#elif defined(SEQ_TYPE_AA)
+        (void)node_label;
         throw std::runtime_error("PhyML for proteins is not supported yet.");
 #else
         static_assert(false, """Make sure the sequence type is defined. Supported types:\n"""
                              """SEQ_TYPE_DNA"""
                              """SEQ_TYPE_AA""");
 #endif
-
-    }*/
+    }
 
     raxmlng_reader::raxmlng_reader(std::string file_name) noexcept
         : _file_name{ std::move(file_name) }
@@ -327,15 +401,60 @@ namespace ipk::ar
         fs::path _ar_output_file;
     };
 
+    /// The registered readers by name, see register_reader
+    std::map<std::string, reader_factory>& get_readers()
+    {
+        static std::map<std::string, reader_factory> readers = {
+            { "phyml", [](const std::string& source) { return std::make_unique<phyml_reader>(source); } },
+            { "raxml-ng", [](const std::string& source) { return std::make_unique<raxmlng_reader>(source); } },
+            { "matrix-cache", make_matrix_cache_reader },
+            { "stream", make_stream_reader },
+            { "process", make_process_reader }
+        };
+        return readers;
+    }
+
+    std::mutex& get_readers_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    void register_reader(const std::string& name, reader_factory factory)
+    {
+        std::lock_guard<std::mutex> lock(get_readers_mutex());
+        get_readers()[name] = std::move(factory);
+    }
+
+    std::unique_ptr<reader> make_reader(const std::string& name, const std::string& source)
+    {
+        reader_factory factory;
+        {
+            std::lock_guard<std::mutex> lock(get_readers_mutex());
+            const auto& readers = get_readers();
+            if (const auto it = readers.find(name); it != readers.end())
+            {
+                factory = it->second;
+            }
+        }
+
+        if (!factory)
+        {
+            throw std::runtime_error("Unknown reader of ancestral reconstruction results: " + name + ". Supported: " +
+                                     boost::algorithm::join(reader_names(), ", ") + ".");
+        }
+        return factory(source);
+    }
+
     std::unique_ptr<reader> make_reader(ar::software software, const std::string& filename)
     {
         if (software == ar::software::PHYML)
         {
-            return std::make_unique<phyml_reader>(filename);
+            return make_reader("phyml", filename);
         }
         else if (software == ar::software::RAXML_NG)
         {
-            return std::make_unique<raxmlng_reader>(filename);
+            return make_reader("raxml-ng", filename);
         }
         else
         {
@@ -343,6 +462,17 @@ namespace ipk::ar
         }
     }
 
+    std::vector<std::string> reader_names()
+    {
+        std::lock_guard<std::mutex> lock(get_readers_mutex());
+        std::vector<std::string> names;
+        for (const auto& [name, factory] : get_readers())
+        {
+            names.push_back(name);
+        }
+        return names;
+    }
+
     ar::model parse_model(const std::string& model)
     {
         std::map<std::string, ar::model> map = {
@@ -448,10 +578,12 @@ namespace ipk::ar
         throw std::runtime_error("Internal error: wrong model");
     }
 
+    /// The output files. There are several of them if the alignment was reconstructed by partitions,
+    /// given in the order of the columns
     struct ar_result
     {
-        std::string matrix_file;
-        std::string tree_file;
+        std::vector<std::string> matrix_files;
+        std::vector<std::string> tree_files;
     };
 
     /// Iterates over files in the directory, looks for the first file with the given suffix
@@ -490,6 +622,11 @@ namespace ipk::ar
 
         ar_result run() override
         {
+            if (_params.partition_files.size() > 1)
+            {
+                throw std::runtime_error("Ancestral reconstruction by partitions is only supported with RAxML-NG.");
+            }
+
             fs::path matrix_file;
             fs::path tree_file;
 
@@ -539,7 +676,7 @@ namespace ipk::ar
             std::cout << "Ancestral reconstruction results have been found: " << std::endl
                       << '\t' << matrix_file.string() << std::endl
                       << '\t' << tree_file.string() << std::endl;
-            return { matrix_file.string(), tree_file.string() };
+            return { { matrix_file.string() }, { tree_file.string() } };
         }
 
     private:
@@ -593,6 +730,11 @@ namespace ipk::ar
 
         ar_result run() override
         {
+            if (_params.partition_files.size() > 1)
+            {
+                return run_partitions();
+            }
+
             fs::path matrix_file;
             fs::path tree_file;
 
@@ -642,11 +784,56 @@ namespace ipk::ar
             std::cout << "Ancestral reconstruction results have been found: " << std::endl
                       << '\t' << matrix_file.string() << std::endl
                       << '\t' << tree_file.string() << std::endl;
-            return {matrix_file.string(), tree_file.string()};
+            return { { matrix_file.string() }, { tree_file.string() } };
         }
 
     private:
 
+        /// Runs RAxML-NG on every partition of the alignment at once, or finds the results
+        /// of the partitions in the directory provided by --ar-dir
+        ar_result run_partitions()
+        {
+            ar_result result;
+            for (const auto& partition_file : _params.partition_files)
+            {
+                const auto prefix = _params.ar_dir.empty()
+                    ? partition_file
+                    : (fs::path(_params.ar_dir) / fs::path(partition_file).filename()).string();
+                result.matrix_files.push_back(prefix + ".raxml.ancestralProbs");
+                result.tree_files.push_back(prefix + ".raxml.ancestralTree");
+            }
+
+            if (_params.ar_dir.empty())
+            {
+                _run_partitions();
+            }
+            else
+            {
+                const auto found = std::all_of(result.matrix_files.begin(), result.matrix_files.end(),
+                                               [](const auto& file) { return fs::exists(file); })
+                                && std::all_of(result.tree_files.begin(), result.tree_files.end(),
+                                               [](const auto& file) { return fs::exists(file); });
+
+                /// The directory holds the results of a run on the whole alignment
+                if (!found)
+                {
+                    auto params = _params;
+                    params.partition_files.clear();
+                    return raxml_wrapper(std::move(params)).run();
+                }
+            }
+
+            std::cout << "Ancestral reconstruction results have been found: " << std::endl;
+            for (size_t i = 0; i < result.matrix_files.size(); ++i)
+            {
+                check_file(result.matrix_files[i]);
+                check_file(result.tree_files[i]);
+                std::cout << '\t' << result.matrix_files[i] << std::endl
+                          << '\t' << result.tree_files[i] << std::endl;
+            }
+            return result;
+        }
+
         void _run()
         {
             auto process = make_process();
@@ -660,13 +847,111 @@ namespace ipk::ar
             }
         }
 
+        /// \brief Runs a process for every partition, each with its share of the threads.
+        /// \details On Linux, the cores this process is allowed to run on (taskset, cpusets)
+        /// are split among the processes, so that their threads do not compete for the same cores
+        void _run_partitions()
+        {
+            const auto num_partitions = _params.partition_files.size();
+            const auto num_threads = std::max<size_t>(1, _params.num_threads / num_partitions);
+#ifdef __linux__
+            const auto cores = allowed_cores();
+            const auto cores_per_partition = std::max<size_t>(1, cores.size() / num_partitions);
+#endif
+
+            std::vector<bp::child> processes;
+            for (size_t i = 0; i < num_partitions; ++i)
+            {
+                const auto args = make_args(_params.partition_files[i], num_threads);
+                std::cout << "Running: " << _params.binary_file << " " << boost::algorithm::join(args, " ") << std::endl;
+
+#ifdef __linux__
+                cpu_affinity affinity;
+                for (size_t j = 0; j < cores_per_partition && !cores.empty(); ++j)
+                {
+                    CPU_SET(cores[(i * cores_per_partition + j) % cores.size()], &affinity.cores);
+                }
+                processes.emplace_back(_params.binary_file, bp::args(args), bp::std_out > bp::null, affinity);
+#else
+                processes.emplace_back(_params.binary_file, bp::args(args), bp::std_out > bp::null);
+#endif
+            }
+
+            for (auto& process : processes)
+            {
+                process.wait();
+            }
+
+            for (size_t i = 0; i < num_partitions; ++i)
+            {
+                if (const auto result = processes[i].exit_code(); result != 0)
+                {
+                    throw std::runtime_error("Error during ancestral reconstruction: exit code "
+                                             + std::to_string(result) + ". See "
+                                             + _params.partition_files[i] + ".raxml.log");
+                }
+            }
+        }
+
+#ifdef __linux__
+        /// Sets the CPU affinity of a child process before it starts
+        struct cpu_affinity : bp::extend::handler
+        {
+            cpu_affinity()
+            {
+                CPU_ZERO(&cores);
+            }
+
+            template<typename Executor>
+            void on_exec_setup(Executor&) const
+            {
+                /// Pinning is an optimization, a failure is not an error. The child
+                /// keeps the cores of the parent if none is known
+                if (CPU_COUNT(&cores) > 0)
+                {
+                    sched_setaffinity(0, sizeof(cores), &cores);
+                }
+            }
+
+            cpu_set_t cores;
+        };
+
+        /// The cores this process is allowed to run on, or nothing if they are unknown
+        static std::vector<int> allowed_cores()
+        {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+            {
+                return {};
+            }
+
+            std::vector<int> cores;
+            for (int core = 0; core < CPU_SETSIZE; ++core)
+            {
+                if (CPU_ISSET(core, &mask))
+                {
+                    cores.push_back(core);
+                }
+            }
+            return cores;
+        }
+#endif
+
         bp::child make_process()
+        {
+            const auto args = make_args(_params.alignment_file, _params.num_threads);
+            std::cout << "Running: " << _params.binary_file << " " << boost::algorithm::join(args, " ") << std::endl;
+            return bp::child(_params.binary_file, bp::args(args));
+        }
+
+        std::vector<std::string> make_args(const std::string& alignment_file, size_t num_threads) const
         {
             std::vector<std::string> args = {
                 "--ancestral",
-                "--msa", _params.alignment_file,
+                "--msa", alignment_file,
                 "--tree", _params.tree_file,
-                "--threads", _params.num_threads,
+                "--threads", std::to_string(num_threads),
                 "--precision", "9",
                 "--seed", "1",
                 "--force", "msa",
@@ -702,8 +987,7 @@ namespace ipk::ar
                     args.push_back(arg);
                 }
             }
-            std::cout << "Running: " << _params.binary_file << " " << boost::algorithm::join(args, " ") << std::endl;
-            return bp::child(_params.binary_file, bp::args(args));
+            return args;
         }
 
         void check_file(const fs::path& file)
@@ -746,7 +1030,7 @@ namespace ipk::ar
         ar_params.ar_model = parse_model(parameters.ar_model);
         ar_params.alpha = parameters.ar_alpha;
         ar_params.categories = parameters.ar_categories;
-        ar_params.num_threads = std::to_string(parameters.num_threads);
+        ar_params.num_threads = parameters.num_threads;
         ar_params.tree_file = ext_tree_file;
         ar_params.alignment_file = ext_alignment_phylip;
 
@@ -757,19 +1041,73 @@ namespace ipk::ar
         return { ar_software, ar_params };
     }
 
-    std::tuple<proba_matrix, i2l::phylo_tree> ancestral_reconstruction(ar::software software, const ar::parameters& parameters)
+    bool has_results(ar::software software, const std::vector<std::string>& alignment_files)
+    {
+        return std::all_of(alignment_files.begin(), alignment_files.end(), [software](const auto& alignment_file) {
+            if (software == ar::software::PHYML)
+            {
+                return fs::exists(alignment_file + "_phyml_ancestral_seq.txt")
+                    && fs::exists(alignment_file + "_phyml_ancestral_tree.txt");
+            }
+            else
+            {
+                return fs::exists(alignment_file + ".raxml.ancestralProbs")
+                    && fs::exists(alignment_file + ".raxml.ancestralTree");
+            }
+        });
+    }
+
+    /// Post-order labels of the nodes of the tree
+    std::vector<std::string> get_labels(const i2l::phylo_tree& tree)
+    {
+        std::vector<std::string> labels;
+        for (const auto& node : tree)
+        {
+            labels.push_back(node.get_label());
+        }
+        return labels;
+    }
+
+    std::tuple<proba_matrix, i2l::phylo_tree> ancestral_reconstruction(ar::software software,
+                                                                       const ar::parameters& parameters,
+                                                                       build_metrics& metrics)
     {
+        auto stage_timer = metrics.measure(stage::ancestral_reconstruction);
+
         /// Run ancestral reconstruction
         auto wrapper = make_ar_wrapper(software, parameters);
+        auto run_timer = metrics.measure(stage::ancestral_reconstruction, substage::ar_run);
         const auto& result = wrapper->run();
+        run_timer.stop();
 
-        auto reader = make_reader(software, result.matrix_file);
+        auto index_timer = metrics.measure(stage::ancestral_reconstruction, substage::ar_indexing);
+        std::vector<std::unique_ptr<reader>> readers;
+        for (const auto& matrix_file : result.matrix_files)
+        {
+            readers.push_back(make_reader(software, matrix_file));
+            metrics.add_bytes_read(fs::file_size(matrix_file));
+        }
+        auto reader = readers.size() == 1 ? std::move(readers.front()) : make_partitioned_reader(std::move(readers));
+        index_timer.stop();
         /// Create the wrapper for the AR results
         auto matrix = proba_matrix(std::move(reader));
 
 
-        /// Read the tree generated by AR software
-        auto ar_tree = i2l::io::load_newick(result.tree_file);
+        /// Read the tree generated by AR software. The partitions are reconstructed on the same
+        /// tree, so their trees differ only in branch lengths
+        auto ar_tree = i2l::io::load_newick(result.tree_files.front());
+        if (result.tree_files.size() > 1)
+        {
+            const auto labels = get_labels(ar_tree);
+            for (size_t i = 1; i < result.tree_files.size(); ++i)
+            {
+                if (get_labels(i2l::io::load_newick(result.tree_files[i])) != labels)
+                {
+                    throw std::runtime_error("Error during ancestral reconstruction: the trees of the partitions differ: "
+                                             + result.tree_files.front() + " and " + result.tree_files[i]);
+                }
+            }
+        }
 
         return { std::move(matrix), std::move(ar_tree) };
     }
@@ -798,6 +1136,8 @@ namespace ipk::ar
         }
 
         ar::mapping ext_to_ar;
+        ext_to_ar.extended_labels.resize(extended_tree.get_node_count());
+        ext_to_ar.ar_labels.resize(extended_tree.get_node_count());
 
         /// Traverse the extended and AR tree at the same time
         using const_iterator = i2l::postorder_tree_iterator<true>;
@@ -819,7 +1159,9 @@ namespace ipk::ar
             }
 
             //std::cout << ext_it->get_label() << " -> " << ar_it->get_label() << std::endl;
-            ext_to_ar[ext_it->get_label()] = ar_it->get_label();
+            const auto id = static_cast<node_id>(ext_it->get_postorder_id());
+            ext_to_ar.extended_labels[id] = ext_it->get_label();
+            ext_to_ar.ar_labels[id] = ar_it->get_label();
             ++ext_it;
             ++ar_it;
 
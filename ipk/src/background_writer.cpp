@@ -0,0 +1,122 @@
+#include <algorithm>
+#include "background_writer.h"
+
+using namespace ipk;
+
+background_writer::background_writer(size_t max_bytes, discard_callback on_discard)
+    : _max_bytes{ max_bytes }
+    , _on_discard{ std::move(on_discard) }
+{
+    _thread = std::thread(&background_writer::run, this);
+}
+
+background_writer::~background_writer() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopped = true;
+        discard();
+    }
+    _not_empty.notify_all();
+    _not_full.notify_all();
+    _thread.join();
+}
+
+void background_writer::push(size_t bytes, task write_task)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _not_full.wait(lock, [this, bytes]() {
+        return _error || _bytes == 0 || _bytes + bytes <= _max_bytes;
+    });
+    if (_error && _on_discard)
+    {
+        _on_discard(bytes);
+    }
+    check_error();
+
+    _tasks.emplace_back(bytes, std::move(write_task));
+    _bytes += bytes;
+    lock.unlock();
+    _not_empty.notify_one();
+}
+
+void background_writer::finish()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _empty.wait(lock, [this]() { return _error || (_tasks.empty() && !_running); });
+    check_error();
+}
+
+void background_writer::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _not_empty.wait(lock, [this]() { return _stopped || !_tasks.empty(); });
+        if (_stopped)
+        {
+            break;
+        }
+
+        auto [bytes, write_task] = std::move(_tasks.front());
+        _tasks.pop_front();
+        _running = true;
+        lock.unlock();
+
+        std::exception_ptr error;
+        try
+        {
+            write_task();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        /// Release the memory of the task before accepting new ones
+        write_task = nullptr;
+
+        lock.lock();
+        _running = false;
+        _bytes -= bytes;
+        if (error)
+        {
+            if (_on_discard)
+            {
+                _on_discard(bytes);
+            }
+
+            if (!_error)
+            {
+                _error = error;
+                discard();
+            }
+        }
+        _not_full.notify_all();
+        _empty.notify_all();
+    }
+}
+
+void background_writer::discard()
+{
+    size_t discarded = 0;
+    for (const auto& [bytes, write_task] : _tasks)
+    {
+        discarded += bytes;
+    }
+    _tasks.clear();
+    _bytes -= discarded;
+
+    if (_on_discard && discarded > 0)
+    {
+        _on_discard(discarded);
+    }
+}
+
+void background_writer::check_error() const
+{
+    if (_error)
+    {
+        std::rethrow_exception(_error);
+    }
+}
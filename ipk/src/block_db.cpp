@@ -0,0 +1,165 @@
+#include <cstring>
+#include <stdexcept>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <i2l/seq.h>
+#include "block_db.h"
+
+using namespace ipk;
+using namespace ipk::blocks;
+namespace io = boost::iostreams;
+
+std::vector<char> ipk::blocks::compress(const std::vector<char>& data, int level)
+{
+    if (level == 0)
+    {
+        return data;
+    }
+
+    std::vector<char> compressed;
+    compressed.reserve(data.size() / 2);
+    {
+        io::filtering_ostream out;
+        out.push(io::zlib_compressor(io::zlib_params(level)));
+        out.push(io::back_inserter(compressed));
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+    return compressed;
+}
+
+std::vector<char> ipk::blocks::decompress(const char* data, size_t size, size_t uncompressed_size, int level)
+{
+    if (level == 0)
+    {
+        return { data, data + size };
+    }
+
+    std::vector<char> uncompressed;
+    uncompressed.reserve(uncompressed_size);
+    {
+        io::filtering_istream in;
+        in.push(io::zlib_decompressor());
+        in.push(io::array_source(data, size));
+        io::copy(in, io::back_inserter(uncompressed));
+    }
+
+    if (uncompressed.size() != uncompressed_size)
+    {
+        throw std::runtime_error("Corrupted block of the database");
+    }
+    return uncompressed;
+}
+
+block_db::block_db(const std::string& filename)
+    : _file(filename)
+{
+    if (_file.size() < sizeof(header))
+    {
+        throw std::runtime_error("Not a block IPK database: " + filename);
+    }
+
+    _header = reinterpret_cast<const header*>(_file.data());
+    if (std::memcmp(_header->magic, blocks::magic, sizeof(blocks::magic)) != 0)
+    {
+        throw std::runtime_error("Not a block IPK database: " + filename);
+    }
+
+    if (_header->version != blocks::version || _header->entry_size != sizeof(flat::entry))
+    {
+        throw std::runtime_error("Unsupported version of the block IPK database: " + filename);
+    }
+
+    if (std::string(_header->sequence_type) != i2l::seq_type::name)
+    {
+        throw std::runtime_error("Wrong sequence type of the database " + filename + ": " +
+                                 std::string(_header->sequence_type));
+    }
+
+    if (_header->block_index_offset + _header->num_blocks * sizeof(block_record) > _file.size() ||
+        _header->tree_offset + _header->tree_size > _file.size() ||
+        _header->tree_index_offset + _header->tree_index_size * sizeof(flat::node_record) > _file.size())
+    {
+        throw std::runtime_error("The block IPK database is truncated: " + filename);
+    }
+
+    _blocks = reinterpret_cast<const block_record*>(_file.data() + _header->block_index_offset);
+    for (size_t i = 0; i < _header->num_blocks; ++i)
+    {
+        if (_blocks[i].offset + _blocks[i].size > _file.size())
+        {
+            throw std::runtime_error("The block IPK database is truncated: " + filename);
+        }
+    }
+}
+
+std::vector<kmer_record> block_db::read_block(size_t block_index) const
+{
+    const auto& record = block(block_index);
+    const auto data = decompress(_file.data() + record.offset, record.size, record.uncompressed_size,
+                                 static_cast<int>(_header->compression_level));
+
+    std::vector<kmer_record> kmers(record.num_kmers);
+    size_t position = 0;
+    const auto read = [&data, &position](void* value, size_t size) {
+        if (position + size > data.size())
+        {
+            throw std::runtime_error("Corrupted block of the database");
+        }
+        std::memcpy(value, data.data() + position, size);
+        position += size;
+    };
+
+    for (auto& kmer : kmers)
+    {
+        uint32_t num_entries = 0;
+        read(&kmer.key, sizeof(kmer.key));
+        read(&kmer.filter_value, sizeof(kmer.filter_value));
+        read(&num_entries, sizeof(num_entries));
+
+        kmer.entries.resize(num_entries);
+        read(kmer.entries.data(), num_entries * sizeof(flat::entry));
+    }
+    return kmers;
+}
+
+size_t block_db::num_blocks() const noexcept
+{
+    return _header->num_blocks;
+}
+
+const block_record& block_db::block(size_t block_index) const
+{
+    if (block_index >= _header->num_blocks)
+    {
+        throw std::out_of_range("Block index out of range: " + std::to_string(block_index));
+    }
+    return _blocks[block_index];
+}
+
+size_t block_db::size() const noexcept
+{
+    return _header->num_kmers;
+}
+
+size_t block_db::kmer_size() const noexcept
+{
+    return _header->kmer_size;
+}
+
+i2l::phylo_kmer::score_type block_db::omega() const noexcept
+{
+    return _header->omega;
+}
+
+std::string_view block_db::tree() const noexcept
+{
+    return { _file.data() + _header->tree_offset, _header->tree_size };
+}
+
+const flat::node_record* block_db::tree_index() const noexcept
+{
+    return reinterpret_cast<const flat::node_record*>(_file.data() + _header->tree_index_offset);
+}
@@ -1,30 +1,246 @@
 #include "branch_group.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/stream.hpp>
 
 using namespace i2l;
 using namespace ipk;
 namespace fs = boost::filesystem;
+namespace io = boost::iostreams;
 
-void ipk::save_group_map(const group_hash_map& map, const std::string& filename)
+spill_codec ipk::parse_spill_codec(const std::string& name)
 {
-    std::ofstream ofs(filename);
-    boost::archive::binary_oarchive oa(ofs);
-    oa & map;
+    if (name == "archive")
+    {
+        return spill_codec::archive;
+    }
+    else if (name == "delta")
+    {
+        return spill_codec::delta;
+    }
+    else if (name == "quantized")
+    {
+        return spill_codec::quantized;
+    }
+    throw std::runtime_error("Unknown spill codec: " + name + ". Supported: archive, delta, quantized.");
+}
+
+namespace
+{
+    /// The largest quantized score
+    constexpr uint16_t max_quantized = std::numeric_limits<uint16_t>::max();
+
+    void put_varint(std::string& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    template<typename T>
+    void put_raw(std::string& out, T value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    /// Reads a segment encoded by the delta codecs
+    class segment_reader
+    {
+    public:
+        segment_reader(const char* data, size_t size)
+            : _data{ data }, _end{ data + size }
+        {}
+
+        uint64_t get_varint()
+        {
+            uint64_t value = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7)
+            {
+                check(1);
+                const auto byte = static_cast<unsigned char>(*_data++);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                {
+                    return value;
+                }
+            }
+            throw std::runtime_error("Internal error: corrupted spill segment");
+        }
+
+        template<typename T>
+        T get_raw()
+        {
+            check(sizeof(T));
+            T value;
+            std::memcpy(&value, _data, sizeof(T));
+            _data += sizeof(T);
+            return value;
+        }
+
+    private:
+        void check(size_t size) const
+        {
+            if (static_cast<size_t>(_end - _data) < size)
+            {
+                throw std::runtime_error("Internal error: corrupted spill segment");
+            }
+        }
+
+        const char* _data;
+        const char* _end;
+    };
+
+    phylo_kmer::score_type get_score(const group_hash_map::mapped_type& value)
+    {
+#ifdef KEEP_POSITIONS
+        return value.score;
+#else
+        return value;
+#endif
+    }
+
+    /// Keys are sorted and stored as deltas, followed by the column of scores and the column of positions
+    std::string save_delta(const group_hash_map& map, bool quantize, phylo_kmer::score_type log_threshold)
+    {
+        std::vector<std::pair<phylo_kmer::key_type, group_hash_map::mapped_type>> kmers(map.begin(), map.end());
+        std::sort(kmers.begin(), kmers.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::string out;
+        out.reserve(1 + sizeof(log_threshold) + kmers.size() * (quantize ? 4 : 6));
+        out.push_back(static_cast<char>(quantize ? spill_codec::quantized : spill_codec::delta));
+        put_varint(out, kmers.size());
+        if (quantize)
+        {
+            put_raw(out, log_threshold);
+        }
+
+        phylo_kmer::key_type previous = 0;
+        for (const auto& [key, value] : kmers)
+        {
+            put_varint(out, key - previous);
+            previous = key;
+        }
+
+        for (const auto& [key, value] : kmers)
+        {
+            const auto score = get_score(value);
+            if (quantize)
+            {
+                const auto ratio = std::clamp((score - log_threshold) / -log_threshold, 0.0f, 1.0f);
+                put_raw(out, static_cast<uint16_t>(std::lround(ratio * max_quantized)));
+            }
+            else
+            {
+                put_raw(out, score);
+            }
+        }
+
+#ifdef KEEP_POSITIONS
+        for (const auto& [key, value] : kmers)
+        {
+            put_varint(out, value.position);
+        }
+#endif
+        return out;
+    }
+
+    group_hash_map load_delta(const char* data, size_t size, bool quantize)
+    {
+        segment_reader in(data, size);
+        const auto num_kmers = in.get_varint();
+        const auto log_threshold = quantize ? in.get_raw<phylo_kmer::score_type>() : 0.0f;
+
+        std::vector<phylo_kmer::key_type> keys(num_kmers);
+        phylo_kmer::key_type key = 0;
+        for (auto& k : keys)
+        {
+            key += in.get_varint();
+            k = key;
+        }
+
+        std::vector<phylo_kmer::score_type> scores(num_kmers);
+        for (auto& score : scores)
+        {
+            if (quantize)
+            {
+                const auto ratio = static_cast<phylo_kmer::score_type>(in.get_raw<uint16_t>()) / max_quantized;
+                score = log_threshold - ratio * log_threshold;
+            }
+            else
+            {
+                score = in.get_raw<phylo_kmer::score_type>();
+            }
+        }
+
+        group_hash_map map;
+        map.reserve(num_kmers);
+        for (size_t i = 0; i < num_kmers; ++i)
+        {
+#ifdef KEEP_POSITIONS
+            const auto position = static_cast<phylo_kmer::pos_type>(in.get_varint());
+            map[keys[i]] = { scores[i], position };
+#else
+            map[keys[i]] = scores[i];
+#endif
+        }
+        return map;
+    }
+}
+
+std::string ipk::save_group_map(const group_hash_map& map, spill_codec codec, phylo_kmer::score_type log_threshold)
+{
+    if (codec != spill_codec::archive)
+    {
+        return save_delta(map, codec == spill_codec::quantized && log_threshold < 0, log_threshold);
+    }
+
+    std::string data(1, static_cast<char>(spill_codec::archive));
+    io::stream<io::back_insert_device<std::string>> out(data);
+    {
+        boost::archive::binary_oarchive oa(out);
+        oa & map;
+    }
+    out.flush();
+    return data;
+}
+
+size_t ipk::memory_usage(const group_hash_map& map)
+{
+    return map.bucket_count() * sizeof(group_hash_map::value_type);
 }
 
-/// \brief Loads a hash map from file
-group_hash_map ipk::load_group_map(const std::string& filename)
+group_hash_map ipk::load_group_map(const char* data, size_t size)
 {
-    std::ifstream ifs(filename);
-    if (!ifs)
+    if (size == 0)
     {
-        throw std::runtime_error("Internal error: could not load an auxiliary database: " + filename);
+        throw std::runtime_error("Internal error: empty spill segment");
     }
-    boost::archive::binary_iarchive ia(ifs);
+
+    const auto codec = static_cast<spill_codec>(data[0]);
+    if (codec == spill_codec::delta || codec == spill_codec::quantized)
+    {
+        return load_delta(data + 1, size - 1, codec == spill_codec::quantized);
+    }
+
+    io::stream<io::array_source> in(data + 1, size - 1);
+    boost::archive::binary_iarchive ia(in);
 
     group_hash_map map;
     ia & map;
@@ -36,31 +252,236 @@ std::string ipk::get_groups_dir(const std::string& working_dir)
     return { (fs::path{working_dir} / fs::path{"hashmaps"}).string() };
 }
 
-std::string ipk::get_group_map_file(const std::string& working_dir, const phylo_kmer::branch_type& group, size_t batch_idx)
+std::string ipk::get_spill_file(const std::string& working_dir, size_t batch_idx)
+{
+    return (get_groups_dir(working_dir) / fs::path{std::to_string(batch_idx) + ".spill"}).string();
+}
+
+namespace
+{
+    std::string get_spill_index_file(const std::string& filename)
+    {
+        return filename + ".index";
+    }
+
+    /// Rewrites the index of a spill file with the complete records of the segments that
+    /// are in the file. Otherwise, a line written partially by the interrupted run would
+    /// be merged with the next one. The index is replaced atomically, like the build journal
+    void rewrite_spill_index(const std::string& filename)
+    {
+        const auto index_file = get_spill_index_file(filename);
+        if (!fs::exists(filename) || !fs::exists(index_file))
+        {
+            return;
+        }
+
+        const auto index = load_spill_index(filename);
+        std::vector<spill_segment> segments;
+        segments.reserve(index.size());
+        for (const auto& [group, segment] : index)
+        {
+            segments.push_back(segment);
+        }
+        std::sort(segments.begin(), segments.end(),
+                  [](const auto& a, const auto& b) { return a.offset < b.offset; });
+
+        const auto temp_file = index_file + ".tmp";
+        {
+            std::ofstream out(temp_file, std::ios::trunc);
+            for (const auto& segment : segments)
+            {
+                out << segment.group << ' ' << segment.offset << ' ' << segment.size << ' '
+                    << segment.num_entries << '\n';
+            }
+
+            if (!out.flush())
+            {
+                throw std::runtime_error("Could not write the index of a spill file: " + temp_file);
+            }
+        }
+        fs::rename(temp_file, index_file);
+    }
+}
+
+spill_file::spill_file(const std::string& filename, bool resume)
+{
+    if (resume)
+    {
+        rewrite_spill_index(filename);
+    }
+
+    /// The data is not buffered, so that a segment is in the file before its line of the index
+    _data.rdbuf()->pubsetbuf(nullptr, 0);
+
+    const auto mode = std::ios::binary | (resume ? std::ios::app : std::ios::trunc);
+    _data.open(filename, mode);
+    _index.open(get_spill_index_file(filename), mode);
+    if (!_data || !_index)
+    {
+        throw std::runtime_error("Could not open the spill file: " + filename);
+    }
+    _size = resume ? fs::file_size(filename) : 0;
+}
+
+size_t spill_file::append(phylo_kmer::branch_type group, const std::string& data, size_t num_entries)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto offset = _size;
+    _data.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!_data)
+    {
+        throw std::runtime_error("Could not write to a spill file");
+    }
+    _size += data.size();
+
+    /// The segment is listed only when it is written completely
+    _index << group << ' ' << offset << ' ' << data.size() << ' ' << num_entries << '\n' << std::flush;
+    if (!_index)
+    {
+        throw std::runtime_error("Could not write to the index of a spill file");
+    }
+    return data.size();
+}
+
+spill_index ipk::load_spill_index(const std::string& filename)
 {
-    return (get_groups_dir(working_dir) /
-            fs::path{std::to_string(group) + "_" + std::to_string(batch_idx) + ".hash"}).string();
+    const auto index_file = get_spill_index_file(filename);
+    std::ifstream in(index_file);
+    if (!in || !fs::exists(filename))
+    {
+        throw std::runtime_error("Internal error: could not load a spill file: " + filename);
+    }
+    const auto file_size = fs::file_size(filename);
+
+    spill_index index;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        /// A line without the end of line was not written completely
+        if (in.eof())
+        {
+            break;
+        }
+
+        std::istringstream record(line);
+        spill_segment segment{};
+        if (record >> segment.group >> segment.offset >> segment.size >> segment.num_entries &&
+            segment.offset + segment.size <= file_size)
+        {
+            index[segment.group] = segment;
+        }
+    }
+    return index;
+}
+
+std::string ipk::read_segment(const std::string& filename, const spill_segment& segment)
+{
+    std::ifstream in(filename, std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(segment.offset));
+
+    std::string data(segment.size, '\0');
+    if (!in.read(data.data(), static_cast<std::streamsize>(data.size())))
+    {
+        throw std::runtime_error("Internal error: could not read a spill file: " + filename);
+    }
+    return data;
+}
+
+std::pair<size_t, size_t> ipk::get_spill_size(const std::vector<std::string>& working_dirs,
+                                              const std::vector<phylo_kmer::branch_type>& group_ids,
+                                              size_t batch_idx)
+{
+    size_t size = 0;
+    size_t num_entries = 0;
+    std::unordered_map<std::string, spill_index> indices;
+    for (size_t i = 0; i < group_ids.size(); ++i)
+    {
+        const auto filename = get_spill_file(working_dirs[i], batch_idx);
+        auto it = indices.find(filename);
+        if (it == indices.end())
+        {
+            it = indices.emplace(filename, load_spill_index(filename)).first;
+        }
+
+        if (const auto segment = it->second.find(group_ids[i]); segment != it->second.end())
+        {
+            size += segment->second.size;
+            num_entries += segment->second.num_entries;
+        }
+    }
+    return { size, num_entries };
+}
+
+bool batch_part::contains(phylo_kmer::key_type key) const
+{
+    return num_parts == 1 || (key / num_batches) % num_parts == index;
 }
 
 phylo_kmer_db ipk::merge_batch(const std::string& working_dir,
-                                const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx)
+                                const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx,
+                                const batch_part& part)
+{
+    return merge_batch(std::vector<std::string>(group_ids.size(), working_dir), group_ids, batch_idx, part);
+}
+
+phylo_kmer_db ipk::merge_batch(const std::vector<std::string>& working_dirs,
+                                const std::vector<phylo_kmer::branch_type>& group_ids, size_t batch_idx,
+                                const batch_part& part)
 {
     //std::cout << "Merging hash maps [batch index = " << batch_idx << "]..." << std::endl;
     phylo_kmer_db temp_db(0, 1.0, seq_type::name, "");
 
+    /// Spill files of the batch are mapped once per directory. Groups are inserted
+    /// in the order of group_ids, which keeps the order of entries deterministic
+    struct mapped_spill
+    {
+        io::mapped_file_source file;
+        spill_index index;
+    };
+    std::unordered_map<std::string, mapped_spill> spills;
+
     /// Load hash maps and merge them
-    for (const auto group_id : group_ids)
+    for (size_t i = 0; i < group_ids.size(); ++i)
     {
-        const auto hash_map = load_group_map(get_group_map_file(working_dir, group_id, batch_idx));
+        const auto group_id = group_ids[i];
+        const auto filename = get_spill_file(working_dirs[i], batch_idx);
+
+        auto it = spills.find(filename);
+        if (it == spills.end())
+        {
+            it = spills.emplace(filename, mapped_spill{ {}, load_spill_index(filename) }).first;
+            if (fs::file_size(filename) > 0)
+            {
+                it->second.file.open(filename);
+            }
+        }
+
+        const auto& [file, index] = it->second;
+        const auto segment = index.find(group_id);
+        if (segment == index.end())
+        {
+            throw std::runtime_error("Internal error: no phylo-k-mers of the group " + std::to_string(group_id) +
+                                     " in " + filename);
+        }
+
+        const auto hash_map = load_group_map(file.data() + segment->second.offset, segment->second.size);
 #ifdef KEEP_POSITIONS
         for (const auto& [key, score_pos_pair] : hash_map)
             {
+                if (!part.contains(key))
+                {
+                    continue;
+                }
                 const auto& [score, position] = score_pos_pair;
                 temp_db.unsafe_insert(key, {group_id, score, position});
             }
 #else
         for (const auto& [key, score] : hash_map)
         {
+            if (!part.contains(key))
+            {
+                continue;
+            }
             temp_db.unsafe_insert(key, {group_id, score});
         }
 #endif
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cctype>
+#include <sstream>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
@@ -23,6 +26,7 @@ namespace ipk::cli
     static std::string AR_MODEL = "model", AR_MODEL_SHORT = "m";
     static std::string AR_ALPHA = "alpha", AR_ALPHA_SHORT = "a";
     static std::string AR_CATEGORIES = "categories";
+    static std::string AR_PARTITIONS = "ar-partitions";
     static std::string AR_ONLY = "ar-only";
     static std::string AR_PARAMETERS = "ar-parameters";
 
@@ -51,8 +55,24 @@ namespace ipk::cli
     static std::string GHOSTS_BOTH = "both";
 
     static std::string ON_DISK = "on-disk";
+    static std::string SCHEDULE = "schedule";
+    static std::string RESUME = "resume";
+    static std::string SHARD = "shard";
+    static std::string KEEP_GROUPS = "keep-groups";
+    static std::string FORMAT = "format";
+    static std::string COMPRESSION_LEVEL = "compression-level";
+    static std::string SPILL_CODEC = "spill-codec";
+    static std::string MAX_RAM = "max-ram";
+    static std::string UPDATE_FROM = "update-from";
+
+    /// Merge of shards
+    static std::string MERGE_SHARDS = "merge-shards";
+    static std::string SHARDS = "shards";
 
     static std::string VERBOSITY = "verbosity", VERBOSITY_SHORT = "v";
+    static std::string METRICS_JSON = "metrics-json";
+    static std::string PROFILE = "profile";
+    static std::string PROFILE_TOP = "profile-top";
 
 
     /// Algorithm flags
@@ -79,6 +99,8 @@ namespace ipk::cli
 
     /// Filtering algorithm flags
     bool on_disk_flag = false;
+    bool resume_flag = false;
+    bool keep_groups_flag = false;
 
     po::options_description get_opt_description()
     {
@@ -107,19 +129,23 @@ namespace ipk::cli
                 "Gamma shape parameter, used in ancestral reconstruction.")
             (AR_CATEGORIES.c_str(), po::value<int>()->default_value(4),
                 "Number of relative substitution rate categories, used in ancestral reconstruction.")
+            (AR_PARTITIONS.c_str(), po::value<size_t>()->default_value(1),
+                "Splits the extended alignment into this number of column partitions and runs "
+                "ancestral reconstruction on them concurrently. RAxML-NG only.")
             ((AR_ONLY).c_str(), po::bool_switch(&ar_only_flag))
             (AR_PARAMETERS.c_str(), po::value<std::string>()->default_value(""),
                 "Whitespace-separated list of arguments passed to the ancestral reconstruction tool.")
 
-            ((K + "," + K_SHORT).c_str(), po::value<size_t>()->default_value(8),
-                "k-mer length used at DB build")
+            ((K + "," + K_SHORT).c_str(), po::value<std::string>()->default_value("8"),
+                "k-mer length used at DB build. A comma-separated list, e.g. 6,8,10, builds a database "
+                "for every value in one run")
             (REDUCTION_RATIO.c_str(), po::value<double>()->default_value(0.99),
                 "Ratio for alignment reduction, e.g. sites holding >X% gaps are ignored.")
             (NO_REDUCTION.c_str(), po::bool_switch(&no_reduction_flag),
                 "Disable alignment reduction. This will keep all sites of the reference alignment and "
                 "may produce erroneous ancestral k-mers.")
-            ((OMEGA).c_str(), po::value<i2l::phylo_kmer::score_type>()->default_value(1.5f),
-                "Score threshold parameter")
+            ((OMEGA).c_str(), po::value<std::string>()->default_value("1.5"),
+                "Score threshold parameter. A comma-separated list builds a database for every value in one run")
             ((NUM_THREADS + "," + NUM_THREADS_SHORT).c_str(), po::value<size_t>()->default_value(1),
                 "Number of threads")
             ((MERGE_BRANCHES).c_str(), po::bool_switch(&merge_branches_flag))
@@ -139,9 +165,72 @@ namespace ipk::cli
             ((GHOSTS_BOTH).c_str(), po::bool_switch(&both_flag))
 
             ((ON_DISK).c_str(), po::bool_switch(&on_disk_flag))
+            (SCHEDULE.c_str(), po::value<std::string>()->default_value("longest-first"),
+                "The order in which branches are processed in parallel: "
+                "tree (traversal order) or longest-first (the most expensive branches first)")
+            (RESUME.c_str(), po::bool_switch(&resume_flag),
+                "Continue an interrupted --on-disk build in the same working directory. "
+                "Reuses the results of ancestral reconstruction and the completed branches and batches.")
+            (SHARD.c_str(), po::value<std::string>()->default_value(""),
+                "i/N: compute phylo-k-mers only for the shard i (0 <= i < N) of the branches and keep them "
+                "in the working directory. Requires --on-disk. Merge the shards with merge-shards.")
+            (FORMAT.c_str(), po::value<std::string>()->default_value("ipk"),
+                "The layout of the output database: ipk (Boost archive), flat "
+                "(memory-mapped and queried without parsing) or blocks (compressed in parallel)")
+            (COMPRESSION_LEVEL.c_str(), po::value<int>()->default_value(6),
+                "The zlib compression level of the blocks layout, from 0 (none) to 9")
+            (SPILL_CODEC.c_str(), po::value<std::string>()->default_value("archive"),
+                "The encoding of temporary files of --on-disk builds: archive, delta (delta-encoded keys) "
+                "or quantized (delta-encoded keys and 16-bit scores, lossy)")
+            (MAX_RAM.c_str(), po::value<std::string>()->default_value(""),
+                "The memory budget, e.g. 512M or 16G. A build in RAM that exceeds it continues on disk, "
+                "and on-disk batches that would exceed it are merged in parts. Memory is estimated.")
+            (KEEP_GROUPS.c_str(), po::bool_switch(&keep_groups_flag),
+                "Keep the phylo-k-mers of every branch in the working directory of an --on-disk build, "
+                "so that the database can be updated later with --update-from.")
+            (UPDATE_FROM.c_str(), po::value<fs::path>()->default_value(""),
+                "The working directory of a previous --on-disk build made with --keep-groups and the same "
+                "parameters. Branches whose ancestral probabilities did not change are copied from it "
+                "instead of being computed again. Requires --on-disk.")
 
             ((VERBOSITY + "," + VERBOSITY_SHORT).c_str(), po::value<int>()->default_value(1),
              "Output verbosity [0=none, 1=default, 2=high]")
+            (METRICS_JSON.c_str(), po::value<fs::path>()->default_value(""),
+             "Write per-stage construction metrics in JSON to the specified file")
+            (PROFILE.c_str(), po::value<fs::path>()->default_value(""),
+             "Write the construction cost of every branch group in JSON to the specified file")
+            (PROFILE_TOP.c_str(), po::value<size_t>()->default_value(10),
+             "The number of the most expensive branch groups to report in the profile")
+            ;
+        return desc;
+    }
+
+    po::options_description get_merge_opt_description()
+    {
+        po::options_description desc("Options of " + MERGE_SHARDS + " (usage: IPK " + MERGE_SHARDS + " [...])");
+        desc.add_options()
+            ((HELP + "," + HELP_SHORT).c_str(),
+                "Show help")
+            (SHARDS.c_str(), po::value<std::vector<std::string>>()->multitoken()->required(),
+                "Working directories of all the shard builds")
+            ((WORKING_DIR + "," + WORKING_DIR_SHORT).c_str(), po::value<fs::path>()->default_value(fs::current_path()),
+                "Path to the working directory. Must differ from the shard directories")
+            ((OUTPUT_FILENAME + "," + OUTPUT_FILENAME_SHORT).c_str(), po::value<fs::path>()->default_value(""),
+             "Output filename")
+            (FORMAT.c_str(), po::value<std::string>()->default_value("ipk"),
+                "The layout of the output database: ipk, flat or blocks")
+            (COMPRESSION_LEVEL.c_str(), po::value<int>()->default_value(6),
+                "The zlib compression level of the blocks layout, from 0 (none) to 9")
+            ((UNCOMPRESSED).c_str(), po::bool_switch(&uncompressed_flag),
+                "Disables database compression, as for the shard builds")
+            (RESUME.c_str(), po::bool_switch(&resume_flag),
+                "Continue an interrupted merge in the same working directory")
+            (MAX_RAM.c_str(), po::value<std::string>()->default_value(""),
+                "The memory budget, e.g. 512M or 16G. Batches that would exceed it are merged in parts")
+            ((VERBOSITY + "," + VERBOSITY_SHORT).c_str(), po::value<int>()->default_value(1),
+             "Output verbosity [0=none, 1=default, 2=high]")
+            (METRICS_JSON.c_str(), po::value<fs::path>()->default_value(""),
+             "Write per-stage construction metrics in JSON to the specified file")
             ;
         return desc;
     }
@@ -149,10 +238,139 @@ namespace ipk::cli
     std::string get_option_list()
     {
         std::stringstream ss;
-        ss << get_opt_description();
+        ss << get_opt_description() << std::endl << get_merge_opt_description();
         return ss.str();
     }
 
+    /// Parses a comma-separated list of distinct values
+    template<typename T>
+    std::vector<T> parse_list(const std::string& value, const std::string& option)
+    {
+        std::vector<T> values;
+        std::istringstream in(value);
+        std::string token;
+        while (std::getline(in, token, ','))
+        {
+            std::istringstream token_stream(token);
+            T parsed;
+            if (!(token_stream >> parsed) || !(token_stream >> std::ws).eof())
+            {
+                throw std::runtime_error("Wrong --" + option + " value: " + value + ". Expected a comma-separated list.");
+            }
+
+            if (std::find(values.begin(), values.end(), parsed) != values.end())
+            {
+                throw std::runtime_error("Wrong --" + option + " value: " + value + ". Values must be distinct.");
+            }
+            values.push_back(parsed);
+        }
+
+        if (values.empty())
+        {
+            throw std::runtime_error("Wrong --" + option + " value: " + value + ". Expected a comma-separated list.");
+        }
+        return values;
+    }
+
+    /// Parses the shard specification i/N
+    std::pair<size_t, size_t> parse_shard(const std::string& shard)
+    {
+        size_t shard_index = 0;
+        size_t num_shards = 0;
+        char separator = 0;
+
+        std::istringstream in(shard);
+        if (!(in >> shard_index >> separator >> num_shards) || separator != '/' || !in.eof() ||
+            num_shards == 0 || shard_index >= num_shards)
+        {
+            throw std::runtime_error("Wrong --" + SHARD + " value: " + shard + ". Expected i/N, where 0 <= i < N.");
+        }
+        return { shard_index, num_shards };
+    }
+
+    /// Parses the memory budget: a number of bytes with an optional suffix K, M, G or T
+    size_t parse_memory_size(const std::string& size)
+    {
+        const auto error = std::runtime_error("Wrong --" + MAX_RAM + " value: " + size +
+                                              ". Expected a size like 512M or 16G.");
+        size_t value = 0;
+        std::string suffix;
+
+        std::istringstream in(size);
+        if (!(in >> value))
+        {
+            throw error;
+        }
+        in >> suffix;
+
+        const std::string suffixes = "KMGT";
+        if (suffix.empty())
+        {
+            return value;
+        }
+
+        const auto power = suffixes.find((char)std::toupper(suffix[0]));
+        if (suffix.size() > 1 || power == std::string::npos)
+        {
+            throw error;
+        }
+        return value << (10 * (power + 1));
+    }
+
+    std::string get_output_filename(const po::variables_map& vm, const std::string& working_directory)
+    {
+        const auto output_filename = vm[OUTPUT_FILENAME].as<fs::path>().string();
+
+        /// Default output name if not given
+        if (output_filename.empty())
+        {
+            return (working_directory / fs::path("DB.ipk")).string();
+        }
+        return output_filename;
+    }
+
+    parameters process_merge_command_line(int argc, const char* argv[])
+    {
+        parameters parameters;
+
+        const po::options_description desc = get_merge_opt_description();
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count(HELP))
+        {
+            parameters.action = action_t::help;
+            return parameters;
+        }
+        po::notify(vm);
+
+        parameters.action = action_t::merge_shards;
+
+        const auto workdir_relative = vm[WORKING_DIR].as<fs::path>().string();
+        parameters.working_directory = fs::system_complete(workdir_relative).string();
+        parameters.output_filename = get_output_filename(vm, parameters.working_directory);
+
+        for (const auto& directory : vm[SHARDS].as<std::vector<std::string>>())
+        {
+            parameters.shard_directories.push_back(fs::system_complete(directory).string());
+        }
+
+        parameters.on_disk = true;
+        parameters.merge_branches = false;
+        parameters.keep_groups = false;
+        parameters.format = vm[FORMAT].as<std::string>();
+        parameters.compression_level = vm[COMPRESSION_LEVEL].as<int>();
+        parameters.uncompressed = uncompressed_flag;
+        parameters.resume = resume_flag;
+        const auto max_ram = vm[MAX_RAM].as<std::string>();
+        parameters.max_ram = max_ram.empty() ? 0 : parse_memory_size(max_ram);
+        parameters.shard_index = 0;
+        parameters.num_shards = 0;
+        parameters.verbose = vm[VERBOSITY].as<int>();
+        parameters.metrics_json = vm[METRICS_JSON].as<fs::path>().string();
+        return parameters;
+    }
+
     const char* to_cstr(const std::string &s)
     {
         return s.c_str();
@@ -224,6 +442,12 @@ namespace ipk::cli
         parameters parameters;
         try
         {
+            /// IPK merge-shards [...]
+            if (argc > 1 && argv[1] == MERGE_SHARDS)
+            {
+                return process_merge_command_line(argc - 1, argv + 1);
+            }
+
             /// Command line arguments can contain arguments like:
             ///     --ar-parameters "--param1 value1 --param2 value2"
             /// In this cases, quotes are ignored and parsed into many
@@ -254,28 +478,23 @@ namespace ipk::cli
             const auto workdir_relative = vm[WORKING_DIR].as<fs::path>().string();
             parameters.working_directory = fs::system_complete(workdir_relative).string();
 
-            parameters.output_filename = vm[OUTPUT_FILENAME].as<fs::path>().string();
-
-            /// Default output name if not given
-            if (parameters.output_filename.empty())
-            {
-                parameters.output_filename = (parameters.working_directory / fs::path("DB.ipk")).string();
-            }
+            parameters.output_filename = get_output_filename(vm, parameters.working_directory);
 
             parameters.alignment_file = vm[REFALIGN].as<fs::path>().string();
             parameters.original_tree_file = vm[REFTREE].as<fs::path>().string();
-            parameters.kmer_size = vm[K].as<size_t>();
+            parameters.kmer_sizes = parse_list<size_t>(vm[K].as<std::string>(), K);
 
             parameters.ar_dir = vm[AR_DIR].as<std::string>();
             parameters.ar_binary_file = vm[AR_BINARY].as<std::string>();
             parameters.ar_model = vm[AR_MODEL].as<std::string>();
             parameters.ar_alpha = vm[AR_ALPHA].as<double>();
             parameters.ar_categories = vm[AR_CATEGORIES].as<int>();
+            parameters.ar_partitions = vm[AR_PARTITIONS].as<size_t>();
             parameters.ar_only = ar_only_flag;
             parameters.ar_parameters = vm[AR_PARAMETERS].as<std::string>();
 
             parameters.reduction_ratio = vm[REDUCTION_RATIO].as<double>();
-            parameters.omega = vm[OMEGA].as<i2l::phylo_kmer::score_type>();
+            parameters.omegas = parse_list<i2l::phylo_kmer::score_type>(vm[OMEGA].as<std::string>(), OMEGA);
             parameters.num_threads = vm[NUM_THREADS].as<size_t>();
             parameters.mu = vm[MU].as<double>();
 
@@ -301,7 +520,26 @@ namespace ipk::cli
             parameters.both = both_flag;
 
             parameters.on_disk = on_disk_flag;
+            parameters.schedule = vm[SCHEDULE].as<std::string>();
+            parameters.resume = resume_flag;
+
+            parameters.format = vm[FORMAT].as<std::string>();
+            parameters.compression_level = vm[COMPRESSION_LEVEL].as<int>();
+            parameters.spill_codec = vm[SPILL_CODEC].as<std::string>();
+            const auto max_ram = vm[MAX_RAM].as<std::string>();
+            parameters.max_ram = max_ram.empty() ? 0 : parse_memory_size(max_ram);
+            parameters.keep_groups = keep_groups_flag;
+            const auto update_from = vm[UPDATE_FROM].as<fs::path>().string();
+            parameters.update_from = update_from.empty() ? "" : fs::system_complete(update_from).string();
+
+            const auto shard = vm[SHARD].as<std::string>();
+            std::tie(parameters.shard_index, parameters.num_shards) =
+                shard.empty() ? std::make_pair<size_t, size_t>(0, 0) : parse_shard(shard);
+
             parameters.verbose = vm[VERBOSITY].as<int>();
+            parameters.metrics_json = vm[METRICS_JSON].as<fs::path>().string();
+            parameters.profile = vm[PROFILE].as<fs::path>().string();
+            parameters.profile_top = vm[PROFILE_TOP].as<size_t>();
         }
         catch (const po::error& e)
         {
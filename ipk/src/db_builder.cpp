@@ -1,11 +1,21 @@
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <limits>
 #include <unordered_set>
 #include <chrono>
 #include <random>
 #include <queue>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <fstream>
 #include <boost/filesystem.hpp>
-#include <boost/algorithm/string/predicate.hpp>
 #include <indicators/cursor_control.hpp>
 #include <indicators/progress_bar.hpp>
 #include <i2l/phylo_kmer_db.h>
@@ -20,6 +30,11 @@
 #include "filter.h"
 #include "branch_group.h"
 #include "pk_compute.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "journal.h"
+#include "db_writer.h"
+#include "background_writer.h"
 
 
 using std::string;
@@ -32,6 +47,66 @@ namespace fs = boost::filesystem;
 
 namespace ipk
 {
+    /// The journal of the on-disk construction in the working directory, see build_journal
+    std::string get_journal_file(const std::string& working_directory);
+
+    /// The list of all groups written by a completed shard build
+    std::string get_shard_manifest(const std::string& working_directory);
+
+    /// The original tree of a shard build in newick
+    std::string get_shard_tree(const std::string& working_directory);
+
+    /// The maximum number of parts of a batch, see batch_part
+    constexpr size_t max_batch_parts = 256;
+
+    /// The number of groups per worker that longest-first scheduling can reorder if the groups
+    /// are inserted in the main DB in RAM, see group_scheduler
+    constexpr size_t reorder_window = 4;
+
+    /// The suffix of the output of a combination of k and omega
+    std::string get_target_name(size_t kmer_size, phylo_kmer::score_type omega)
+    {
+        std::ostringstream name;
+        name << "k" << kmer_size << "_o" << omega;
+        return name.str();
+    }
+
+    /// Estimated memory of a database of num_kmers k-mers and num_entries entries
+    size_t estimate_db_memory(size_t num_kmers, size_t num_entries)
+    {
+        /// A node of the hash map with a vector of entries, and a bucket pointer
+        const auto kmer_size = sizeof(phylo_kmer::key_type) + sizeof(pkdb_value_vector) + 2 * sizeof(void*);
+        return num_kmers * kmer_size + num_entries * sizeof(pkdb_value);
+    }
+
+    /// Estimated memory of the filter values of a database
+    size_t memory_usage(const decltype(phylo_kmer_db::kmer_order)& kmer_order)
+    {
+        return kmer_order.size() * sizeof(kmer_order[0]);
+    }
+
+    /// Estimated memory of the hashmaps of a group, see memory_component::group_maps
+    size_t memory_usage(const std::vector<group_hash_map>& hash_maps)
+    {
+        size_t bytes = 0;
+        for (const auto& hash_map : hash_maps)
+        {
+            bytes += memory_usage(hash_map);
+        }
+        return bytes;
+    }
+
+    /// Estimated memory of the probability matrices
+    size_t memory_usage(const std::vector<std::reference_wrapper<proba_matrix::mapped_type>>& matrices)
+    {
+        size_t bytes = 0;
+        for (const auto& matrix : matrices)
+        {
+            bytes += matrix.get().get_data().size() * sizeof(matrix.get().get_data()[0]);
+        }
+        return bytes;
+    }
+
     /// \brief Constructs a database of phylo-kmers.
     class db_builder
     {
@@ -40,16 +115,30 @@ namespace ipk
                           proba_matrix& matrix,
                           const ghost_mapping& mapping, const ar::mapping& ar_mapping, bool merge_branches,
                           ipk::algorithm algorithm, ipk::ghost_strategy strategy,
-                          size_t kmer_size, phylo_kmer::score_type omega,
+                          const std::vector<size_t>& kmer_sizes, const std::vector<phylo_kmer::score_type>& omegas,
                           filter_type filter, double mu,
-                          size_t num_threads, bool on_disk);
+                          size_t num_threads, bool on_disk,
+                          const build_options& options, build_metrics& metrics);
+        friend void merge_shards(const std::vector<std::string>& shard_directories,
+                                 const string& working_directory, const string& output_filename,
+                                 const build_options& options, build_metrics& metrics);
+        friend phylo_kmer_db build_in_memory(const string& working_directory,
+                                             const phylo_tree& original_tree, const phylo_tree& extended_tree,
+                                             proba_matrix& matrix,
+                                             const ghost_mapping& mapping, const ar::mapping& ar_mapping,
+                                             bool merge_branches,
+                                             ipk::algorithm algorithm, ipk::ghost_strategy strategy,
+                                             size_t kmer_size, phylo_kmer::score_type omega,
+                                             filter_type filter, double mu, size_t num_threads,
+                                             const build_options& options, build_metrics& metrics,
+                                             db_writer* sink);
     public:
         /// Member types
 
 
         /// \brief A group of node ids that must be processed together. We group together
         ///        the extended node ids that correspond to the same original node ids
-        using id_group = std::vector<std::string>;
+        using id_group = std::vector<ar::node_id>;
 
         /// \brief A group of probability submatrices that correspond to a group of nodes
         using proba_group = std::vector<std::reference_wrapper<proba_matrix::mapped_type>>;
@@ -63,7 +152,8 @@ namespace ipk
                    ipk::algorithm algorithm, ipk::ghost_strategy strategy,
                    size_t kmer_size, phylo_kmer::score_type omega,
                    filter_type filter, double mu,
-                   size_t num_threads, bool on_disk);
+                   size_t num_threads, bool on_disk,
+                   const build_options& options, build_metrics& metrics);
         db_builder(const db_builder&) = delete;
         db_builder(db_builder&&) = delete;
         db_builder& operator=(const db_builder&) = delete;
@@ -73,7 +163,31 @@ namespace ipk
         /// \brief Runs the database construction
         void run();
 
+        /// \brief Runs the filtering and merge stages over the group hashmaps computed by shards
+        /// \param group_dirs The working directory of the shard that computed group_ids[i]
+        void merge(const std::vector<phylo_kmer::branch_type>& group_ids, std::vector<std::string> group_dirs);
+
     private:
+        void print_parameters() const;
+
+        /// Fills the tree index of the database from the original tree
+        void fill_tree_index();
+
+        /// Opens the output file for the serialization of the database
+        void open_output();
+
+        /// Returns true if only a shard of the groups is explored, see build_options::num_shards
+        [[nodiscard]]
+        bool is_shard() const;
+
+        /// Returns false for the builds that must not touch the filesystem, see build_in_memory
+        [[nodiscard]]
+        bool has_working_directory() const;
+
+        /// Marks the shard as completed: saves the list of all groups and the original tree
+        /// for merge_shards
+        void save_shard(const std::vector<phylo_kmer::branch_type>& group_ids) const;
+
         /// Computes phylo-k-mers. See explore_group
         std::tuple<std::vector<phylo_kmer::branch_type>, unsigned long> compute_phylo_kmers();
 
@@ -91,11 +205,28 @@ namespace ipk
         /// Disk-based merge of batch DBs
         void merge_stage2();
 
-        std::string get_batch_db_name(size_t batch_id);
+        /// The batch database of a part of the batch, see batch_part
+        std::string get_batch_db_name(size_t batch_id, size_t part = 0);
+
+        /// \brief The number of parts to split a batch in so that the database of every part
+        /// fits in the memory budget. One if there is no budget
+        [[nodiscard]]
+        size_t get_num_parts(size_t num_entries) const;
+
+        /// The journal of the on-disk construction, see build_journal
+        [[nodiscard]]
+        std::string get_journal_file() const;
+
+        /// Parameters that must be the same to resume a build
+        [[nodiscard]]
+        build_journal::parameter_list journal_parameters() const;
 
         /// \brief Groups ghost nodes by corresponding original node id
+        /// \return 1) The groups of ghost node ids
+        ///         2) The post-order id of the original node of every group
         [[nodiscard]]
-        std::vector<id_group> group_ghost_ids(const std::vector<std::string>& ghost_ids) const;
+        std::tuple<std::vector<id_group>, std::vector<phylo_kmer::branch_type>>
+        group_ghost_ids(const std::vector<ar::node_id>& ghost_ids) const;
 
         /// \brief Groups references to submatrices of probabilites, corresponding to a group of nodes
         [[nodiscard]]
@@ -107,10 +238,67 @@ namespace ipk
         [[nodiscard]]
         std::tuple<std::vector<phylo_kmer::branch_type>, size_t> explore_kmers();
 
-        /// \brief Explores phylo-kmers of a group of ghost nodes. Here we assume that the nodes
-        ///        in the group correspond to one original node
+        /// \brief Estimates the cost of exploration for the given groups. See estimate_cost
+        /// \details The matrices of the num_kept most expensive groups, which are explored first,
+        /// stay loaded, so that they are not parsed again.
+        /// \return The costs, and the positions of the groups in group_indices whose matrices are kept
+        [[nodiscard]]
+        std::tuple<std::vector<double>, std::vector<size_t>> estimate_costs(const std::vector<id_group>& node_groups,
+                                                                            const std::vector<size_t>& group_indices,
+                                                                            size_t num_kept);
+
+        /// Frees the memory of the matrices of the group
+        void release_matrices(const id_group& group);
+
+        /// \brief Explores phylo-kmers of a group of ghost nodes for every target. Here we assume
+        ///        that the nodes in the group correspond to one original node
+        /// \param group_index The index of the group in the list of groups to explore
+        /// \param prefetched True if the matrices of the group were loaded and accounted by matrix_loader
+        [[nodiscard]]
+        size_t explore_group(const id_group& group, size_t group_index, size_t postorder_id, bool prefetched);
+
+        /// \brief Saves the phylo-k-mers of the group on disk or inserts them in the main DB.
+        /// The memory of the hashmaps is released once they are written or inserted
+        /// \return The number of distinct k-mers
+        size_t save_group(size_t group_index, phylo_kmer::branch_type postorder_id,
+                          std::vector<group_hash_map>&& hash_maps, size_t num_explored, uint64_t digest);
+
+        /// \brief Appends the hashmaps of the group to the spill files. A single hashmap is split by batch
+        /// \return The number of distinct k-mers
+        size_t spill_group(phylo_kmer::branch_type postorder_id,
+                           std::vector<group_hash_map>&& hash_maps, size_t num_explored, uint64_t digest);
+
+        /// \brief Digest of the probability matrices of a group. Groups with the same digest
+        /// have the same phylo-k-mers for the same parameters
+        [[nodiscard]]
+        static uint64_t get_digest(const proba_group& matrices);
+
+        /// Loads the digests of the groups completed by the build in build_options::update_from
+        void load_previous_groups();
+
+        /// \brief Copies the hashmaps of a group with the same digest from the previous build
+        /// \return The number of explored phylo-k-mers, or nothing if there is no such group
+        std::optional<size_t> reuse_group(phylo_kmer::branch_type postorder_id, uint64_t digest);
+
+        /// The log-threshold of phylo-k-mer scores
+        [[nodiscard]]
+        phylo_kmer::score_type log_threshold() const;
+
+        /// Distinct values of k of the targets, with the lowest log-threshold for each of them
         [[nodiscard]]
-        size_t explore_group(const id_group& group, size_t postorder_id);
+        static std::vector<std::pair<size_t, phylo_kmer::score_type>> enumeration_thresholds(
+            const std::vector<db_builder*>& targets);
+
+        /// \brief Inserts the hashmap of the group in the main DB as soon as all the groups
+        ///        with smaller indices are inserted. The hashmap stays accounted in
+        ///        memory_component::group_maps until then
+        void commit_group(size_t group_index, phylo_kmer::branch_type postorder_id, group_hash_map&& group_map,
+                          size_t num_explored, uint64_t digest);
+
+        /// \brief Moves the main DB and the groups not yet inserted in it to the spill files, and
+        /// continues the construction on disk. Called under _commit_mutex once the memory budget
+        /// is exceeded, see build_options::max_ram
+        void switch_to_disk();
 
         /// \brief Working and output directory
         string _working_directory;
@@ -141,12 +329,86 @@ namespace ipk
 
         std::string _output_filename;
 
-        /// Streams for deserialization
-        std::ofstream _ofs;
-        ::boost::archive::binary_oarchive _ar;
+        /// Serializer of the database. Opened only when the database is written
+        std::unique_ptr<db_writer> _writer;
+
+        /// The output given by the caller instead of the output file, see build_in_memory. Not owned
+        db_writer* _sink = nullptr;
+
+        /// Where the database is written: _sink or _writer
+        db_writer* _output = nullptr;
+
+        /// Keep the database in RAM after the filtering instead of writing it, see build_in_memory
+        bool _keep_database = false;
+
+        /// Writes group hashmaps of the on-disk construction while the next groups are
+        /// explored. Exists only during the exploration
+        std::unique_ptr<background_writer> _group_writer;
+
+        /// Set by switch_to_disk during the exploration
+        std::atomic<bool> _on_disk;
+
+        build_options _options;
+
+        build_metrics& _metrics;
+
+        /// The key of the counters of this database in the metrics, see get_target_name
+        std::string _target_name;
+
+        /// The number of parts of every batch, see batch_part
+        std::vector<size_t> _batch_parts;
+
+        /// A group explored, but not yet inserted in the main DB
+        struct pending_group
+        {
+            phylo_kmer::branch_type postorder_id;
+            group_hash_map map;
+            size_t num_explored;
+            uint64_t digest;
+
+            /// The memory of the hashmap, see memory_component::group_maps
+            size_t bytes;
+        };
+
+        /// Group hashmaps explored, but not yet inserted in the main DB. If built in RAM,
+        /// groups are inserted in the order of node_groups, no matter which thread explored
+        /// them first. This keeps the order of entries in the database deterministic.
+        /// Their number is bounded by the window of the scheduler, see group_scheduler
+        std::map<size_t, pending_group> _pending_groups;
+
+        /// Groups inserted in the main DB: post-order id, the number of explored phylo-k-mers
+        /// and the digest. They are journaled if the construction switches to disk
+        std::vector<std::tuple<phylo_kmer::branch_type, size_t, uint64_t>> _committed_groups;
+
+        /// The estimated memory of the main DB, see memory_component::database
+        size_t _db_memory;
+        size_t _db_entries;
+
+        /// The index of the next group to insert in the main DB
+        size_t _next_commit;
+        std::mutex _commit_mutex;
+
+        /// Completed groups and batches of the on-disk construction
+        build_journal _journal;
 
-        bool _on_disk;
+        /// Directories of group hashmaps, parallel to the group ids. If empty, group hashmaps
+        /// are in the working directory
+        std::vector<std::string> _group_dirs;
 
+        /// Spill files of group hashmaps for every batch. Open only during the exploration
+        std::vector<std::unique_ptr<spill_file>> _spill_files;
+
+        /// Segments of the spill files of the previous build for every batch. See build_options::update_from
+        std::vector<spill_index> _previous_segments;
+
+        /// Groups of the previous build by their digests: post-order id and the number of
+        /// explored phylo-k-mers. See build_options::update_from
+        std::unordered_map<uint64_t, std::pair<phylo_kmer::branch_type, size_t>> _previous_groups;
+        std::atomic<size_t> _num_reused;
+
+        /// Builders of the same reference for other values of k and omega, including this one.
+        /// Every group is explored for all of them at once, so the matrices are loaded once
+        std::vector<db_builder*> _targets;
     };
 
     db_builder::db_builder(std::string working_directory, const std::string& output_filename,
@@ -156,7 +418,8 @@ namespace ipk
                            ipk::algorithm algorithm, ipk::ghost_strategy strategy,
                            size_t kmer_size, phylo_kmer::score_type omega,
                            filter_type filter, double mu,
-                           size_t num_threads, bool on_disk)
+                           size_t num_threads, bool on_disk,
+                           const build_options& options, build_metrics& metrics)
         : _working_directory{ std::move(working_directory) }
         , _original_tree{ original_tree }
         , _extended_tree{ extended_tree }
@@ -173,75 +436,345 @@ namespace ipk
         , _num_threads{ num_threads }
         , _phylo_kmer_db{ kmer_size, omega, seq_type::name, i2l::io::to_newick(_original_tree)}
         , _output_filename(output_filename)
-        , _ofs(output_filename)
-        , _ar(_ofs)
         , _on_disk(on_disk)
+        , _options(options)
+        , _metrics(metrics)
+        , _target_name(get_target_name(kmer_size, omega))
+        , _batch_parts(_num_batches, 1)
+        , _db_memory(0)
+        , _db_entries(0)
+        , _next_commit(0)
+        , _num_reused(0)
+        , _targets{ this }
     {
+        _metrics.set_num_batches(_target_name, _num_batches);
     }
 
     void db_builder::run()
+    {
+        for (auto* target : _targets)
+        {
+            target->print_parameters();
+            target->fill_tree_index();
+        }
+
+        if (is_shard())
+        {
+            /// The manifest of a previous run of the shard is not valid anymore
+            for (const auto* target : _targets)
+            {
+                fs::remove(get_shard_manifest(target->_working_directory));
+            }
+
+            const auto& [group_ids, time] = compute_phylo_kmers();
+
+            std::cout << "Building shard " << _options.shard_index << "/" << _options.num_shards << ": Done." << std::endl;
+            for (const auto* target : _targets)
+            {
+                target->save_shard(group_ids);
+                std::cout << "Output: " << get_groups_dir(target->_working_directory) << std::endl;
+            }
+            std::cout << "Total time (ms): " << time << "\n\n" << std::flush;
+            return;
+        }
+
+        const auto& [group_ids, construction_time] = compute_phylo_kmers();
+
+        /// Filtering and merge are done for every target separately
+        unsigned long filtering_time = 0;
+        for (auto* target : _targets)
+        {
+            filtering_time += target->_on_disk ? target->filter_on_disk(group_ids) : target->filter_in_ram();
+
+            /// Group hashmaps and the journal are kept for a later update
+            if (target->_on_disk && target->_options.keep_groups)
+            {
+                for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+                {
+                    for (size_t part = 0; part < target->_batch_parts[batch_id]; ++part)
+                    {
+                        fs::remove(target->get_batch_db_name(batch_id, part));
+                    }
+                }
+            }
+            else if (target->has_working_directory())
+            {
+                fs::remove_all(get_groups_dir(target->_working_directory));
+            }
+        }
+
+        std::cout << "Building database: Done." << std::endl;
+        for (const auto* target : _targets)
+        {
+            if (!target->_output_filename.empty())
+            {
+                std::cout << "Output: " << target->_output_filename << std::endl;
+            }
+        }
+        std::cout << "Total time (ms): " << construction_time + filtering_time << "\n\n" << std::flush;
+        _metrics.print_memory(std::cout);
+    }
+
+    void db_builder::merge(const std::vector<phylo_kmer::branch_type>& group_ids, std::vector<std::string> group_dirs)
+    {
+        print_parameters();
+        fill_tree_index();
+
+        _group_dirs = std::move(group_dirs);
+
+        /// Batch databases are written in the working directory of the merge
+        const auto temp_dir = get_groups_dir(_working_directory);
+        fs::create_directories(temp_dir);
+        const auto resumed = _journal.open(get_journal_file(), journal_parameters(), _options.resume);
+        if (resumed)
+        {
+            std::cout << "Resuming the merge: " << _journal.num_batches() << " batches are already done." << std::endl;
+        }
+
+        const auto time = filter_on_disk(group_ids);
+        fs::remove_all(temp_dir);
+
+        std::cout << "Merging shards: Done." << std::endl;
+        std::cout << "Output: " << _output_filename << std::endl;
+        std::cout << "Total time (ms): " << time << "\n\n" << std::flush;
+        _metrics.print_memory(std::cout);
+    }
+
+    void db_builder::print_parameters() const
     {
         std::cout << "Computation parameters:" << std::endl <<
                   "\tsequence type: " << seq_type::name << std::endl <<
                   "\tk: " << _kmer_size << std::endl <<
                   "\tomega: " << _omega << std::endl <<
-                  "\ton disk: " << (_on_disk ? "true" : "false") << std::endl <<
-                  "\tkeep positions: " << (keep_positions ? "true" : "false") << std::endl << std::endl;
+                  "\ton disk: " << (_on_disk ? "true" : "false") << std::endl;
+        if (is_shard())
+        {
+            std::cout << "\tshard: " << _options.shard_index << "/" << _options.num_shards << std::endl;
+        }
+        std::cout << "\tkeep positions: " << (keep_positions ? "true" : "false") << std::endl << std::endl;
+    }
 
-        /// Fill the tree index from the tree
+    void db_builder::fill_tree_index()
+    {
         auto& index = _phylo_kmer_db.tree_index();
+        index.clear();
         index.reserve(_original_tree.get_node_count());
         for (const auto& node : visit_subtree(_original_tree.get_root()))
         {
             index.push_back(phylo_node::node_index{ node.get_num_nodes(), node.get_subtree_branch_length() });
         }
+    }
 
-        size_t construction_time, filtering_time;
-        if (_on_disk)
+    void db_builder::open_output()
+    {
+        if (_sink)
         {
-            const auto& [group_ids, time] = compute_phylo_kmers();
-            construction_time = time;
-            filtering_time = filter_on_disk(group_ids);
+            _output = _sink;
+            return;
         }
-        else
+
+        _writer = make_db_writer(_options.format, _output_filename, _num_threads, _options.compression_level);
+        _output = _writer.get();
+    }
+
+    bool db_builder::is_shard() const
+    {
+        return _options.num_shards > 0;
+    }
+
+    bool db_builder::has_working_directory() const
+    {
+        return !_working_directory.empty();
+    }
+
+    void db_builder::save_shard(const std::vector<phylo_kmer::branch_type>& group_ids) const
+    {
         {
-            const auto& [group_ids, time] = compute_phylo_kmers();
-            construction_time = time;
-            filtering_time = filter_in_ram();
+            std::ofstream out(get_shard_tree(_working_directory));
+            out << i2l::io::to_newick(_original_tree);
         }
 
-        fs::remove_all(get_groups_dir(_working_directory));
+        /// The manifest is written last and renamed, so that it exists only if the shard is complete
+        const auto manifest_file = get_shard_manifest(_working_directory);
+        const auto temp_file = manifest_file + ".tmp";
+        {
+            std::ofstream out(temp_file);
+            out << "shard " << _options.shard_index << ' ' << _options.num_shards << '\n';
+            for (const auto group_id : group_ids)
+            {
+                out << "group " << group_id << '\n';
+            }
 
-        std::cout << "Building database: Done." << std::endl;
-        std::cout << "Output: " << _output_filename << std::endl;
-        std::cout << "Total time (ms): " << construction_time + filtering_time << "\n\n" << std::flush;
+            if (!out.flush())
+            {
+                throw std::runtime_error("Could not write the shard manifest: " + temp_file);
+            }
+        }
+        fs::rename(temp_file, manifest_file);
     }
 
     std::tuple<std::vector<phylo_kmer::branch_type>, unsigned long> db_builder::compute_phylo_kmers()
     {
         std::cout << "Computing phylo-k-mers [stage 1 / 3]:" << std::endl;
-        /// create a temporary directory for hashmaps
-        const auto temp_dir = get_groups_dir(_working_directory);
-        fs::create_directories(temp_dir);
+        /// create temporary directories for hashmaps
+        for (const auto* target : _targets)
+        {
+            if (target->has_working_directory())
+            {
+                fs::create_directories(get_groups_dir(target->_working_directory));
+            }
+        }
 
         try
         {
+            if (_on_disk)
+            {
+                for (auto* target : _targets)
+                {
+                    auto& journal = target->_journal;
+                    const auto resumed = journal.open(target->get_journal_file(), target->journal_parameters(),
+                                                      _options.resume);
+                    if (resumed)
+                    {
+                        std::cout << "Resuming the build of " << target->_output_filename << ": "
+                                  << journal.num_groups() << " groups and "
+                                  << journal.num_batches() << " batches are already done." << std::endl;
+                    }
+
+                    if (!target->_options.update_from.empty())
+                    {
+                        target->load_previous_groups();
+                    }
+
+                    target->_spill_files.clear();
+                    for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+                    {
+                        target->_spill_files.push_back(std::make_unique<spill_file>(
+                            get_spill_file(target->_working_directory, batch_id), _options.resume));
+                    }
+                }
+            }
+
             /// Compute phylo-k-mers for every branch (node group)
+            auto timer = _metrics.measure(stage::computation);
             const auto begin = std::chrono::steady_clock::now();
             const auto& [group_ids, num_tuples] = explore_kmers();
-            (void)num_tuples;
+            _metrics.add_explored(num_tuples);
+            for (auto* target : _targets)
+            {
+                target->_spill_files.clear();
+            }
+            timer.stop();
             const auto end = std::chrono::steady_clock::now();
             const auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
 
+            for (const auto* target : _targets)
+            {
+                if (!target->_options.update_from.empty())
+                {
+                    std::cout << "Reused " << target->_num_reused << " groups of " << target->_options.update_from
+                              << " for " << target->_output_filename << std::endl;
+                }
+            }
             std::cout << "Computation time: " << elapsed_time << "\n\n" << std::flush;
             return { group_ids, elapsed_time };
         }
         catch (const std::exception& error)
         {
             std::cerr << "Error: " << error.what() << std::endl;
-            fs::remove_all(temp_dir);
-            throw error;
+
+            /// Completed groups can be reused by --resume
+            for (const auto* target : _targets)
+            {
+                const auto temp_dir = get_groups_dir(target->_working_directory);
+                if (_on_disk)
+                {
+                    std::cerr << "Intermediate results are kept in " << temp_dir << ". "
+                              << "Run with --resume to continue the build." << std::endl;
+                }
+                else if (target->has_working_directory())
+                {
+                    fs::remove_all(temp_dir);
+                }
+            }
+            throw;
+        }
+    }
+
+    std::string db_builder::get_journal_file() const
+    {
+        return ipk::get_journal_file(_working_directory);
+    }
+
+    std::string get_journal_file(const std::string& working_directory)
+    {
+        return (fs::path(get_groups_dir(working_directory)) / "journal").string();
+    }
+
+    std::string get_shard_manifest(const std::string& working_directory)
+    {
+        return (fs::path(get_groups_dir(working_directory)) / "shard").string();
+    }
+
+    std::string get_shard_tree(const std::string& working_directory)
+    {
+        return (fs::path(get_groups_dir(working_directory)) / "tree.newick").string();
+    }
+
+    build_journal::parameter_list db_builder::journal_parameters() const
+    {
+        std::ostringstream omega;
+        omega << std::setprecision(std::numeric_limits<phylo_kmer::score_type>::max_digits10) << _omega;
+
+        std::ostringstream tree_hash;
+        tree_hash << std::hex << fnv1a(i2l::io::to_newick(_original_tree));
+
+        const auto filter = _filter == filter_type::mif0 ? "mif0" : "random";
+        std::string ghosts;
+        switch (_ghost_strategy)
+        {
+            case ghost_strategy::INNER_ONLY:
+                ghosts = "inner-only";
+                break;
+            case ghost_strategy::OUTER_ONLY:
+                ghosts = "outer-only";
+                break;
+            default:
+                ghosts = "both";
         }
+
+        /// Quantized groups are lossy, they must not be reused by a lossless build
+        std::string codec;
+        switch (_options.spill)
+        {
+            case spill_codec::delta:
+                codec = "delta";
+                break;
+            case spill_codec::quantized:
+                codec = "quantized";
+                break;
+            default:
+                codec = "archive";
+        }
+
+        build_journal::parameter_list parameters = {
+            { "sequence_type", seq_type::name },
+            { "keep_positions", keep_positions ? "true" : "false" },
+            { "k", std::to_string(_kmer_size) },
+            { "omega", omega.str() },
+            { "filter", filter },
+            { "ghosts", ghosts },
+            { "batches", std::to_string(_num_batches) },
+            { "spill", "3" },
+            { "codec", codec },
+            { "tree", tree_hash.str() }
+        };
+
+        if (is_shard())
+        {
+            parameters.emplace_back("shard", std::to_string(_options.shard_index) + "/" + std::to_string(_options.num_shards));
+        }
+        return parameters;
     }
 
     void throw_if_positions()
@@ -254,6 +787,7 @@ namespace ipk
     unsigned long db_builder::filter_in_ram()
     {
         std::cout << "Filtering in RAM [stage 2 / 3]:" << std::endl;
+        auto filtering_timer = _metrics.measure(stage::filtering);
         auto begin = std::chrono::steady_clock::now();
 
         /// Filter phylo k-mers
@@ -278,19 +812,53 @@ namespace ipk
         size_t total_num_kmers = 0;
         size_t total_num_entries = 0;
         /// Calculate filter values for the batch
+        auto filter_timer = _metrics.measure(stage::filtering, substage::filter);
         _phylo_kmer_db.kmer_order = filter->calc_filter_values(_phylo_kmer_db);
+        const auto order_memory = memory_usage(_phylo_kmer_db.kmer_order);
+        _metrics.memory().add(memory_component::kmer_order, order_memory);
+        filter_timer.stop();
 
         /// Sort k-mers by filter values
+        auto sort_timer = _metrics.measure(stage::filtering, substage::sort);
         std::sort(_phylo_kmer_db.kmer_order.begin(), _phylo_kmer_db.kmer_order.end());
+        sort_timer.stop();
         total_num_kmers += _phylo_kmer_db.size();
         total_num_entries += get_num_entries(_phylo_kmer_db);
+        _metrics.set_stored(_target_name, total_num_kmers, total_num_entries);
+
+        /// The database is not split in RAM. Count k-mers of every batch
+        /// to report the same statistics as for the on-disk construction
+        if (_metrics.enabled())
+        {
+            std::vector<size_t> batch_kmers(_num_batches, 0);
+            std::vector<size_t> batch_entries(_num_batches, 0);
+            for (const auto& [kmer, entries] : _phylo_kmer_db)
+            {
+                const auto batch_id = kmer_batch(kmer, _num_batches);
+                ++batch_kmers[batch_id];
+                batch_entries[batch_id] += entries.size();
+            }
+
+            for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+            {
+                _metrics.set_batch(_target_name, batch_id, batch_kmers[batch_id], batch_entries[batch_id]);
+            }
+        }
+        filtering_timer.stop();
 
         auto end = std::chrono::steady_clock::now();
         auto time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
         std::cout << "Filtering time: " << time << "\n\n" << std::flush;
 
+        /// The database is given to the caller sorted by filter values
+        if (_keep_database)
+        {
+            return time;
+        }
 
         std::cout << "Merging [stage 3 / 3]:" << std::endl;
+        auto merge_timer = _metrics.measure(stage::merge);
+        auto serialize_timer = _metrics.measure(stage::merge, substage::serialize);
         begin = std::chrono::steady_clock::now();
 
         /// Serialize the protocol header
@@ -303,7 +871,8 @@ namespace ipk
             total_num_kmers,
             total_num_entries
         };
-        i2l::save_header(_ar, header);
+        open_output();
+        _output->write_header(header);
 
         ProgressBar bar2{
             option::BarWidth{60},
@@ -324,12 +893,20 @@ namespace ipk
         {
             const auto& kmer_entries = _phylo_kmer_db.at(kmer);
             /// Serialize k-mer
-            i2l::save_phylo_kmer(_ar, kmer, kmer_fv, kmer_entries);
+            _output->write_kmer(kmer, kmer_fv, kmer_entries);
 
             ++kmers_processed;
             bar2.set_option(option::PostfixText{std::to_string(kmers_processed) + "/" + std::to_string(total_num_kmers)});
             bar2.tick();
         }
+        _metrics.add_bytes_written(_output->close());
+        serialize_timer.stop();
+        merge_timer.stop();
+
+        /// The database is not used after serialization
+        _metrics.memory().release(memory_component::kmer_order, order_memory);
+        _metrics.memory().release(memory_component::database, _db_memory);
+        _db_memory = 0;
 
         end = std::chrono::steady_clock::now();
         time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
@@ -357,29 +934,95 @@ namespace ipk
         };
 
         std::cout << "Filtering on disk [stage 2 / 3]:" << std::endl;
+        const auto& working_dirs = _group_dirs.empty()
+            ? std::vector<std::string>(group_ids.size(), _working_directory)
+            : _group_dirs;
+        auto& memory = _metrics.memory();
+
         /// Go over k-mer batches (ranges of k-mers)
         for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
         {
-            /// Merge all branch subdatabases for the current range of k-mers
-            auto batch_db = ipk::merge_batch(_working_directory, group_ids, batch_id);
+            /// The batch is done by a previous run
+            if (const auto batch = _journal.get_batch(batch_id); batch)
+            {
+                bool saved = true;
+                for (size_t part = 0; part < batch->num_parts; ++part)
+                {
+                    saved = saved && fs::exists(get_batch_db_name(batch_id, part));
+                }
 
-            const auto threshold = score_threshold(_omega, _kmer_size);
-            auto filter = ipk::make_filter(_filter, _original_tree.get_node_count(),
-                                           _working_directory, _num_batches, threshold);
-            batch_db.kmer_order = filter->calc_filter_values(batch_db);
+                if (saved)
+                {
+                    _batch_parts[batch_id] = batch->num_parts;
+                    total_num_kmers += batch->num_kmers;
+                    total_num_entries += batch->num_entries;
+                    _metrics.set_batch(_target_name, batch_id, batch->num_kmers, batch->num_entries);
+
+                    bar.set_option(option::PostfixText{std::to_string(batch_id) + "/" + std::to_string(_num_batches)});
+                    bar.tick();
+                    continue;
+                }
+            }
 
-            /// Sort filter values. We want minimal values of filter score because
-            /// they are inverted, Sw [ H(c | B_w = 1) - H(c) ] -> min.
-            /// see calc_filter_values() for detail
-            std::sort(batch_db.kmer_order.begin(), batch_db.kmer_order.end());
+            /// A batch that does not fit in the memory budget is merged in parts. Every part
+            /// reads all the segments of the batch and keeps its own k-mers
+            const auto [spill_bytes, spill_entries] = get_spill_size(working_dirs, group_ids, batch_id);
+            const auto num_parts = get_num_parts(spill_entries);
+            _batch_parts[batch_id] = num_parts;
 
-            /// Since batches cover independent ranges of k-mers, we can simply
-            /// sum up k-mer and entry counters
-            total_num_kmers += batch_db.size();
-            total_num_entries += get_num_entries(batch_db);
+            size_t batch_num_kmers = 0;
+            size_t batch_num_entries = 0;
+            for (size_t part = 0; part < num_parts; ++part)
+            {
+                /// Merge all branch subdatabases for the current range of k-mers
+                auto io_timer = _metrics.measure(stage::filtering, substage::temp_io);
+                memory.add(memory_component::merge_buffers, spill_bytes);
+                auto batch_db = ipk::merge_batch(working_dirs, group_ids, batch_id,
+                                                 batch_part{ _num_batches, part, num_parts });
+                memory.release(memory_component::merge_buffers, spill_bytes);
+                _metrics.add_bytes_read(spill_bytes);
+                io_timer.stop();
+
+                const auto part_num_entries = get_num_entries(batch_db);
+                const auto db_memory = estimate_db_memory(batch_db.size(), part_num_entries);
+                memory.add(memory_component::database, db_memory);
+
+                auto filter_timer = _metrics.measure(stage::filtering, substage::filter);
+                const auto threshold = score_threshold(_omega, _kmer_size);
+                auto filter = ipk::make_filter(_filter, _original_tree.get_node_count(),
+                                               _working_directory, _num_batches, threshold);
+                batch_db.kmer_order = filter->calc_filter_values(batch_db);
+                const auto order_memory = memory_usage(batch_db.kmer_order);
+                memory.add(memory_component::kmer_order, order_memory);
+                filter_timer.stop();
+
+                /// Sort filter values. We want minimal values of filter score because
+                /// they are inverted, Sw [ H(c | B_w = 1) - H(c) ] -> min.
+                /// see calc_filter_values() for detail
+                auto sort_timer = _metrics.measure(stage::filtering, substage::sort);
+                std::sort(batch_db.kmer_order.begin(), batch_db.kmer_order.end());
+                sort_timer.stop();
+
+                /// Since batches cover independent ranges of k-mers, we can simply
+                /// sum up k-mer and entry counters
+                batch_num_kmers += batch_db.size();
+                batch_num_entries += part_num_entries;
+
+                /// Serialize the batch database
+                auto serialize_timer = _metrics.measure(stage::filtering, substage::serialize);
+                const auto batch_db_name = get_batch_db_name(batch_id, part);
+                i2l::save_uncompressed(batch_db, batch_db_name);
+                _metrics.add_bytes_written(fs::file_size(batch_db_name));
+                serialize_timer.stop();
+
+                memory.release(memory_component::kmer_order, order_memory);
+                memory.release(memory_component::database, db_memory);
+            }
 
-            /// Serialize the batch database
-            i2l::save_uncompressed(batch_db, get_batch_db_name(batch_id));
+            total_num_kmers += batch_num_kmers;
+            total_num_entries += batch_num_entries;
+            _metrics.set_batch(_target_name, batch_id, batch_num_kmers, batch_num_entries);
+            _journal.add_batch(batch_id, batch_num_kmers, batch_num_entries, num_parts);
 
             /// Update progress bar
             bar.set_option(option::PostfixText{std::to_string(batch_id) + "/" + std::to_string(_num_batches)});
@@ -393,21 +1036,27 @@ namespace ipk
     {
         std::cout << "Merging [stage 3 / 3]:" << std::endl;
 
-        /// Lazy loaders for every batch
+        /// Lazy loaders for every part of every batch
+        const auto num_loaders = std::accumulate(_batch_parts.begin(), _batch_parts.end(), size_t{ 0 });
         std::vector<batch_loader> batches;
-        batches.reserve(_num_batches);
+        batches.reserve(num_loaders);
         // Priority queue for batch loaders
         std::priority_queue<batch_loader*, std::vector<batch_loader*>, batch_loader_compare> pq;
         for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
         {
-            batches.emplace_back(get_batch_db_name(batch_id));
-            auto& loader= batches[batch_id];
-
-            /// pre-load the first k-mer and push the loader to the queue
-            if (loader.has_next())
+            for (size_t part = 0; part < _batch_parts[batch_id]; ++part)
             {
-                loader.next();
-                pq.push(&batches[batch_id]);
+                const auto batch_db_name = get_batch_db_name(batch_id, part);
+                _metrics.add_bytes_read(fs::file_size(batch_db_name));
+                batches.emplace_back(batch_db_name);
+                auto& loader = batches.back();
+
+                /// pre-load the first k-mer and push the loader to the queue
+                if (loader.has_next())
+                {
+                    loader.next();
+                    pq.push(&loader);
+                }
             }
         }
 
@@ -441,7 +1090,7 @@ namespace ipk
 
             if (auto& top = loader->current(); top.is_valid())
             {
-                i2l::save_phylo_kmer(_ar, top.key, top.filter_value, top.entries);
+                _output->write_kmer(top.key, top.filter_value, top.entries);
             }
 
             // If the loader has more items, insert it back into the queue
@@ -457,10 +1106,31 @@ namespace ipk
         }
     }
 
-    std::string db_builder::get_batch_db_name(size_t batch_id)
+    std::string db_builder::get_batch_db_name(size_t batch_id, size_t part)
+    {
+        const auto name = part == 0
+            ? std::to_string(batch_id) + ".ipk"
+            : std::to_string(batch_id) + "_" + std::to_string(part) + ".ipk";
+        return (fs::path(_working_directory) / fs::path{"hashmaps"} / fs::path(name)).string();
+    }
+
+    size_t db_builder::get_num_parts(size_t num_entries) const
     {
-        return (fs::path(_working_directory) / fs::path{"hashmaps"} /
-                fs::path(std::to_string(batch_id) + ".ipk")).string();
+        const auto available = _metrics.memory().available();
+        if (available == std::numeric_limits<size_t>::max())
+        {
+            return 1;
+        }
+
+        /// The worst case: every entry is a k-mer of its own
+        const auto required = estimate_db_memory(num_entries, num_entries) + num_entries * sizeof(decltype(phylo_kmer_db::kmer_order)::value_type);
+        if (required <= available)
+        {
+            return 1;
+        }
+        return available == 0
+            ? max_batch_parts
+            : std::min(max_batch_parts, (required + available - 1) / available);
     }
 
 
@@ -469,7 +1139,13 @@ namespace ipk
         throw_if_positions();
 
         const auto begin = std::chrono::steady_clock::now();
+        auto filtering_timer = _metrics.measure(stage::filtering);
         const auto& [total_num_kmers, total_num_entries] = merge_stage1(group_ids);
+        _metrics.set_stored(_target_name, total_num_kmers, total_num_entries);
+        filtering_timer.stop();
+
+        auto merge_timer = _metrics.measure(stage::merge);
+        auto serialize_timer = _metrics.measure(stage::merge, substage::serialize);
 
         /// Serialize the protocol header
         const auto header = i2l::ipk_header {
@@ -481,10 +1157,14 @@ namespace ipk
             total_num_kmers,
             total_num_entries
         };
-        i2l::save_header(_ar, header);
+        open_output();
+        _output->write_header(header);
 
         merge_stage2();
         //_phylo_kmer_db.sort();
+        _metrics.add_bytes_written(_output->close());
+        serialize_timer.stop();
+        merge_timer.stop();
         const auto end = std::chrono::steady_clock::now();
         const auto time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
 
@@ -492,44 +1172,46 @@ namespace ipk
         return time;
     }
 
-    bool is_ghost(const phylo_node& node, ipk::ghost_strategy strategy)
+    bool is_ghost(ghost_kind kind, ipk::ghost_strategy strategy)
     {
-        const string& label = node.get_label();
         switch (strategy)
         {
             case ipk::ghost_strategy::INNER_ONLY:
-                return boost::ends_with(label, "_X0");
+                return kind == ghost_kind::inner;
             case ipk::ghost_strategy::OUTER_ONLY:
-                return boost::ends_with(label, "_X1");
+                return kind == ghost_kind::outer;
             default:
-                return boost::ends_with(label, "_X0") || boost::ends_with(label, "_X1");
+                return kind != ghost_kind::none;
         }
     }
 
-    /// \brief Returns a list of ghost node ids
-    std::vector<std::string> get_ghost_ids(const phylo_tree& tree, ipk::ghost_strategy strategy)
+    /// \brief Returns a list of post-order ids of ghost nodes
+    std::vector<ar::node_id> get_ghost_ids(const ghost_mapping& mapping, ipk::ghost_strategy strategy)
     {
-        std::vector<std::string> branch_ids;
+        std::vector<ar::node_id> branch_ids;
 
-        for (const auto& branch_node: tree)
+        for (size_t id = 0; id < mapping.kinds.size(); ++id)
         {
-            if (is_ghost(branch_node, strategy))
+            if (is_ghost(mapping.kinds[id], strategy))
             {
-                branch_ids.push_back(branch_node.get_label());
+                branch_ids.push_back(static_cast<ar::node_id>(id));
             }
         }
         return branch_ids;
     }
 
-    std::vector<db_builder::id_group> db_builder::group_ghost_ids(const std::vector<std::string>& ghost_ids) const
+    std::tuple<std::vector<db_builder::id_group>, std::vector<phylo_kmer::branch_type>>
+    db_builder::group_ghost_ids(const std::vector<ar::node_id>& ghost_ids) const
     {
         std::vector<id_group> groups;
         groups.reserve(ghost_ids.size() / 2);
+        std::vector<branch_type> original_ids;
+        original_ids.reserve(ghost_ids.size() / 2);
 
         std::unordered_map<branch_type, size_t> index_mapping;
-        for (const auto& ghost_id : ghost_ids)
+        for (const auto ghost_id : ghost_ids)
         {
-            const auto original_postorder_id = _extended_mapping.at(ghost_id);
+            const auto original_postorder_id = _extended_mapping.original_ids[ghost_id];
 
             /// Ignore the root
             const auto original_node = _original_tree.get_by_postorder_id(original_postorder_id);
@@ -545,156 +1227,696 @@ namespace ipk
             else
             {
                 groups.push_back({ghost_id});
+                original_ids.push_back(original_postorder_id);
                 index_mapping[original_postorder_id] = groups.size() - 1;
             }
 
         }
-        return groups;
+        return { std::move(groups), std::move(original_ids) };
     }
 
     db_builder::proba_group db_builder::get_submatrices(const id_group& group) const
     {
         proba_group submatrices;
 
-        for (const auto& ext_node_label : group)
+        auto timer = _metrics.measure(stage::computation, substage::matrix_parse);
+        for (const auto node_id : group)
         {
-            const auto& ar_node_label = _ar_mapping.at(ext_node_label);
-            if (const auto& it = _matrix.find(ar_node_label); it != _matrix.end())
-            {
-                submatrices.push_back(std::ref(it->second));
-            }
-            else
-            {
-                throw std::runtime_error("Internal error: could not find " + ar_node_label + " node. "
-                                         "Make sure it is in the ARTree_id_mapping file.");
-            }
+            submatrices.push_back(std::ref(_matrix.get(node_id)));
         }
 
         return submatrices;
     }
 
-    std::tuple<std::vector<phylo_kmer::branch_type>, size_t> db_builder::explore_kmers()
+    std::tuple<std::vector<double>, std::vector<size_t>>
+    db_builder::estimate_costs(const std::vector<id_group>& node_groups, const std::vector<size_t>& group_indices,
+                               size_t num_kept)
     {
-        size_t count = 0;
+        std::cout << "Estimating the cost of " << group_indices.size() << " branch groups..." << std::endl;
+        const auto thresholds = enumeration_thresholds(_targets);
 
-        /// Filter and group ghost nodes
-        const auto node_groups = group_ghost_ids(get_ghost_ids(_extended_tree, _ghost_strategy));
+        /// The most expensive groups so far, the cheapest on top: (cost, position, memory)
+        using kept_group = std::tuple<double, size_t, size_t>;
+        std::priority_queue<kept_group, std::vector<kept_group>, std::greater<>> kept;
 
-        /// Process branches in parallel. Results of the branch-and-bound algorithm are stored
-        /// in a hash map for every group separately on disk.
-        std::vector<phylo_kmer::branch_type> node_postorder_ids(node_groups.size());
+        std::vector<double> costs;
+        costs.reserve(group_indices.size());
+        for (size_t position = 0; position < group_indices.size(); ++position)
+        {
+            const auto& group = node_groups[group_indices[position]];
+            const auto submatrices = get_submatrices(group);
+            const auto matrix_memory = memory_usage(submatrices);
+            _metrics.memory().add(memory_component::matrices, matrix_memory);
 
+            double cost = 0.0;
+            for (const auto& submatrix : submatrices)
+            {
+                for (const auto& [kmer_size, log_threshold] : thresholds)
+                {
+                    cost += estimate_cost(submatrix.get(), kmer_size, log_threshold);
+                }
+            }
+            costs.push_back(cost);
 
-        using namespace indicators;
-        ProgressBar bar{
-            option::BarWidth{60},
-            option::Start{"["},
-            option::Fill{"="},
-            option::Lead{">"},
-            option::Remainder{" "},
+            /// Do not keep all matrices in memory. Others will be loaded again on exploration
+            kept.emplace(cost, position, matrix_memory);
+            if (kept.size() > num_kept)
+            {
+                const auto [cheapest_cost, cheapest_position, cheapest_memory] = kept.top();
+                (void)cheapest_cost;
+                kept.pop();
+                release_matrices(node_groups[group_indices[cheapest_position]]);
+                _metrics.memory().release(memory_component::matrices, cheapest_memory);
+            }
+        }
+
+        /// Kept matrices are accounted again by the matrix loader
+        std::vector<size_t> kept_positions;
+        while (!kept.empty())
+        {
+            const auto [cost, position, matrix_memory] = kept.top();
+            (void)cost;
+            kept.pop();
+            kept_positions.push_back(position);
+            _metrics.memory().release(memory_component::matrices, matrix_memory);
+        }
+        return { std::move(costs), std::move(kept_positions) };
+    }
+
+    void db_builder::release_matrices(const id_group& group)
+    {
+        for (const auto node_id : group)
+        {
+            _matrix.release(node_id);
+        }
+    }
+
+    std::tuple<std::vector<phylo_kmer::branch_type>, size_t> db_builder::explore_kmers()
+    {
+        std::atomic<size_t> count = 0;
+
+        /// Filter and group ghost nodes
+        std::vector<id_group> node_groups;
+        std::vector<phylo_kmer::branch_type> node_postorder_ids;
+        std::tie(node_groups, node_postorder_ids) = group_ghost_ids(get_ghost_ids(_extended_mapping, _ghost_strategy));
+
+        /// Process branches in parallel. Results of the branch-and-bound algorithm are stored
+        /// in a hash map for every group separately on disk.
+        /// Groups to explore. Groups completed by a previous run are skipped, see build_journal
+        std::vector<size_t> pending_groups;
+        pending_groups.reserve(node_groups.size());
+        for (size_t i = 0; i < node_groups.size(); ++i)
+        {
+            const auto original_node_postorder_id = node_postorder_ids[i];
+
+            /// The group belongs to another shard
+            if (is_shard() && i % _options.num_shards != _options.shard_index)
+            {
+                continue;
+            }
+
+            /// The group is explored again if any target has not completed it
+            bool completed = _on_disk;
+            for (const auto* target : _targets)
+            {
+                if (const auto num_explored = _on_disk ? target->_journal.get_group(original_node_postorder_id) : std::nullopt)
+                {
+                    count += *num_explored;
+                }
+                else
+                {
+                    completed = false;
+                }
+            }
+
+            if (!completed)
+            {
+                pending_groups.push_back(i);
+            }
+        }
+
+        const auto num_workers = std::max<size_t>(1, std::min(_num_threads, pending_groups.size()));
+
+        /// Cost estimates are useless for one thread
+        const auto policy = num_workers > 1 ? _options.schedule : schedule_policy::tree;
+        std::vector<double> costs(pending_groups.size(), 1.0);
+        std::vector<size_t> kept_positions;
+        if (policy == schedule_policy::longest_first)
+        {
+            std::tie(costs, kept_positions) = estimate_costs(node_groups, pending_groups, num_workers);
+        }
+
+        /// Groups built in RAM are inserted in the main DB in the order of node_groups. The
+        /// window keeps them close to that order, so that few of them wait to be inserted
+        const auto in_ram = std::any_of(_targets.begin(), _targets.end(),
+                                        [](const auto* target) { return !target->_on_disk; });
+        const auto window = in_ram ? reorder_window * num_workers : 0;
+        group_scheduler scheduler(costs, num_workers, policy, window);
+        const auto dispatch_order = scheduler.dispatch_order();
+
+        /// The matrices kept by the estimation are those of the first groups to explore,
+        /// unless some costs are equal
+        const auto first_dispatched = std::vector<size_t>(
+            dispatch_order.begin(), dispatch_order.begin() + std::min(num_workers, dispatch_order.size()));
+        for (const auto position : kept_positions)
+        {
+            if (std::find(first_dispatched.begin(), first_dispatched.end(), position) == first_dispatched.end())
+            {
+                release_matrices(node_groups[pending_groups[position]]);
+            }
+        }
+
+        using namespace indicators;
+        ProgressBar bar{
+            option::BarWidth{60},
+            option::Start{"["},
+            option::Fill{"="},
+            option::Lead{">"},
+            option::Remainder{" "},
             option::End{"]"},
             option::PostfixText{"Computing phylo-k-mers"},
             option::ForegroundColor{Color::green},
             option::FontStyles{std::vector<FontStyle>{FontStyle::bold}},
-            option::MaxProgress{node_groups.size()}
+            option::MaxProgress{pending_groups.size()}
         };
+        size_t num_processed = 0;
+        std::mutex bar_mutex;
+
+        /// The exploration is a pipeline of three stages: the loader parses the matrices of the next
+        /// groups, the workers enumerate phylo-k-mers, and the writer spills the group hashmaps
+        /// (on disk only). The loader keeps one group ready per worker
+        std::vector<matrix_loader::group> pending_node_groups;
+        pending_node_groups.reserve(pending_groups.size());
+        for (const auto i : pending_groups)
+        {
+            pending_node_groups.push_back(node_groups[i]);
+        }
+        matrix_loader loader(_matrix, std::move(pending_node_groups), dispatch_order, num_workers,
+                             [this](size_t bytes) { _metrics.memory().add(memory_component::matrices, bytes); });
 
-        /*
-        #pragma omp parallel for schedule(auto) reduction(+: count) num_threads(_num_threads) \
-            shared(original_tree, node_postorder_ids, _matrix)
-        */
-        for (size_t i = 0; i < node_groups.size(); ++i)
+        if (_on_disk)
         {
-            const auto& node_group = node_groups[i];
+            /// The memory of the hashmaps that are not written is released by the writer
+            _group_writer = std::make_unique<background_writer>(_options.write_buffer_size, [this](size_t bytes) {
+                _metrics.memory().release(memory_component::group_maps, bytes);
+            });
+        }
 
-            /// Having a label of a node in the extended tree, we need to find the corresponding node
-            /// in the original tree. We take the first ghost node, because all of them correspond to
-            /// the same original node
-            const auto original_node_postorder_id = _extended_mapping.at(node_group[0]);
-            node_postorder_ids[i] = original_node_postorder_id;
+        /// The first exception thrown by a worker. Other workers stop as soon as possible
+        std::exception_ptr error;
+        std::atomic<bool> failed = false;
+        std::mutex error_mutex;
 
-            /// Compute phylo-k-mers for the branch and store them in the main DB
-            /// or on disk
-            const auto entry_count = explore_group(node_group, original_node_postorder_id);
+        auto worker = [&](size_t worker_id) {
+            try
+            {
+                while (!failed)
+                {
+                    const auto task = scheduler.next(worker_id);
+                    if (!task)
+                    {
+                        break;
+                    }
+
+                    const auto i = pending_groups[*task];
+                    const auto prefetched = loader.take(*task);
+
+                    /// Compute phylo-k-mers for the branch and store them in the main DB
+                    /// or on disk
+                    count += explore_group(node_groups[i], *task, node_postorder_ids[i], prefetched);
+
+                    // update progress bar
+                    std::lock_guard<std::mutex> lock(bar_mutex);
+                    ++num_processed;
+                    bar.set_option(option::PostfixText{std::to_string(num_processed) + "/" + std::to_string(pending_groups.size())});
+                    bar.tick();
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        };
 
-            // update progress bar
-            bar.set_option(option::PostfixText{std::to_string(i) + "/" + std::to_string(node_groups.size())});
-            bar.tick();
+        /// The calling thread is one of the workers
+        std::vector<std::thread> threads;
+        threads.reserve(num_workers - 1);
+        for (size_t worker_id = 1; worker_id < num_workers; ++worker_id)
+        {
+            threads.emplace_back(worker, worker_id);
+        }
+        worker(0);
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
 
-            count += entry_count;
+        /// Wait for the hashmaps still in the queue. They are discarded if the exploration failed
+        if (_group_writer && !error)
+        {
+            try
+            {
+                _group_writer->finish();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
         }
-        return { node_postorder_ids, count };
+        _group_writer.reset();
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        return { node_postorder_ids, count.load() };
     }
 
-    size_t db_builder::explore_group(const id_group& group, size_t postorder_id)
+    void db_builder::commit_group(size_t group_index, phylo_kmer::branch_type postorder_id, group_hash_map&& group_map,
+                                  size_t num_explored, uint64_t digest)
     {
-        /// Lazy load of matrices from disk
-        auto matrix_refs = get_submatrices(group);
+        std::lock_guard<std::mutex> lock(_commit_mutex);
+        const auto bytes = memory_usage(group_map);
 
-        auto hash_maps = std::vector<group_hash_map>(_num_batches);
+        /// The construction has switched to disk since the group was explored
+        if (_on_disk)
+        {
+            std::vector<group_hash_map> hash_maps;
+            hash_maps.push_back(std::move(group_map));
+            spill_group(postorder_id, std::move(hash_maps), num_explored, digest);
+            _metrics.memory().release(memory_component::group_maps, bytes);
+            return;
+        }
+        _pending_groups.emplace(group_index,
+                                pending_group{ postorder_id, std::move(group_map), num_explored, digest, bytes });
+
+        auto hashing_timer = _metrics.measure(stage::computation, substage::hashing);
+        for (auto it = _pending_groups.begin(); it != _pending_groups.end() && it->first == _next_commit; )
+        {
+            const auto& group = it->second;
+            const auto branch = group.postorder_id;
+            for (const auto& [kmer, value] : group.map)
+            {
+#ifdef KEEP_POSITIONS
+                const auto& [score, position] = value;
+                _phylo_kmer_db.unsafe_insert(kmer, { branch, score, position });
+#else
+                const auto score = value;
+                _phylo_kmer_db.unsafe_insert(kmer, { branch, score });
+#endif
+            }
+            _db_entries += group.map.size();
+            _committed_groups.emplace_back(branch, group.num_explored, group.digest);
+            _metrics.memory().release(memory_component::group_maps, group.bytes);
+
+            it = _pending_groups.erase(it);
+            ++_next_commit;
+        }
+
+        /// The estimate only grows, as k-mers are never removed from the database
+        const auto db_memory = estimate_db_memory(_phylo_kmer_db.size(), _db_entries);
+        _metrics.memory().add(memory_component::database, db_memory - _db_memory);
+        _db_memory = db_memory;
+        hashing_timer.stop();
+
+        /// Positions are not supported by the on-disk construction, and builds
+        /// without a working directory stay in RAM
+        if (_metrics.memory().over_budget() && !keep_positions && has_working_directory())
+        {
+            switch_to_disk();
+        }
+    }
+
+    void db_builder::switch_to_disk()
+    {
+        std::cout << "\nThe memory budget is exceeded: " << _output_filename
+                  << " continues to be built on disk." << std::endl;
+        auto io_timer = _metrics.measure(stage::computation, substage::temp_io);
+
+        _journal.open(get_journal_file(), journal_parameters(), false);
+        _spill_files.clear();
+        for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+        {
+            _spill_files.push_back(std::make_unique<spill_file>(get_spill_file(_working_directory, batch_id), false));
+        }
+
+        /// Split the main DB back in group hashmaps, one batch at a time. Every committed group
+        /// gets a segment in every batch, even an empty one, as merge_batch expects
+        for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+        {
+            std::unordered_map<phylo_kmer::branch_type, group_hash_map> group_maps;
+            for (const auto& [kmer, entries] : _phylo_kmer_db)
+            {
+                if (kmer_batch(kmer, _num_batches) != batch_id)
+                {
+                    continue;
+                }
+
+                for (const auto& entry : entries)
+                {
+#ifdef KEEP_POSITIONS
+                    group_maps[entry.branch][kmer] = { entry.score, entry.position };
+#else
+                    group_maps[entry.branch][kmer] = entry.score;
+#endif
+                }
+            }
+
+            for (const auto& [postorder_id, num_explored, digest] : _committed_groups)
+            {
+                const auto& group_map = group_maps[postorder_id];
+                const auto bytes = _spill_files[batch_id]->append(
+                    postorder_id, save_group_map(group_map, _options.spill, log_threshold()), group_map.size());
+                _metrics.add_bytes_written(bytes);
+            }
+        }
 
-        /// A hashmap for the group used if we build in RAM
-        group_hash_map group_map;
+        for (const auto& [postorder_id, num_explored, digest] : _committed_groups)
+        {
+            _journal.add_group(postorder_id, num_explored, digest);
+        }
+        _committed_groups.clear();
+
+        _phylo_kmer_db = phylo_kmer_db{ _kmer_size, _omega, seq_type::name, i2l::io::to_newick(_original_tree) };
+        fill_tree_index();
+        _metrics.memory().release(memory_component::database, _db_memory);
+        _db_memory = 0;
+        _db_entries = 0;
+        _on_disk = true;
+        io_timer.stop();
+
+        /// Groups waiting for the groups explored before them
+        for (auto& [group_index, group] : _pending_groups)
+        {
+            std::vector<group_hash_map> hash_maps;
+            hash_maps.push_back(std::move(group.map));
+            spill_group(group.postorder_id, std::move(hash_maps), group.num_explored, group.digest);
+            _metrics.memory().release(memory_component::group_maps, group.bytes);
+        }
+        _pending_groups.clear();
+    }
 
+    size_t db_builder::explore_group(const id_group& group, size_t group_index, size_t postorder_id, bool prefetched)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+
+        /// Lazy load of matrices from disk, unless the loader did it
+        auto matrix_refs = get_submatrices(group);
+        const auto matrix_load_time = std::chrono::steady_clock::now() - begin;
+        auto& memory = _metrics.memory();
+        if (!prefetched)
+        {
+            memory.add(memory_component::matrices, memory_usage(matrix_refs));
+        }
+
+        const auto digest = get_digest(matrix_refs);
+
+        /// Targets that did not complete the group in a previous run. Some of them can reuse the
+        /// group of a build they update
         size_t count = 0;
-        const auto log_threshold = std::log10(score_threshold(_omega, _kmer_size));
+        std::vector<db_builder*> targets;
+        for (auto* target : _targets)
+        {
+            if (_on_disk && target->_journal.get_group((branch_type)postorder_id))
+            {
+                continue;
+            }
+
+            if (const auto num_explored = target->reuse_group((branch_type)postorder_id, digest))
+            {
+                count += *num_explored;
+                continue;
+            }
+            targets.push_back(target);
+        }
+
+        /// Hashmaps of the group for every target. If built on disk, there is a hashmap
+        /// for every batch. If built in RAM, there is one hashmap
+        std::vector<std::vector<group_hash_map>> hash_maps;
+        hash_maps.reserve(targets.size());
+        for (const auto* target : targets)
+        {
+            hash_maps.emplace_back(target->_on_disk ? _num_batches : 1);
+        }
+        auto counts = std::vector<size_t>(targets.size(), 0);
+
+        size_t num_windows = 0;
         for (auto node_matrix_ref : matrix_refs)
         {
             auto& node_matrix = node_matrix_ref.get();
 
-            for (const auto& window : to_windows(&node_matrix, _kmer_size))
+            /// Targets with the same k share the enumeration. It runs with the lowest threshold,
+            /// and every target keeps the phylo-k-mers that score above its own threshold
+            for (const auto& [kmer_size, log_threshold] : enumeration_thresholds(targets))
             {
-                /// Compute phylo-k-mers
-                auto alg = ipk::DCLA(window, _kmer_size);
-                alg.run(log_threshold);
-
-                /// Either drop them on disk or hash in the main hashmap
-                for (const auto& kmer : alg.get_result())
+                for (const auto& window : to_windows(&node_matrix, kmer_size))
                 {
-                    auto& hashmap = _on_disk ? hash_maps[kmer_batch(kmer.key, _num_batches)] : group_map;
+                    ++num_windows;
+
+                    /// Compute phylo-k-mers
+                    auto enumeration_timer = _metrics.measure(stage::computation, substage::enumeration);
+                    auto alg = ipk::DCLA(window, kmer_size);
+                    alg.run(log_threshold);
+                    enumeration_timer.stop();
+
+                    /// Either drop them on disk or hash in the main hashmap
+                    auto hashing_timer = _metrics.measure(stage::computation, substage::hashing);
+                    for (size_t i = 0; i < targets.size(); ++i)
+                    {
+                        if (targets[i]->_kmer_size != kmer_size)
+                        {
+                            continue;
+                        }
+
+                        const auto target_threshold = targets[i]->log_threshold();
+                        for (const auto& kmer : alg.get_result())
+                        {
+                            if (kmer.score <= target_threshold)
+                            {
+                                continue;
+                            }
+
+                            auto& hashmap = hash_maps[i][hash_maps[i].size() > 1 ? kmer_batch(kmer.key, _num_batches) : 0];
 #ifdef KEEP_POSITIONS
-                    auto value = phylo_kmer{
-                        kmer.key, kmer.score,
-                        static_cast<phylo_kmer::pos_type>(window.get_position())
-                    };
+                            auto value = phylo_kmer{
+                                kmer.key, kmer.score,
+                                static_cast<phylo_kmer::pos_type>(window.get_position())
+                            };
 #else
-                    auto value = kmer;
+                            auto value = kmer;
 #endif
-                    ipk::put(hashmap, value);
-                    ++count;
+                            ipk::put(hashmap, value);
+                            ++counts[i];
+                        }
+                    }
                 }
             }
 
             /// Clear the matrix as we don't need it anymore
+            memory.release(memory_component::matrices, node_matrix.get_data().size() * sizeof(node_matrix.get_data()[0]));
             node_matrix.clear();
         }
 
+        size_t num_distinct = 0;
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            count += counts[i];
+
+            const auto bytes = memory_usage(hash_maps[i]);
+            memory.add(memory_component::group_maps, bytes);
+
+            if (!_group_writer)
+            {
+                num_distinct += targets[i]->save_group(group_index, (branch_type)postorder_id,
+                                                       std::move(hash_maps[i]), counts[i], digest);
+                continue;
+            }
+
+            /// Hashmaps are written in the background, while this thread explores the next group.
+            /// push blocks if the writer is too far behind
+            for (const auto& hash_map : hash_maps[i])
+            {
+                num_distinct += hash_map.size();
+            }
+
+            auto group_maps = std::make_shared<std::vector<group_hash_map>>(std::move(hash_maps[i]));
+            _group_writer->push(bytes, [this, target = targets[i], group_index, postorder_id, group_maps,
+                                        num_explored = counts[i], digest]() {
+                target->save_group(group_index, (branch_type)postorder_id,
+                                   std::move(*group_maps), num_explored, digest);
+                group_maps->clear();
+            });
+        }
+
+        _metrics.add_hashed(num_distinct);
+        _metrics.add_group({
+            postorder_id, group.size(), num_windows, count, num_distinct,
+            std::chrono::steady_clock::now() - begin, matrix_load_time
+        });
+        return count;
+    }
+
+    size_t db_builder::save_group(size_t group_index, phylo_kmer::branch_type postorder_id,
+                                  std::vector<group_hash_map>&& hash_maps, size_t num_explored, uint64_t digest)
+    {
         /// Save the group hashmap on disk
         if (_on_disk)
         {
-            size_t index = 0;
-            for (const auto& hash_map: hash_maps)
+            const auto bytes = memory_usage(hash_maps);
+            const auto num_distinct = spill_group(postorder_id, std::move(hash_maps), num_explored, digest);
+            _metrics.memory().release(memory_component::group_maps, bytes);
+            return num_distinct;
+        }
+
+        /// Or hash in the main DB with the corresponding branch ID (postorder ID)
+        const auto num_distinct = hash_maps[0].size();
+        commit_group(group_index, postorder_id, std::move(hash_maps[0]), num_explored, digest);
+        return num_distinct;
+    }
+
+    size_t db_builder::spill_group(phylo_kmer::branch_type postorder_id,
+                                   std::vector<group_hash_map>&& hash_maps, size_t num_explored, uint64_t digest)
+    {
+        /// The group was explored in RAM before the construction switched to disk
+        if (hash_maps.size() != _num_batches)
+        {
+            std::vector<group_hash_map> batch_maps(_num_batches);
+            for (const auto& [kmer, value] : hash_maps[0])
             {
-                save_group_map(hash_map, get_group_map_file(_working_directory, postorder_id, index));
-                ++index;
+                batch_maps[kmer_batch(kmer, _num_batches)][kmer] = value;
             }
+            hash_maps = std::move(batch_maps);
         }
-        /// Or hash in the main DB with the corresponding branch ID (postorder ID)
-        else
+
+        size_t num_distinct = 0;
+        auto io_timer = _metrics.measure(stage::computation, substage::temp_io);
+        for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+        {
+            const auto& hash_map = hash_maps[batch_id];
+            num_distinct += hash_map.size();
+            const auto bytes = _spill_files[batch_id]->append(
+                postorder_id, save_group_map(hash_map, _options.spill, log_threshold()), hash_map.size());
+            _metrics.add_bytes_written(bytes);
+        }
+        _journal.add_group(postorder_id, num_explored, digest);
+        return num_distinct;
+    }
+
+    uint64_t db_builder::get_digest(const proba_group& matrices)
+    {
+        uint64_t digest = fnv1a("");
+        for (const auto& matrix : matrices)
         {
-            for (const auto& [kmer, value] : group_map)
+            const auto& data = matrix.get().get_data();
+            const auto width = data.size();
+            digest = fnv1a(&width, sizeof(width), digest);
+            digest = fnv1a(data.data(), data.size() * sizeof(data[0]), digest);
+        }
+        return digest;
+    }
+
+    void db_builder::load_previous_groups()
+    {
+        const auto& previous_dir = _options.update_from;
+        if (fs::exists(_working_directory) && fs::equivalent(previous_dir, _working_directory))
+        {
+            throw std::runtime_error("The working directory must differ from the build to update: " + previous_dir);
+        }
+
+        build_journal previous;
+        previous.read(ipk::get_journal_file(previous_dir));
+
+        /// The tree can change, everything else must be the same
+        for (const auto& [name, value] : journal_parameters())
+        {
+            if (name == "tree" || name == "shard")
             {
-#ifdef KEEP_POSITIONS
-                const auto& [score, position] = value;
-                _phylo_kmer_db.unsafe_insert(kmer, { (branch_type)postorder_id, score, position });
-#else
-                const auto score = value;
-                _phylo_kmer_db.unsafe_insert(kmer, { (branch_type)postorder_id, score });
-#endif
+                continue;
+            }
+
+            const auto it = std::find_if(previous.parameters().begin(), previous.parameters().end(),
+                                         [&name](const auto& parameter) { return parameter.first == name; });
+            if (it == previous.parameters().end() || it->second != value)
+            {
+                throw std::runtime_error("Cannot update the build in " + previous_dir + ": parameter '" + name +
+                                         "' is " + value + ", but the previous build has " +
+                                         (it == previous.parameters().end() ? std::string("none") : it->second) + ".");
             }
         }
 
-        return count;
+        _previous_groups.clear();
+        for (const auto& [postorder_id, digest] : previous.digests())
+        {
+            _previous_groups.emplace(digest, std::make_pair(postorder_id, previous.groups().at(postorder_id)));
+        }
+
+        _previous_segments.clear();
+        for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+        {
+            _previous_segments.push_back(load_spill_index(get_spill_file(previous_dir, batch_id)));
+        }
+        std::cout << "Updating the build in " << previous_dir << ": " << _previous_groups.size()
+                  << " groups can be reused." << std::endl;
+    }
+
+    std::optional<size_t> db_builder::reuse_group(phylo_kmer::branch_type postorder_id, uint64_t digest)
+    {
+        const auto it = _previous_groups.find(digest);
+        if (it == _previous_groups.end())
+        {
+            return std::nullopt;
+        }
+
+        const auto& [previous_id, num_explored] = it->second;
+        auto io_timer = _metrics.measure(stage::computation, substage::temp_io);
+        for (size_t batch_id = 0; batch_id < _num_batches; ++batch_id)
+        {
+            const auto previous_file = get_spill_file(_options.update_from, batch_id);
+            const auto segment = _previous_segments[batch_id].find(previous_id);
+            if (segment == _previous_segments[batch_id].end())
+            {
+                throw std::runtime_error("Cannot update the build: no phylo-k-mers of the group " +
+                                         std::to_string(previous_id) + " in " + previous_file);
+            }
+
+            const auto bytes = _spill_files[batch_id]->append(postorder_id, read_segment(previous_file, segment->second),
+                                                              segment->second.num_entries);
+            _metrics.add_bytes_read(bytes);
+            _metrics.add_bytes_written(bytes);
+        }
+        _journal.add_group(postorder_id, num_explored, digest);
+        ++_num_reused;
+        return num_explored;
+    }
+
+    phylo_kmer::score_type db_builder::log_threshold() const
+    {
+        return std::log10(score_threshold(_omega, _kmer_size));
+    }
+
+    std::vector<std::pair<size_t, phylo_kmer::score_type>> db_builder::enumeration_thresholds(
+        const std::vector<db_builder*>& targets)
+    {
+        std::vector<std::pair<size_t, phylo_kmer::score_type>> thresholds;
+        for (const auto* target : targets)
+        {
+            const auto it = std::find_if(thresholds.begin(), thresholds.end(),
+                                         [target](const auto& pair) { return pair.first == target->_kmer_size; });
+            if (it == thresholds.end())
+            {
+                thresholds.emplace_back(target->_kmer_size, target->log_threshold());
+            }
+            else
+            {
+                it->second = std::min(it->second, target->log_threshold());
+            }
+        }
+        return thresholds;
     }
 
 };
@@ -708,16 +1930,280 @@ namespace ipk
                proba_matrix& matrix,
                const ghost_mapping& mapping, const ar::mapping& ar_mapping, bool merge_branches,
                ipk::algorithm algorithm, ipk::ghost_strategy strategy,
-               size_t kmer_size, i2l::phylo_kmer::score_type omega,
-               filter_type filter, double mu, size_t num_threads, bool on_disk)
+               const std::vector<size_t>& kmer_sizes, const std::vector<i2l::phylo_kmer::score_type>& omegas,
+               filter_type filter, double mu, size_t num_threads, bool on_disk,
+               const build_options& options, build_metrics& metrics)
+    {
+        const auto single = kmer_sizes.size() * omegas.size() == 1;
+        metrics.memory().set_budget(options.max_ram);
+
+        std::vector<std::unique_ptr<db_builder>> builders;
+        for (const auto kmer_size : kmer_sizes)
+        {
+            for (const auto omega : omegas)
+            {
+                auto target_directory = working_directory;
+                auto target_output = output_filename;
+                auto target_options = options;
+                if (options.max_ram > 0)
+                {
+                    /// Hashmaps waiting to be written count against the budget as well
+                    target_options.write_buffer_size = std::min(options.write_buffer_size, options.max_ram / 4);
+                }
+
+                if (!single)
+                {
+                    const auto name = get_target_name(kmer_size, omega);
+                    const auto output = fs::path(output_filename);
+                    target_directory = (fs::path(working_directory) / name).string();
+                    target_output = (output.parent_path() /
+                                     (output.stem().string() + "_" + name + output.extension().string())).string();
+                    if (!options.update_from.empty())
+                    {
+                        target_options.update_from = (fs::path(options.update_from) / name).string();
+                    }
+                }
+
+                builders.push_back(std::make_unique<db_builder>(target_directory, target_output,
+                                                                original_tree, extended_tree,
+                                                                matrix,
+                                                                mapping, ar_mapping, merge_branches,
+                                                                algorithm, strategy,
+                                                                kmer_size, omega,
+                                                                filter, mu, num_threads, on_disk, target_options, metrics));
+            }
+        }
+
+        /// The first builder explores the groups for all of them
+        auto& builder = *builders.front();
+        builder._targets.clear();
+        for (const auto& target : builders)
+        {
+            builder._targets.push_back(target.get());
+        }
+        builder.run();
+    }
+
+    /// A completed shard build, see save_shard
+    struct shard
     {
+        std::string directory;
+        size_t index;
+        size_t num_shards;
+
+        /// Post-order ids of all groups of the tree, in the order of exploration
+        std::vector<phylo_kmer::branch_type> group_ids;
+        build_journal journal;
+    };
+
+    void load_shard(shard& shard)
+    {
+        const auto manifest_file = get_shard_manifest(shard.directory);
+        std::ifstream in(manifest_file);
+        if (!in)
+        {
+            throw std::runtime_error(shard.directory + " is not a completed shard build: " + manifest_file +
+                                     " not found. Run the shard build with --resume to complete it.");
+        }
+
+        std::string type;
+        if (!(in >> type >> shard.index >> shard.num_shards) || type != "shard")
+        {
+            throw std::runtime_error("Could not parse the shard manifest: " + manifest_file);
+        }
+
+        phylo_kmer::branch_type group_id;
+        while (in >> type >> group_id)
+        {
+            shard.group_ids.push_back(group_id);
+        }
+
+        shard.journal.read(get_journal_file(shard.directory));
+    }
+
+    /// Returns the value of a parameter of the journal
+    std::string get_parameter(const build_journal& journal, const std::string& name)
+    {
+        for (const auto& [parameter, value] : journal.parameters())
+        {
+            if (parameter == name)
+            {
+                return value;
+            }
+        }
+        throw std::runtime_error("The build journal does not have the parameter " + name);
+    }
+
+    void merge_shards(const std::vector<std::string>& shard_directories,
+                      const std::string& working_directory, const std::string& output_filename,
+                      const build_options& options, build_metrics& metrics)
+    {
+        if (shard_directories.empty())
+        {
+            throw std::runtime_error("No shards to merge.");
+        }
+        metrics.memory().set_budget(options.max_ram);
+
+        std::vector<shard> shards(shard_directories.size());
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            /// The merge removes its temporary files, which would destroy the shard
+            if (fs::exists(working_directory) && fs::equivalent(shard_directories[i], working_directory))
+            {
+                throw std::runtime_error("The working directory of the merge must differ from the shard directory "
+                                         + shard_directories[i]);
+            }
+
+            shards[i].directory = shard_directories[i];
+            load_shard(shards[i]);
+        }
+
+        /// All shards must be built with the same parameters and cover the same groups
+        auto parameters = shards[0].journal.parameters();
+        parameters.erase(std::remove_if(parameters.begin(), parameters.end(),
+                                        [](const auto& parameter) { return parameter.first == "shard"; }),
+                         parameters.end());
+
+        const auto num_shards = shards[0].num_shards;
+        std::vector<bool> found(num_shards, false);
+        for (const auto& shard : shards)
+        {
+            if (shard.num_shards != num_shards || shard.index >= num_shards || found[shard.index])
+            {
+                throw std::runtime_error("Shard " + std::to_string(shard.index) + "/" + std::to_string(shard.num_shards) +
+                                         " in " + shard.directory + " does not fit the other shards.");
+            }
+            found[shard.index] = true;
+
+            if (shard.group_ids != shards[0].group_ids)
+            {
+                throw std::runtime_error("Shards " + shards[0].directory + " and " + shard.directory +
+                                         " are built for different trees.");
+            }
+
+            for (const auto& [name, value] : parameters)
+            {
+                if (get_parameter(shard.journal, name) != value)
+                {
+                    throw std::runtime_error("Shards " + shards[0].directory + " and " + shard.directory +
+                                             " are built with different parameters: " + name + ".");
+                }
+            }
+        }
+
+        if (const auto it = std::find(found.begin(), found.end(), false); it != found.end())
+        {
+            throw std::runtime_error("Shard " + std::to_string(it - found.begin()) + "/" + std::to_string(num_shards) +
+                                     " is missing.");
+        }
+
+        if (get_parameter(shards[0].journal, "sequence_type") != seq_type::name ||
+            get_parameter(shards[0].journal, "keep_positions") != (keep_positions ? "true" : "false"))
+        {
+            throw std::runtime_error("The shards are built by a different version of IPK: sequence type " +
+                                     get_parameter(shards[0].journal, "sequence_type") + ", keep positions " +
+                                     get_parameter(shards[0].journal, "keep_positions") + ".");
+        }
+
+        /// Find the shard that explored every group
+        const auto& group_ids = shards[0].group_ids;
+        std::vector<std::string> group_dirs;
+        group_dirs.reserve(group_ids.size());
+        size_t num_explored = 0;
+        for (const auto group_id : group_ids)
+        {
+            const auto it = std::find_if(shards.begin(), shards.end(),
+                                         [group_id](const auto& shard) { return shard.journal.get_group(group_id); });
+            if (it == shards.end())
+            {
+                throw std::runtime_error("No shard has computed the group " + std::to_string(group_id) + ".");
+            }
+            group_dirs.push_back(it->directory);
+            num_explored += *it->journal.get_group(group_id);
+        }
+        metrics.add_explored(num_explored);
+
+        /// The original tree
+        std::ifstream tree_stream(get_shard_tree(shards[0].directory));
+        const auto newick = std::string(std::istreambuf_iterator<char>(tree_stream), std::istreambuf_iterator<char>());
+        std::ostringstream tree_hash;
+        tree_hash << std::hex << fnv1a(newick);
+        if (tree_hash.str() != get_parameter(shards[0].journal, "tree"))
+        {
+            throw std::runtime_error("The tree of the shard " + shards[0].directory + " is corrupted.");
+        }
+        const auto tree = i2l::io::load_newick(get_shard_tree(shards[0].directory));
+
+        const auto filter = get_parameter(shards[0].journal, "filter") == "mif0" ? filter_type::mif0 : filter_type::random;
+        const auto ghosts = get_parameter(shards[0].journal, "ghosts");
+        const auto strategy = ghosts == "inner-only" ? ghost_strategy::INNER_ONLY
+            : ghosts == "outer-only" ? ghost_strategy::OUTER_ONLY : ghost_strategy::BOTH;
+        const auto kmer_size = std::stoul(get_parameter(shards[0].journal, "k"));
+        const auto omega = std::stof(get_parameter(shards[0].journal, "omega"));
+
+        /// Nothing is explored, so there are no matrices and ghost nodes
+        proba_matrix matrix(nullptr);
+        const ghost_mapping mapping;
+        const ar::mapping ar_mapping;
+
         db_builder builder(working_directory, output_filename,
+                           tree, tree,
+                           matrix,
+                           mapping, ar_mapping, false,
+                           ipk::algorithm::DCLA, strategy,
+                           kmer_size, omega,
+                           filter, 0.0, 1, true, options, metrics);
+
+        if (get_parameter(shards[0].journal, "batches") != std::to_string(builder._num_batches))
+        {
+            throw std::runtime_error("The shards are split in " + get_parameter(shards[0].journal, "batches") +
+                                     " batches, this version of IPK supports " +
+                                     std::to_string(builder._num_batches) + ".");
+        }
+        builder.merge(group_ids, std::move(group_dirs));
+    }
+
+    phylo_kmer_db build_in_memory(const string& working_directory,
+                                  const phylo_tree& original_tree, const phylo_tree& extended_tree,
+                                  proba_matrix& matrix,
+                                  const ghost_mapping& mapping, const ar::mapping& ar_mapping, bool merge_branches,
+                                  ipk::algorithm algorithm, ipk::ghost_strategy strategy,
+                                  size_t kmer_size, phylo_kmer::score_type omega,
+                                  filter_type filter, double mu, size_t num_threads,
+                                  const build_options& options, build_metrics& metrics,
+                                  db_writer* sink)
+    {
+        if (options.num_shards > 0 || options.resume || options.keep_groups || !options.update_from.empty())
+        {
+            throw std::runtime_error("Shards, resuming and updating builds are not supported by in-memory builds.");
+        }
+
+        /// The database is spilled only if there is a directory for it and a sink to write it to.
+        /// Otherwise, the budget is not enforced
+        const auto can_spill = !working_directory.empty() && sink;
+        metrics.memory().set_budget(can_spill ? options.max_ram : 0);
+
+        auto target_options = options;
+        if (can_spill && options.max_ram > 0)
+        {
+            target_options.write_buffer_size = std::min(options.write_buffer_size, options.max_ram / 4);
+        }
+
+        db_builder builder(can_spill ? working_directory : "", "",
                            original_tree, extended_tree,
                            matrix,
                            mapping, ar_mapping, merge_branches,
                            algorithm, strategy,
                            kmer_size, omega,
-                           filter, mu, num_threads, on_disk);
+                           filter, mu, num_threads, false, target_options, metrics);
+        builder._sink = sink;
+        builder._keep_database = !sink;
         builder.run();
+
+        if (!sink)
+        {
+            return std::move(builder._phylo_kmer_db);
+        }
+        return phylo_kmer_db{ kmer_size, omega, seq_type::name, i2l::io::to_newick(original_tree) };
     }
 }
@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <vector>
+#include <boost/archive/binary_oarchive.hpp>
+#include <i2l/seq.h>
+#include "db_writer.h"
+#include "block_db.h"
+#include "flat_db.h"
+
+using namespace ipk;
+
+db_format ipk::parse_db_format(const std::string& name)
+{
+    if (name == "ipk")
+    {
+        return db_format::ipk;
+    }
+    else if (name == "flat")
+    {
+        return db_format::flat;
+    }
+    else if (name == "blocks")
+    {
+        return db_format::blocks;
+    }
+    throw std::runtime_error("Unknown database format: " + name + ". Supported: ipk, flat, blocks.");
+}
+
+namespace ipk
+{
+    /// Writes the Boost archive of i2l
+    class ipk_writer final : public db_writer
+    {
+    public:
+        explicit ipk_writer(const std::string& filename)
+            : _out(filename)
+        {
+            if (!_out)
+            {
+                throw std::runtime_error("Could not open the output file: " + filename);
+            }
+            _archive = std::make_unique<boost::archive::binary_oarchive>(_out);
+        }
+
+        void write_header(const i2l::ipk_header& header) override
+        {
+            i2l::save_header(*_archive, header);
+        }
+
+        void write_kmer(i2l::phylo_kmer::key_type key, float filter_value,
+                        const i2l::pkdb_value_vector& entries) override
+        {
+            i2l::save_phylo_kmer(*_archive, key, filter_value, entries);
+        }
+
+        size_t close() override
+        {
+            _out.flush();
+            return static_cast<size_t>(_out.tellp());
+        }
+
+    private:
+        std::ofstream _out;
+        std::unique_ptr<boost::archive::binary_oarchive> _archive;
+    };
+
+    /// An output file written at known offsets, with the sections aligned to 8 bytes
+    class binary_output
+    {
+    public:
+        explicit binary_output(const std::string& filename)
+            : _out(filename, std::ios::binary)
+        {
+            if (!_out)
+            {
+                throw std::runtime_error("Could not open the output file: " + filename);
+            }
+        }
+
+        void write(const void* data, size_t size)
+        {
+            _out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        }
+
+        uint64_t offset()
+        {
+            return static_cast<uint64_t>(_out.tellp());
+        }
+
+        /// Pads the output to a multiple of 8 bytes
+        void align()
+        {
+            static constexpr char padding[8] = {};
+            if (const auto remainder = offset() % 8; remainder != 0)
+            {
+                write(padding, 8 - remainder);
+            }
+        }
+
+        /// Writes the newick tree and the tree index, each followed by the padding.
+        /// Fills the offsets and sizes of both sections in the header
+        template<typename Header>
+        void write_tree(const i2l::ipk_header& header, Header& output_header)
+        {
+            output_header.tree_offset = offset();
+            output_header.tree_size = header.tree.size();
+            write(header.tree.data(), header.tree.size());
+            align();
+
+            output_header.tree_index_offset = offset();
+            output_header.tree_index_size = header.tree_index.size();
+            for (const auto& [num_nodes, total_length] : header.tree_index)
+            {
+                const auto record = flat::node_record{ num_nodes, total_length };
+                write(&record, sizeof(record));
+            }
+            align();
+        }
+
+        /// Rewrites the header at the beginning of the file. Returns the file size
+        template<typename Header>
+        uint64_t finish(const Header& header)
+        {
+            const auto size = offset();
+            _out.seekp(0);
+            write(&header, sizeof(header));
+            _out.flush();
+            if (!_out)
+            {
+                throw std::runtime_error("Could not write the output database");
+            }
+            return size;
+        }
+
+    private:
+        std::ofstream _out;
+    };
+
+    /// Copies entries to the flat representation, with the padding zeroed so that
+    /// the output is deterministic
+    void to_flat(const i2l::pkdb_value_vector& entries, std::vector<flat::entry>& buffer)
+    {
+        buffer.resize(entries.size());
+        std::memset(buffer.data(), 0, buffer.size() * sizeof(flat::entry));
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            buffer[i].branch = entries[i].branch;
+            buffer[i].score = entries[i].score;
+#ifdef KEEP_POSITIONS
+            buffer[i].position = entries[i].position;
+#endif
+        }
+    }
+
+    /// Fills the fields shared by the flat and block layouts
+    template<typename Header>
+    void fill_header(const i2l::ipk_header& header, const char* magic, uint32_t version, Header& output_header)
+    {
+        std::memcpy(output_header.magic, magic, sizeof(output_header.magic));
+        output_header.version = version;
+        output_header.entry_size = sizeof(flat::entry);
+        std::strncpy(output_header.sequence_type, header.sequence_type.c_str(),
+                     sizeof(output_header.sequence_type) - 1);
+        output_header.kmer_size = static_cast<uint32_t>(header.kmer_size);
+        output_header.omega = header.omega;
+#ifdef KEEP_POSITIONS
+        output_header.keep_positions = 1;
+#else
+        output_header.keep_positions = 0;
+#endif
+    }
+
+    /// \brief Writes the flat layout, see flat::header.
+    /// \details Entries are written as they come. Index records are kept in memory,
+    /// sorted and written by close(). The header is written last.
+    class flat_writer final : public db_writer
+    {
+    public:
+        explicit flat_writer(const std::string& filename)
+            : _out(filename), _header{}
+        {}
+
+        void write_header(const i2l::ipk_header& header) override
+        {
+            fill_header(header, flat::magic, flat::version, _header);
+
+            /// The header is rewritten by close()
+            _out.write(&_header, sizeof(_header));
+            _out.write_tree(header, _header);
+
+            _header.entries_offset = _out.offset();
+            _index.reserve(header.num_kmers);
+        }
+
+        void write_kmer(i2l::phylo_kmer::key_type key, float filter_value,
+                        const i2l::pkdb_value_vector& entries) override
+        {
+            _index.push_back({ key, _header.num_entries, static_cast<uint32_t>(entries.size()), filter_value });
+            _header.num_entries += entries.size();
+
+            to_flat(entries, _buffer);
+            _out.write(_buffer.data(), _buffer.size() * sizeof(flat::entry));
+        }
+
+        size_t close() override
+        {
+            _out.align();
+            _header.index_offset = _out.offset();
+            _header.num_kmers = _index.size();
+
+            std::sort(_index.begin(), _index.end(),
+                      [](const auto& a, const auto& b) { return a.key < b.key; });
+            _out.write(_index.data(), _index.size() * sizeof(flat::index_record));
+            return _out.finish(_header);
+        }
+
+    private:
+        binary_output _out;
+        flat::header _header;
+        std::vector<flat::index_record> _index;
+        std::vector<flat::entry> _buffer;
+    };
+
+    /// \brief Writes the block layout, see blocks::header.
+    /// \details K-mers are serialized into a block until it reaches the block size. Full blocks
+    /// are compressed asynchronously, up to two blocks per thread at once, and written in order
+    /// as soon as they are ready. The block index is written by close().
+    class block_writer final : public db_writer
+    {
+    public:
+        block_writer(const std::string& filename, size_t num_threads, int compression_level)
+            : _out(filename), _header{}
+            , _compression_level{ compression_level }
+            , _max_pending{ 2 * std::max<size_t>(1, num_threads) }
+        {
+            if (compression_level < 0 || compression_level > 9)
+            {
+                throw std::runtime_error("Wrong compression level: " + std::to_string(compression_level) +
+                                         ". Must be from 0 to 9.");
+            }
+            _block.reserve(blocks::default_block_size);
+        }
+
+        void write_header(const i2l::ipk_header& header) override
+        {
+            fill_header(header, blocks::magic, blocks::version, _header);
+            _header.compression_level = static_cast<uint32_t>(_compression_level);
+
+            /// The header is rewritten by close()
+            _out.write(&_header, sizeof(_header));
+            _out.write_tree(header, _header);
+
+            _header.blocks_offset = _out.offset();
+        }
+
+        void write_kmer(i2l::phylo_kmer::key_type key, float filter_value,
+                        const i2l::pkdb_value_vector& entries) override
+        {
+            to_flat(entries, _buffer);
+            const auto num_entries = static_cast<uint32_t>(entries.size());
+            append(&key, sizeof(key));
+            append(&filter_value, sizeof(filter_value));
+            append(&num_entries, sizeof(num_entries));
+            append(_buffer.data(), _buffer.size() * sizeof(flat::entry));
+
+            ++_block_kmers;
+            ++_header.num_kmers;
+            _header.num_entries += entries.size();
+
+            if (_block.size() >= blocks::default_block_size)
+            {
+                submit();
+            }
+        }
+
+        size_t close() override
+        {
+            if (!_block.empty())
+            {
+                submit();
+            }
+            while (!_pending.empty())
+            {
+                write_pending();
+            }
+
+            _out.align();
+            _header.block_index_offset = _out.offset();
+            _header.num_blocks = _index.size();
+            _out.write(_index.data(), _index.size() * sizeof(blocks::block_record));
+            return _out.finish(_header);
+        }
+
+    private:
+        struct pending_block
+        {
+            std::future<std::vector<char>> data;
+            uint64_t uncompressed_size;
+            uint64_t num_kmers;
+        };
+
+        void append(const void* data, size_t size)
+        {
+            const auto bytes = static_cast<const char*>(data);
+            _block.insert(_block.end(), bytes, bytes + size);
+        }
+
+        /// Starts the compression of the current block
+        void submit()
+        {
+            while (_pending.size() >= _max_pending)
+            {
+                write_pending();
+            }
+
+            const auto uncompressed_size = _block.size();
+            auto data = std::async(std::launch::async,
+                                   [block = std::move(_block), level = _compression_level]() {
+                                       return blocks::compress(block, level);
+                                   });
+            _pending.push_back({ std::move(data), uncompressed_size, _block_kmers });
+
+            _block = {};
+            _block.reserve(blocks::default_block_size);
+            _block_kmers = 0;
+        }
+
+        /// Waits for the oldest block and writes it
+        void write_pending()
+        {
+            auto& block = _pending.front();
+            const auto data = block.data.get();
+
+            _index.push_back({ _out.offset(), data.size(), block.uncompressed_size, block.num_kmers });
+            _out.write(data.data(), data.size());
+            _pending.pop_front();
+        }
+
+        binary_output _out;
+        blocks::header _header;
+        int _compression_level;
+        size_t _max_pending;
+
+        std::vector<char> _block;
+        uint64_t _block_kmers = 0;
+        std::deque<pending_block> _pending;
+        std::vector<blocks::block_record> _index;
+        std::vector<flat::entry> _buffer;
+    };
+}
+
+std::unique_ptr<db_writer> ipk::make_db_writer(db_format format, const std::string& filename,
+                                               size_t num_threads, int compression_level)
+{
+    switch (format)
+    {
+        case db_format::flat:
+            return std::make_unique<flat_writer>(filename);
+        case db_format::blocks:
+            return std::make_unique<block_writer>(filename, num_threads, compression_level);
+        default:
+            return std::make_unique<ipk_writer>(filename);
+    }
+}
@@ -4,35 +4,11 @@
 using namespace i2l;
 using namespace ipk;
 
-phylo_node::branch_length_type total_branch_length(const phylo_node* root)
-{
-    if (root->is_leaf())
-    {
-        return 0.0;
-    }
-    else
-    {
-        phylo_node::branch_length_type length = 0.0;
-        for (const auto& node : visit_subtree(root))
-        {
-            if (node.is_leaf())
-            {
-                length += node.get_branch_length();
-            }
-            else
-            {
-                length += node.get_num_leaves() * node.get_branch_length();
-            }
-        }
-        /// exclude the branch that leads to the root, because it is not
-        /// in the subtree
-        length -= root->get_num_leaves() * root->get_branch_length();
-        return length;
-    }
-}
-
-/// Calculates the branch lengths from X0, X1 ghost nodes to their parents
-std::pair<phylo_node::branch_length_type, phylo_node::branch_length_type> calc_ghost_branch_lengths(const phylo_node* node)
+/// Calculates the branch lengths from X0, X1 ghost nodes to their parents.
+/// total_length is the sum of branch lengths of the subtree of the node, every branch
+/// weighted by the number of leaves under it, see tree_extender::compute_subtree_sums
+std::pair<phylo_node::branch_length_type, phylo_node::branch_length_type> calc_ghost_branch_lengths(
+    const phylo_node* node, phylo_node::branch_length_type total_length, size_t num_leaves)
 {
     auto old_branch_length = node->get_branch_length();
 
@@ -65,8 +41,7 @@ std::pair<phylo_node::branch_length_type, phylo_node::branch_length_type> calc_g
     {
         /// The mean branch length in the subtree of X0 can be recalculated from the
         /// mean branch length of the subtree of Node
-        const auto total_length = total_branch_length(node);
-        x1_branch_length = (total_length + residual_bl*node->get_num_leaves()) / node->get_num_leaves();
+        x1_branch_length = (total_length + residual_bl * num_leaves) / num_leaves;
     }
 
     return {x0_branch_length, x1_branch_length };
@@ -79,7 +54,9 @@ public:
     explicit tree_extender(const phylo_tree& original_tree)
         : _original_tree(original_tree)
         , _counter(original_tree.get_node_count() + 1)
-    {}
+    {
+        compute_subtree_sums();
+    }
     tree_extender(const tree_extender&) = delete;
     ~tree_extender() noexcept = default;
 
@@ -94,12 +71,52 @@ public:
         /// reindex the tree
         extended_tree.index();
 
+        /// Ghost nodes have their post-order ids only now
+        ghost_mapping mapping;
+        mapping.kinds.assign(extended_tree.get_node_count(), ghost_kind::none);
+        mapping.original_ids.assign(extended_tree.get_node_count(), ghost_mapping::no_original_id);
+        for (const auto& [ghost, kind, original_id] : _ghosts)
+        {
+            const auto id = ghost->get_postorder_id();
+            mapping.kinds[id] = kind;
+            mapping.original_ids[id] = original_id;
+        }
+
         /// return the tree and
         ///        the mapping Extended Node ID -> Original Postorder ID
-        return { std::move(extended_tree), std::move(_mapping) };
+        return { std::move(extended_tree), std::move(mapping) };
     }
 
 private:
+    /// Computes the number of leaves and the total branch length of every subtree of the
+    /// original tree in one post-order pass. A branch of the subtree is weighted by the number
+    /// of leaves under it, and the branch that leads to the subtree root is excluded
+    void compute_subtree_sums()
+    {
+        const auto num_nodes = _original_tree.get_node_count();
+        _num_leaves.assign(num_nodes, 0);
+        _subtree_lengths.assign(num_nodes, 0.0);
+
+        /// Children are visited before their parents
+        for (const auto& node : visit_subtree(_original_tree.get_root()))
+        {
+            const auto id = node.get_postorder_id();
+            if (node.is_leaf())
+            {
+                _num_leaves[id] = 1;
+                continue;
+            }
+
+            for (const auto* child : node.get_children())
+            {
+                const auto child_id = child->get_postorder_id();
+                _num_leaves[id] += _num_leaves[child_id];
+                _subtree_lengths[id] += _subtree_lengths[child_id] +
+                                        _num_leaves[child_id] * child->get_branch_length();
+            }
+        }
+    }
+
     void extend_subtree(phylo_node* node)
     {
         /// iterate over the copy, because we need to remove and insert elements
@@ -121,7 +138,9 @@ private:
             const auto original_node = _original_tree.get_by_postorder_id(node->get_postorder_id());
 
             /// Use it to calculate branch length. It is easier to do in the original tree
-            const auto& [x0_length, x1_length] = calc_ghost_branch_lengths(*original_node);
+            const auto id = (*original_node)->get_postorder_id();
+            const auto& [x0_length, x1_length] = calc_ghost_branch_lengths(*original_node, _subtree_lengths[id],
+                                                                           _num_leaves[id]);
 
             const auto x0_name = std::to_string(_counter++) + "_X0";
             auto x0 = new phylo_node(x0_name, x0_length, parent);
@@ -141,17 +160,25 @@ private:
             x1->add_child(x2);
             x1->add_child(x3);
 
-            /// Map the new ghost node IDs to the original post-order ID.
+            /// Map the new ghost nodes to the original post-order ID.
             /// This is needed to group x0 and x1 together,
             /// and for output purposes.
-            _mapping[x0_name] = node->get_postorder_id();
-            _mapping[x1_name] = node->get_postorder_id();
+            const auto original_id = static_cast<phylo_kmer::branch_type>(node->get_postorder_id());
+            _ghosts.emplace_back(x0, ghost_kind::inner, original_id);
+            _ghosts.emplace_back(x1, ghost_kind::outer, original_id);
         }
     }
 
     const phylo_tree& _original_tree;
     size_t _counter;
-    ghost_mapping _mapping;
+
+    /// Ghost nodes X0, X1 of the extended tree, with the post-order id of their original node
+    std::vector<std::tuple<const phylo_node*, ghost_kind, phylo_kmer::branch_type>> _ghosts;
+
+    /// The number of leaves and the total branch length of the subtree of every node of the
+    /// original tree, by post-order id. See compute_subtree_sums
+    std::vector<size_t> _num_leaves;
+    std::vector<phylo_node::branch_length_type> _subtree_lengths;
 };
 
 std::pair<phylo_tree, ghost_mapping> extend_tree(const phylo_tree& tree)
@@ -164,8 +191,11 @@ std::pair<phylo_tree, ghost_mapping> extend_tree(const phylo_tree& tree)
 std::tuple<phylo_tree, phylo_tree, ghost_mapping> ipk::preprocess_tree(const std::string& filename, bool use_unrooted)
 {
     /// load original tree
-    auto tree = i2l::io::load_newick(filename);
+    return preprocess_tree(i2l::io::load_newick(filename), use_unrooted);
+}
 
+std::tuple<phylo_tree, phylo_tree, ghost_mapping> ipk::preprocess_tree(phylo_tree tree, bool use_unrooted)
+{
     if (!tree.is_rooted())
     {
         if (!use_unrooted)
@@ -176,11 +206,9 @@ std::tuple<phylo_tree, phylo_tree, ghost_mapping> ipk::preprocess_tree(const std
         }
     }
 
-    /// inject ghost nodes
+    /// inject ghost nodes. The extension works on a copy, so the loaded tree is the original one
     auto [extended_tree, mapping] = extend_tree(tree);
-
-    auto original_tree = i2l::io::load_newick(filename);
-    return std::make_tuple(std::move(original_tree), std::move(extended_tree), mapping);
+    return std::make_tuple(std::move(tree), std::move(extended_tree), std::move(mapping));
 }
 
 void ipk::reroot_tree(phylo_tree& tree)
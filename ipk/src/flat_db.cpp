@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <i2l/seq.h>
+#include "flat_db.h"
+
+using namespace ipk;
+using namespace ipk::flat;
+
+namespace
+{
+    /// Checks that count items of the given size from offset are in a file of file_size bytes
+    bool fits(uint64_t offset, uint64_t count, size_t item_size, size_t file_size)
+    {
+        return offset <= file_size && count <= (file_size - offset) / item_size;
+    }
+}
+
+entry_range::entry_range(const entry* first, const entry* last) noexcept
+    : _first{ first }, _last{ last }
+{
+}
+
+const entry* entry_range::begin() const noexcept
+{
+    return _first;
+}
+
+const entry* entry_range::end() const noexcept
+{
+    return _last;
+}
+
+size_t entry_range::size() const noexcept
+{
+    return static_cast<size_t>(_last - _first);
+}
+
+bool entry_range::empty() const noexcept
+{
+    return _first == _last;
+}
+
+flat_db::flat_db(const std::string& filename)
+    : _file(filename)
+{
+    if (_file.size() < sizeof(header))
+    {
+        throw std::runtime_error("Not a flat IPK database: " + filename);
+    }
+
+    _header = reinterpret_cast<const header*>(_file.data());
+    if (std::memcmp(_header->magic, flat::magic, sizeof(flat::magic)) != 0)
+    {
+        throw std::runtime_error("Not a flat IPK database: " + filename);
+    }
+
+    if (_header->version != flat::version || _header->entry_size != sizeof(entry))
+    {
+        throw std::runtime_error("Unsupported version of the flat IPK database: " + filename);
+    }
+
+    /// The sequence type is not null-terminated if it takes all the field
+    const auto sequence_type = std::string(_header->sequence_type,
+                                           strnlen(_header->sequence_type, sizeof(_header->sequence_type)));
+    if (sequence_type != i2l::seq_type::name)
+    {
+        throw std::runtime_error("Wrong sequence type of the database " + filename + ": " + sequence_type);
+    }
+
+    if (!fits(_header->entries_offset, _header->num_entries, sizeof(entry), _file.size()) ||
+        !fits(_header->index_offset, _header->num_kmers, sizeof(index_record), _file.size()) ||
+        !fits(_header->tree_offset, _header->tree_size, 1, _file.size()) ||
+        !fits(_header->tree_index_offset, _header->tree_index_size, sizeof(node_record), _file.size()))
+    {
+        throw std::runtime_error("The flat IPK database is truncated: " + filename);
+    }
+
+    _index = reinterpret_cast<const index_record*>(_file.data() + _header->index_offset);
+    _entries = reinterpret_cast<const entry*>(_file.data() + _header->entries_offset);
+}
+
+entry_range flat_db::search(i2l::phylo_kmer::key_type key) const
+{
+    const auto it = std::lower_bound(begin(), end(), key,
+                                     [](const index_record& record, auto key) { return record.key < key; });
+    if (it == end() || it->key != key)
+    {
+        return { _entries, _entries };
+    }
+
+    /// Index records are checked when they are read, opening the database does not read them
+    if (it->first_entry > _header->num_entries || it->num_entries > _header->num_entries - it->first_entry)
+    {
+        throw std::runtime_error("The flat IPK database is corrupted: the entries of a k-mer are out of bounds");
+    }
+
+    const auto first = _entries + it->first_entry;
+    return { first, first + it->num_entries };
+}
+
+const index_record* flat_db::begin() const noexcept
+{
+    return _index;
+}
+
+const index_record* flat_db::end() const noexcept
+{
+    return _index + _header->num_kmers;
+}
+
+entry_range flat_db::entries() const noexcept
+{
+    return { _entries, _entries + _header->num_entries };
+}
+
+size_t flat_db::size() const noexcept
+{
+    return _header->num_kmers;
+}
+
+size_t flat_db::kmer_size() const noexcept
+{
+    return _header->kmer_size;
+}
+
+i2l::phylo_kmer::score_type flat_db::omega() const noexcept
+{
+    return _header->omega;
+}
+
+std::string_view flat_db::tree() const noexcept
+{
+    return { _file.data() + _header->tree_offset, _header->tree_size };
+}
+
+const node_record* flat_db::tree_index() const noexcept
+{
+    return reinterpret_cast<const node_record*>(_file.data() + _header->tree_index_offset);
+}
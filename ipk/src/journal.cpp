@@ -0,0 +1,228 @@
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "journal.h"
+
+using namespace ipk;
+namespace fs = boost::filesystem;
+
+bool build_journal::open(const std::string& filename, const parameter_list& parameters, bool resume)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _parameters.clear();
+    _groups.clear();
+    _digests.clear();
+    _batches.clear();
+
+    if (resume && fs::exists(filename))
+    {
+        load(filename);
+        check(filename, parameters);
+    }
+    _parameters = parameters;
+
+    /// Rewrite the journal with the complete records only. Otherwise, a record
+    /// written partially by the interrupted run would be merged with the next one.
+    /// The journal is replaced atomically, so it survives an interruption here too
+    const auto temp_filename = filename + ".tmp";
+    {
+        std::ofstream out(temp_filename, std::ios::trunc);
+        for (const auto& [name, value] : parameters)
+        {
+            out << "param " << name << ' ' << value << '\n';
+        }
+        for (const auto& [postorder_id, num_explored] : _groups)
+        {
+            out << "group " << postorder_id << ' ' << num_explored << ' '
+                << std::hex << _digests[postorder_id] << std::dec << '\n';
+        }
+        for (const auto& [batch_id, batch] : _batches)
+        {
+            out << "batch " << batch_id << ' ' << batch.num_kmers << ' ' << batch.num_entries << ' '
+                << batch.num_parts << '\n';
+        }
+
+        if (!out.flush())
+        {
+            throw std::runtime_error("Could not write the build journal: " + temp_filename);
+        }
+    }
+    fs::rename(temp_filename, filename);
+
+    _out.open(filename, std::ios::app);
+    if (!_out)
+    {
+        throw std::runtime_error("Could not open the build journal: " + filename);
+    }
+
+    return !_groups.empty() || !_batches.empty();
+}
+
+void build_journal::read(const std::string& filename)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _parameters.clear();
+    _groups.clear();
+    _digests.clear();
+    _batches.clear();
+    load(filename);
+}
+
+const build_journal::parameter_list& build_journal::parameters() const
+{
+    return _parameters;
+}
+
+const std::unordered_map<build_journal::branch_type, size_t>& build_journal::groups() const
+{
+    return _groups;
+}
+
+const std::unordered_map<build_journal::branch_type, uint64_t>& build_journal::digests() const
+{
+    return _digests;
+}
+
+void build_journal::load(const std::string& filename)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        throw std::runtime_error("Could not read the build journal: " + filename);
+    }
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        /// A line without the end of line was not written completely
+        if (in.eof())
+        {
+            break;
+        }
+
+        std::istringstream record(line);
+        std::string type;
+        record >> type;
+
+        if (type == "param")
+        {
+            std::string name, value;
+            if (record >> name >> value)
+            {
+                _parameters.emplace_back(name, value);
+            }
+        }
+        else if (type == "group")
+        {
+            branch_type postorder_id;
+            size_t num_explored;
+            uint64_t digest;
+            if (record >> postorder_id >> num_explored >> std::hex >> digest)
+            {
+                _groups[postorder_id] = num_explored;
+                _digests[postorder_id] = digest;
+            }
+        }
+        else if (type == "batch")
+        {
+            size_t batch_id, num_kmers, num_entries, num_parts;
+            if (record >> batch_id >> num_kmers >> num_entries >> num_parts)
+            {
+                _batches[batch_id] = { num_kmers, num_entries, num_parts };
+            }
+        }
+    }
+}
+
+void build_journal::check(const std::string& filename, const parameter_list& parameters) const
+{
+    for (const auto& [name, value] : parameters)
+    {
+        const auto it = std::find_if(_parameters.begin(), _parameters.end(),
+                                     [&name](const auto& parameter) { return parameter.first == name; });
+        if (it == _parameters.end() || it->second != value)
+        {
+            throw std::runtime_error("Cannot resume the build: parameter '" + name + "' is " + value +
+                                     ", but the journal " + filename + " has " +
+                                     (it == _parameters.end() ? std::string("none") : it->second) +
+                                     ". Run without --resume to start over.");
+        }
+    }
+}
+
+std::optional<size_t> build_journal::get_group(branch_type postorder_id) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto it = _groups.find(postorder_id); it != _groups.end())
+    {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+void build_journal::add_group(branch_type postorder_id, size_t num_explored, uint64_t digest)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _groups[postorder_id] = num_explored;
+    _digests[postorder_id] = digest;
+
+    std::ostringstream record;
+    record << "group " << postorder_id << ' ' << num_explored << ' ' << std::hex << digest;
+    write(record.str());
+}
+
+std::optional<build_journal::batch_record> build_journal::get_batch(size_t batch_id) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto it = _batches.find(batch_id); it != _batches.end())
+    {
+        return it->second;
+    }
+    return std::nullopt;
+}
+
+void build_journal::add_batch(size_t batch_id, size_t num_kmers, size_t num_entries, size_t num_parts)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _batches[batch_id] = { num_kmers, num_entries, num_parts };
+    write("batch " + std::to_string(batch_id) + " " + std::to_string(num_kmers) + " " + std::to_string(num_entries) +
+          " " + std::to_string(num_parts));
+}
+
+size_t build_journal::num_groups() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _groups.size();
+}
+
+size_t build_journal::num_batches() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _batches.size();
+}
+
+void build_journal::write(const std::string& record)
+{
+    _out << record << '\n' << std::flush;
+    if (!_out)
+    {
+        throw std::runtime_error("Could not write to the build journal");
+    }
+}
+
+uint64_t ipk::fnv1a(const std::string& data)
+{
+    return fnv1a(data.data(), data.size());
+}
+
+uint64_t ipk::fnv1a(const void* data, size_t size, uint64_t hash)
+{
+    const auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
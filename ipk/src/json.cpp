@@ -0,0 +1,168 @@
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include "json.h"
+
+using namespace ipk;
+
+json_writer::json_writer(std::ostream& out)
+    : _out{ out }, _after_key{ false }
+{
+}
+
+json_writer& json_writer::begin_object()
+{
+    before_value();
+    _out << '{';
+    _first.push_back(true);
+    return *this;
+}
+
+json_writer& json_writer::end_object()
+{
+    const bool empty = _first.back();
+    _first.pop_back();
+    if (!empty)
+    {
+        indent();
+    }
+    _out << '}';
+    if (_first.empty())
+    {
+        _out << '\n';
+    }
+    return *this;
+}
+
+json_writer& json_writer::begin_array()
+{
+    before_value();
+    _out << '[';
+    _first.push_back(true);
+    return *this;
+}
+
+json_writer& json_writer::end_array()
+{
+    const bool empty = _first.back();
+    _first.pop_back();
+    if (!empty)
+    {
+        indent();
+    }
+    _out << ']';
+    if (_first.empty())
+    {
+        _out << '\n';
+    }
+    return *this;
+}
+
+json_writer& json_writer::key(const std::string& name)
+{
+    before_value();
+    write_string(name);
+    _out << ": ";
+    _after_key = true;
+    return *this;
+}
+
+json_writer& json_writer::value(const std::string& value)
+{
+    before_value();
+    write_string(value);
+    return *this;
+}
+
+json_writer& json_writer::value(const char* value)
+{
+    return this->value(std::string(value));
+}
+
+json_writer& json_writer::value(bool value)
+{
+    before_value();
+    _out << (value ? "true" : "false");
+    return *this;
+}
+
+json_writer& json_writer::value(double value)
+{
+    before_value();
+    /// JSON has no representation for NaN and infinities
+    if (std::isfinite(value))
+    {
+        /// Format in a local stream, so that the format of the output stream does not change
+        std::ostringstream formatted;
+        formatted << std::setprecision(std::numeric_limits<double>::digits10) << value;
+        _out << formatted.str();
+    }
+    else
+    {
+        _out << "null";
+    }
+    return *this;
+}
+
+void json_writer::before_value()
+{
+    /// Values that follow a key go on the same line
+    if (_after_key)
+    {
+        _after_key = false;
+        return;
+    }
+
+    if (!_first.empty())
+    {
+        if (!_first.back())
+        {
+            _out << ',';
+        }
+        _first.back() = false;
+        indent();
+    }
+}
+
+void json_writer::indent()
+{
+    _out << '\n' << std::string(2 * _first.size(), ' ');
+}
+
+void json_writer::write_string(const std::string& value)
+{
+    _out << '"';
+    for (const char c : value)
+    {
+        switch (c)
+        {
+            case '"':
+                _out << "\\\"";
+                break;
+            case '\\':
+                _out << "\\\\";
+                break;
+            case '\n':
+                _out << "\\n";
+                break;
+            case '\t':
+                _out << "\\t";
+                break;
+            case '\r':
+                _out << "\\r";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    _out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                         << static_cast<int>(c) << std::dec << std::setfill(' ');
+                }
+                else
+                {
+                    _out << c;
+                }
+        }
+    }
+    _out << '"';
+}
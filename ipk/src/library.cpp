@@ -0,0 +1,102 @@
+#include <stdexcept>
+#include <i2l/seq.h>
+#include "library.h"
+#include "proba_matrix.h"
+
+using namespace ipk;
+
+database_builder::database_builder(i2l::phylo_tree tree, library_parameters parameters)
+    : database_builder(preprocess_tree(std::move(tree), parameters.use_unrooted), std::move(parameters))
+{
+}
+
+database_builder::database_builder(std::tuple<i2l::phylo_tree, i2l::phylo_tree, ghost_mapping> trees,
+                                   library_parameters parameters)
+    : _parameters{ std::move(parameters) }
+    , _original_tree{ std::move(std::get<0>(trees)) }
+    , _extended_tree{ std::move(std::get<1>(trees)) }
+    , _ghost_mapping{ std::move(std::get<2>(trees)) }
+    , _metrics{ std::make_unique<build_metrics>(false) }
+{
+}
+
+const i2l::phylo_tree& database_builder::original_tree() const noexcept
+{
+    return _original_tree;
+}
+
+const i2l::phylo_tree& database_builder::extended_tree() const noexcept
+{
+    return _extended_tree;
+}
+
+i2l::phylo_kmer_db database_builder::build(std::unique_ptr<ar::reader> reader, i2l::phylo_tree& ar_tree)
+{
+    /// Ancestral reconstruction unroots the tree, see build_database of the command line
+    if (_original_tree.is_rooted() && !ar_tree.is_rooted())
+    {
+        reroot_tree(ar_tree);
+    }
+    return run(std::move(reader), ar_tree, nullptr);
+}
+
+i2l::phylo_kmer_db database_builder::build(std::unique_ptr<ar::reader> reader)
+{
+    return run(std::move(reader), _extended_tree, nullptr);
+}
+
+void database_builder::build(std::unique_ptr<ar::reader> reader, i2l::phylo_tree& ar_tree, db_writer& sink)
+{
+    if (_original_tree.is_rooted() && !ar_tree.is_rooted())
+    {
+        reroot_tree(ar_tree);
+    }
+    run(std::move(reader), ar_tree, &sink);
+}
+
+void database_builder::build(std::unique_ptr<ar::reader> reader, db_writer& sink)
+{
+    run(std::move(reader), _extended_tree, &sink);
+}
+
+const build_metrics& database_builder::metrics() const noexcept
+{
+    return *_metrics;
+}
+
+i2l::phylo_kmer_db database_builder::run(std::unique_ptr<ar::reader> reader, const i2l::phylo_tree& ar_tree,
+                                         db_writer* sink)
+{
+    if (!reader)
+    {
+        throw std::runtime_error("No reader of ancestral reconstruction results.");
+    }
+
+    if (_parameters.kmer_size > i2l::seq_traits::max_kmer_length)
+    {
+        throw std::runtime_error("Maximum k-mer size allowed: " + std::to_string(i2l::seq_traits::max_kmer_length));
+    }
+
+    /// Metrics are not accumulated over builds
+    _metrics = std::make_unique<build_metrics>(false);
+
+    proba_matrix matrix(std::move(reader));
+    const auto ar_mapping = ar::map_nodes(_extended_tree, ar_tree);
+    matrix.index(ar_mapping);
+
+    /// The layout of the database is the one of the sink
+    build_options options;
+    options.schedule = _parameters.schedule;
+    options.max_ram = _parameters.max_ram;
+    options.spill = _parameters.spill;
+    options.write_buffer_size = _parameters.write_buffer_size;
+
+    return build_in_memory(_parameters.spill_directory,
+                           _original_tree, _extended_tree,
+                           matrix,
+                           _ghost_mapping, ar_mapping, _parameters.merge_branches,
+                           _parameters.algorithm, _parameters.ghost_strategy,
+                           _parameters.kmer_size, _parameters.omega,
+                           _parameters.filter, _parameters.mu, _parameters.num_threads,
+                           options, *_metrics, sink);
+}
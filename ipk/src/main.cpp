@@ -15,6 +15,7 @@
 #include "proba_matrix.h"
 #include "filter.h"
 #include "pk_compute.h"
+#include "metrics.h"
 
 namespace fs = boost::filesystem;
 using namespace i2l;
@@ -23,6 +24,7 @@ return_code print_help()
 {
     std::cout << "IPK (Inference of Phylo-Kmers)" << std::endl << std::endl
               << "Usage: IPK [...]" << std::endl
+              << "       IPK merge-shards [...]" << std::endl
               << ipk::cli::get_option_list() << std::endl;
 
     return return_code::help;
@@ -34,6 +36,21 @@ void check_parameters(const ipk::cli::parameters& parameters)
    {
        throw std::runtime_error("--merge-branches is only supported for IPK compiled with the KEEP_POSITIONS flag.");
    }
+
+   if (parameters.resume && !parameters.on_disk)
+   {
+       throw std::runtime_error("--resume is only supported for --on-disk builds.");
+   }
+
+   if (parameters.num_shards > 0 && !parameters.on_disk)
+   {
+       throw std::runtime_error("--shard is only supported for --on-disk builds.");
+   }
+
+   if ((parameters.keep_groups || !parameters.update_from.empty()) && !parameters.on_disk)
+   {
+       throw std::runtime_error("--keep-groups and --update-from are only supported for --on-disk builds.");
+   }
 }
 
 std::string save_extended_tree(const std::string& working_dir, const i2l::phylo_tree& tree)
@@ -52,12 +69,9 @@ std::pair<std::string, std::string> save_extended_alignment(const std::string& w
 
 
     fs::path fasta_path = directory / "extended_align.fasta";
-    std::cout << "Saving alignment to " << fasta_path.string() << "..." << std::endl;
-    ipk::save_alignment(alignment, fasta_path.string(), ipk::alignment_format::FASTA);
-
     fs::path phylip_path = directory / "extended_align.phylip";
-    std::cout << "Saving alignment to " << phylip_path.string() << "..." << std::endl;
-    ipk::save_alignment(alignment, phylip_path.string(), ipk::alignment_format::PHYLIP);
+    std::cout << "Saving alignment to " << fasta_path.string() << " and " << phylip_path.string() << "..." << std::endl;
+    ipk::save_alignment(alignment, fasta_path.string(), phylip_path.string());
 
     return { fasta_path.string(), phylip_path.string() };
 }
@@ -117,6 +131,22 @@ ipk::ghost_strategy get_ghost_strategy(const ipk::cli::parameters& parameters)
     return ipk::ghost_strategy::BOTH;
 }
 
+ipk::build_options get_build_options(const ipk::cli::parameters& parameters)
+{
+    ipk::build_options options;
+    options.schedule = ipk::parse_schedule_policy(parameters.schedule);
+    options.format = ipk::parse_db_format(parameters.format);
+    options.compression_level = parameters.uncompressed ? 0 : parameters.compression_level;
+    options.spill = ipk::parse_spill_codec(parameters.spill_codec);
+    options.max_ram = parameters.max_ram;
+    options.resume = parameters.resume;
+    options.shard_index = parameters.shard_index;
+    options.num_shards = parameters.num_shards;
+    options.keep_groups = parameters.keep_groups;
+    options.update_from = parameters.update_from;
+    return options;
+}
+
 std::string compression_status(const ipk::cli::parameters& parameters)
 {
     if (parameters.uncompressed)
@@ -128,10 +158,13 @@ std::string compression_status(const ipk::cli::parameters& parameters)
 
 return_code build_database(const ipk::cli::parameters& parameters)
 {
-    if (parameters.kmer_size > seq_traits::max_kmer_length)
+    for (const auto kmer_size : parameters.kmer_sizes)
     {
-        std::cerr << "Maximum k-mer size allowed: " << seq_traits::max_kmer_length << std::endl;
-        return return_code::argument_error;
+        if (kmer_size > seq_traits::max_kmer_length)
+        {
+            std::cerr << "Maximum k-mer size allowed: " << seq_traits::max_kmer_length << std::endl;
+            return return_code::argument_error;
+        }
     }
 
     /// Load and filter the reference alignment
@@ -139,15 +172,16 @@ return_code build_database(const ipk::cli::parameters& parameters)
                                                 parameters.alignment_file,
                                                 parameters.reduction_ratio,
                                                 parameters.no_reduction,
-                                                parameters.verbose);
+                                                parameters.verbose,
+                                                parameters.num_threads);
 
     /// Load and extend the reference tree
     const auto& [original_tree, extended_tree, ghost_mapping] = ipk::preprocess_tree(parameters.original_tree_file,
                                                                                       parameters.use_unrooted);
     const auto extended_tree_file = save_extended_tree(parameters.working_directory, extended_tree);
 
-    /// Extend the alignment
-    auto extended_alignment = ipk::extend_alignment(alignment, extended_tree);
+    /// Extend the alignment. The reduced alignment is not used anymore
+    auto extended_alignment = ipk::extend_alignment(std::move(alignment), extended_tree);
     const auto& [ext_alignment_fasta, ext_alignment_phylip] =
         save_extended_alignment(parameters.working_directory, extended_alignment);
     (void)ext_alignment_fasta;
@@ -155,7 +189,24 @@ return_code build_database(const ipk::cli::parameters& parameters)
     /// Prepare and run ancestral reconstruction
     auto [ar_software, ar_parameters] = ipk::ar::make_parameters(parameters,
                                                                  extended_tree_file, ext_alignment_phylip);
-    auto [proba_matrix, ar_tree] = ipk::ar::ancestral_reconstruction(ar_software, ar_parameters);
+    if (parameters.ar_partitions > 1)
+    {
+        ar_parameters.partition_files = ipk::save_partitions(extended_alignment, ext_alignment_phylip,
+                                                             parameters.ar_partitions);
+    }
+
+    /// Do not run ancestral reconstruction again if it was finished by the interrupted run
+    const auto ar_alignment_files = ar_parameters.partition_files.empty()
+        ? std::vector<std::string>{ ext_alignment_phylip }
+        : ar_parameters.partition_files;
+    if (parameters.resume && ar_parameters.ar_dir.empty() && ipk::ar::has_results(ar_software, ar_alignment_files))
+    {
+        ar_parameters.ar_dir = fs::path(ext_alignment_phylip).parent_path().string();
+        std::cout << "Resuming the build: reusing ancestral reconstruction results from "
+                  << ar_parameters.ar_dir << std::endl;
+    }
+    ipk::build_metrics metrics(!parameters.metrics_json.empty());
+    auto [proba_matrix, ar_tree] = ipk::ar::ancestral_reconstruction(ar_software, ar_parameters, metrics);
 
     if (parameters.ar_only)
     {
@@ -164,6 +215,11 @@ return_code build_database(const ipk::cli::parameters& parameters)
             std::cout << "--ar-only requested. Finishing after ancestral reconstruction." << std::endl;
         }
 
+        if (!parameters.metrics_json.empty())
+        {
+            metrics.save(parameters.metrics_json);
+        }
+
         return return_code::success;
     }
 
@@ -178,6 +234,7 @@ return_code build_database(const ipk::cli::parameters& parameters)
     }
 
     const auto ar_mapping = ipk::ar::map_nodes(extended_tree, ar_tree);
+    proba_matrix.index(ar_mapping);
 
     ipk::build(
         parameters.working_directory,
@@ -190,12 +247,50 @@ return_code build_database(const ipk::cli::parameters& parameters)
         parameters.merge_branches,
         get_algorithm_type(parameters),
         get_ghost_strategy(parameters),
-        parameters.kmer_size,
-        parameters.omega,
+        parameters.kmer_sizes,
+        parameters.omegas,
         get_filter_type(parameters),
         parameters.mu,
         parameters.num_threads,
-        parameters.on_disk);
+        parameters.on_disk,
+        get_build_options(parameters),
+        metrics);
+
+    if (!parameters.metrics_json.empty())
+    {
+        metrics.save(parameters.metrics_json);
+        std::cout << "Metrics: " << parameters.metrics_json << std::endl;
+    }
+
+    if (!parameters.profile.empty())
+    {
+        metrics.save_profile(parameters.profile, parameters.profile_top);
+        metrics.print_profile(std::cout, parameters.profile_top);
+        std::cout << "Profile: " << parameters.profile << std::endl;
+    }
+    return return_code::success;
+}
+
+return_code merge_shards(const ipk::cli::parameters& parameters)
+{
+    ipk::build_metrics metrics(!parameters.metrics_json.empty());
+
+    ipk::build_options options;
+    options.format = ipk::parse_db_format(parameters.format);
+    options.compression_level = parameters.uncompressed ? 0 : parameters.compression_level;
+    options.resume = parameters.resume;
+    options.max_ram = parameters.max_ram;
+    ipk::merge_shards(parameters.shard_directories,
+                      parameters.working_directory,
+                      parameters.output_filename,
+                      options,
+                      metrics);
+
+    if (!parameters.metrics_json.empty())
+    {
+        metrics.save(parameters.metrics_json);
+        std::cout << "Metrics: " << parameters.metrics_json << std::endl;
+    }
     return return_code::success;
 }
 
@@ -211,6 +306,10 @@ return_code run(const ipk::cli::parameters& parameters)
         {
             return build_database(parameters);
         }
+        case ipk::cli::action_t::merge_shards:
+        {
+            return merge_shards(parameters);
+        }
         default:
         {
             return return_code::unknown_error;
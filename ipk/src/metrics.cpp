@@ -0,0 +1,503 @@
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <tuple>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <sys/resource.h>
+#include "metrics.h"
+#include "json.h"
+
+using namespace ipk;
+using std::chrono::nanoseconds;
+
+namespace
+{
+    nanoseconds cpu_time(clockid_t clock)
+    {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return std::chrono::seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+    }
+
+    /// Stages are measured with the CPU time of the whole process,
+    /// sub-stages with the CPU time of the calling thread
+    nanoseconds cpu_time(substage substage)
+    {
+        return cpu_time(substage == substage::total ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    const char* to_string(stage stage)
+    {
+        switch (stage)
+        {
+            case stage::ancestral_reconstruction:
+                return "ancestral_reconstruction";
+            case stage::computation:
+                return "computation";
+            case stage::filtering:
+                return "filtering";
+            case stage::merge:
+                return "merge";
+            default:
+                throw std::runtime_error("Internal error: unknown stage");
+        }
+    }
+
+    const char* to_string(substage substage)
+    {
+        switch (substage)
+        {
+            case substage::total:
+                return "total";
+            case substage::ar_run:
+                return "ar_run";
+            case substage::ar_indexing:
+                return "ar_indexing";
+            case substage::matrix_parse:
+                return "matrix_parse";
+            case substage::enumeration:
+                return "enumeration";
+            case substage::hashing:
+                return "hashing";
+            case substage::temp_io:
+                return "temp_io";
+            case substage::filter:
+                return "filter";
+            case substage::sort:
+                return "sort";
+            case substage::serialize:
+                return "serialize";
+            default:
+                throw std::runtime_error("Internal error: unknown substage");
+        }
+    }
+
+    const char* to_string(memory_component component)
+    {
+        switch (component)
+        {
+            case memory_component::matrices:
+                return "matrices";
+            case memory_component::group_maps:
+                return "group_maps";
+            case memory_component::database:
+                return "database";
+            case memory_component::kmer_order:
+                return "kmer_order";
+            case memory_component::merge_buffers:
+                return "merge_buffers";
+            default:
+                throw std::runtime_error("Internal error: unknown memory component");
+        }
+    }
+
+    /// Raises the peak to the value if it is larger
+    void update_peak(std::atomic<size_t>& peak, size_t value)
+    {
+        auto current = peak.load(std::memory_order_relaxed);
+        while (current < value && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    double to_mb(size_t bytes)
+    {
+        return static_cast<double>(bytes) / (1024 * 1024);
+    }
+
+    double to_ms(int64_t ns)
+    {
+        return static_cast<double>(ns) / 1e6;
+    }
+
+    void write_group(json_writer& json, const group_record& record)
+    {
+        json.begin_object();
+        json.field("postorder_id", record.postorder_id);
+        json.field("nodes", record.num_nodes);
+        json.field("windows", record.num_windows);
+        json.field("emitted", record.num_emitted);
+        json.field("distinct", record.num_distinct);
+        json.field("time_ms", to_ms(record.time.count()));
+        json.field("matrix_load_ms", to_ms(record.matrix_load_time.count()));
+        json.end_object();
+    }
+}
+
+build_metrics::timer::timer(build_metrics* metrics, ipk::stage stage, ipk::substage substage)
+    : _metrics{ metrics }, _stage{ stage }, _substage{ substage }
+{
+    if (_metrics)
+    {
+        _wall_begin = std::chrono::steady_clock::now();
+        _cpu_begin = cpu_time(_substage);
+    }
+}
+
+build_metrics::timer::timer(timer&& other) noexcept
+    : _metrics{ other._metrics }, _stage{ other._stage }, _substage{ other._substage }
+    , _wall_begin{ other._wall_begin }, _cpu_begin{ other._cpu_begin }
+{
+    other._metrics = nullptr;
+}
+
+build_metrics::timer::~timer() noexcept
+{
+    stop();
+}
+
+void build_metrics::timer::stop()
+{
+    if (_metrics)
+    {
+        const auto wall = std::chrono::steady_clock::now() - _wall_begin;
+        const auto cpu = cpu_time(_substage) - _cpu_begin;
+        _metrics->add_time(_stage, _substage, std::chrono::duration_cast<nanoseconds>(wall), cpu);
+        _metrics = nullptr;
+    }
+}
+
+build_metrics::build_metrics(bool enabled)
+    : _enabled{ enabled }
+{
+}
+
+bool build_metrics::enabled() const
+{
+    return _enabled;
+}
+
+build_metrics::timer build_metrics::measure(ipk::stage stage, ipk::substage substage)
+{
+    /// Stages are long enough to be always measured. Sub-stages may be
+    /// measured millions of times, so we do it only if requested
+    const bool active = _enabled || substage == substage::total;
+    return { active ? this : nullptr, stage, substage };
+}
+
+void build_metrics::add_time(ipk::stage stage, ipk::substage substage, nanoseconds wall, nanoseconds cpu)
+{
+    auto& timing = _timings[static_cast<size_t>(stage)][static_cast<size_t>(substage)];
+    timing.wall_ns.fetch_add(wall.count(), std::memory_order_relaxed);
+    timing.cpu_ns.fetch_add(cpu.count(), std::memory_order_relaxed);
+}
+
+void build_metrics::add_explored(size_t num_kmers)
+{
+    _num_explored.fetch_add(num_kmers, std::memory_order_relaxed);
+}
+
+void build_metrics::add_hashed(size_t num_kmers)
+{
+    _num_hashed.fetch_add(num_kmers, std::memory_order_relaxed);
+}
+
+void build_metrics::set_stored(const std::string& target, size_t num_kmers, size_t num_entries)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    auto& counts = _targets[target];
+    counts.num_stored_kmers = num_kmers;
+    counts.num_stored_entries = num_entries;
+}
+
+void build_metrics::set_num_batches(const std::string& target, size_t num_batches)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    _targets[target].batches.resize(num_batches);
+}
+
+void build_metrics::set_batch(const std::string& target, size_t batch_id, size_t num_kmers, size_t num_entries)
+{
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    auto& batches = _targets[target].batches;
+    if (batch_id >= batches.size())
+    {
+        batches.resize(batch_id + 1);
+    }
+    batches[batch_id] = { num_kmers, num_entries };
+}
+
+void build_metrics::add_group(const group_record& record)
+{
+    std::lock_guard<std::mutex> lock(_groups_mutex);
+    _groups.push_back(record);
+}
+
+void build_metrics::add_bytes_written(size_t bytes)
+{
+    _bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void build_metrics::add_bytes_read(size_t bytes)
+{
+    _bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void memory_tracker::add(memory_component component, size_t bytes)
+{
+    const auto index = static_cast<size_t>(component);
+    update_peak(_peak[index], _current[index].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    update_peak(_peak_total, _total.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+}
+
+void memory_tracker::release(memory_component component, size_t bytes)
+{
+    _current[static_cast<size_t>(component)].fetch_sub(bytes, std::memory_order_relaxed);
+    _total.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t memory_tracker::current() const
+{
+    return _total.load(std::memory_order_relaxed);
+}
+
+size_t memory_tracker::current(memory_component component) const
+{
+    return _current[static_cast<size_t>(component)].load(std::memory_order_relaxed);
+}
+
+size_t memory_tracker::peak() const
+{
+    return _peak_total.load(std::memory_order_relaxed);
+}
+
+size_t memory_tracker::peak(memory_component component) const
+{
+    return _peak[static_cast<size_t>(component)].load(std::memory_order_relaxed);
+}
+
+void memory_tracker::set_budget(size_t bytes)
+{
+    _budget = bytes;
+}
+
+size_t memory_tracker::budget() const
+{
+    return _budget;
+}
+
+bool memory_tracker::over_budget() const
+{
+    return _budget > 0 && current() > _budget;
+}
+
+size_t memory_tracker::available() const
+{
+    if (_budget == 0)
+    {
+        return std::numeric_limits<size_t>::max();
+    }
+    const auto used = current();
+    return used < _budget ? _budget - used : 0;
+}
+
+memory_tracker& build_metrics::memory()
+{
+    return _memory;
+}
+
+const memory_tracker& build_metrics::memory() const
+{
+    return _memory;
+}
+
+void build_metrics::save(const std::string& filename) const
+{
+    std::ofstream out(filename);
+    if (!out)
+    {
+        throw std::runtime_error("Could not open file for writing: " + filename);
+    }
+
+    json_writer json(out);
+    json.begin_object();
+
+    json.key("stages").begin_object();
+    for (size_t i = 0; i < num_stages; ++i)
+    {
+        const auto& stage_timings = _timings[i];
+        json.key(to_string(static_cast<stage>(i))).begin_object();
+        json.field("wall_ms", to_ms(stage_timings[0].wall_ns));
+        json.field("cpu_ms", to_ms(stage_timings[0].cpu_ns));
+
+        json.key("substages").begin_object();
+        for (size_t j = 1; j < num_substages; ++j)
+        {
+            /// Skip sub-stages that never happened in this stage
+            if (stage_timings[j].wall_ns == 0 && stage_timings[j].cpu_ns == 0)
+            {
+                continue;
+            }
+
+            json.key(to_string(static_cast<substage>(j))).begin_object();
+            json.field("wall_ms", to_ms(stage_timings[j].wall_ns));
+            json.field("cpu_ms", to_ms(stage_timings[j].cpu_ns));
+            json.end_object();
+        }
+        json.end_object();
+        json.end_object();
+    }
+    json.end_object();
+
+    std::lock_guard<std::mutex> lock(_targets_mutex);
+    size_t num_stored_kmers = 0;
+    size_t num_stored_entries = 0;
+    for (const auto& [name, counts] : _targets)
+    {
+        num_stored_kmers += counts.num_stored_kmers;
+        num_stored_entries += counts.num_stored_entries;
+    }
+
+    /// Explored and hashed phylo-k-mers are shared by the targets explored together,
+    /// stored ones are summed up over the targets
+    json.key("phylo_kmers").begin_object();
+    json.field("explored", _num_explored.load());
+    json.field("hashed", _num_hashed.load());
+    json.field("stored_kmers", num_stored_kmers);
+    json.field("stored_entries", num_stored_entries);
+    json.end_object();
+
+    json.key("targets").begin_object();
+    for (const auto& [name, counts] : _targets)
+    {
+        json.key(name).begin_object();
+        json.field("stored_kmers", counts.num_stored_kmers);
+        json.field("stored_entries", counts.num_stored_entries);
+
+        json.key("batches").begin_array();
+        for (size_t batch_id = 0; batch_id < counts.batches.size(); ++batch_id)
+        {
+            json.begin_object();
+            json.field("id", batch_id);
+            json.field("kmers", counts.batches[batch_id].num_kmers);
+            json.field("entries", counts.batches[batch_id].num_entries);
+            json.end_object();
+        }
+        json.end_array();
+        json.end_object();
+    }
+    json.end_object();
+
+    json.key("io").begin_object();
+    json.field("bytes_written", _bytes_written.load());
+    json.field("bytes_read", _bytes_read.load());
+    json.end_object();
+
+    json.key("memory").begin_object();
+    json.field("budget_bytes", _memory.budget());
+    json.field("peak_bytes", _memory.peak());
+    json.key("peak_bytes_by_component").begin_object();
+    for (size_t i = 0; i < memory_tracker::num_components; ++i)
+    {
+        const auto component = static_cast<memory_component>(i);
+        json.field(to_string(component), _memory.peak(component));
+    }
+    json.end_object();
+    json.end_object();
+
+    json.field("peak_rss_bytes", peak_rss());
+    json.end_object();
+}
+
+std::vector<group_record> build_metrics::top_groups(size_t top) const
+{
+    std::vector<group_record> groups;
+    {
+        std::lock_guard<std::mutex> lock(_groups_mutex);
+        groups = _groups;
+    }
+
+    top = std::min(top, groups.size());
+    std::partial_sort(groups.begin(), groups.begin() + top, groups.end(),
+                      [](const group_record& a, const group_record& b) {
+                          return std::tie(b.time, a.postorder_id) < std::tie(a.time, b.postorder_id);
+                      });
+    groups.resize(top);
+    return groups;
+}
+
+void build_metrics::save_profile(const std::string& filename, size_t top) const
+{
+    std::ofstream out(filename);
+    if (!out)
+    {
+        throw std::runtime_error("Could not open file for writing: " + filename);
+    }
+
+    json_writer json(out);
+    json.begin_object();
+
+    json.key("top").begin_array();
+    for (const auto& record : top_groups(top))
+    {
+        write_group(json, record);
+    }
+    json.end_array();
+
+    json.key("groups").begin_array();
+    {
+        std::lock_guard<std::mutex> lock(_groups_mutex);
+        for (const auto& record : _groups)
+        {
+            write_group(json, record);
+        }
+    }
+    json.end_array();
+
+    json.end_object();
+}
+
+void build_metrics::print_profile(std::ostream& stream, size_t top) const
+{
+    /// Format in a local stream, so that the format of the caller's stream does not change
+    std::ostringstream out;
+    const auto groups = top_groups(top);
+    out << "Most expensive branch groups:" << std::endl;
+    out << std::setw(12) << "postorder id" << std::setw(8) << "nodes" << std::setw(10) << "windows"
+        << std::setw(14) << "emitted" << std::setw(12) << "distinct"
+        << std::setw(12) << "time (ms)" << std::setw(12) << "load (ms)" << std::endl;
+
+    for (const auto& record : groups)
+    {
+        out << std::setw(12) << record.postorder_id << std::setw(8) << record.num_nodes
+            << std::setw(10) << record.num_windows << std::setw(14) << record.num_emitted
+            << std::setw(12) << record.num_distinct
+            << std::setw(12) << std::fixed << std::setprecision(1) << to_ms(record.time.count())
+            << std::setw(12) << to_ms(record.matrix_load_time.count()) << std::endl;
+    }
+    stream << out.str() << std::endl;
+}
+
+void build_metrics::print_memory(std::ostream& stream) const
+{
+    std::ostringstream out;
+    out << "Peak memory (MB, estimated):";
+    for (size_t i = 0; i < memory_tracker::num_components; ++i)
+    {
+        const auto component = static_cast<memory_component>(i);
+        out << (i == 0 ? " " : ", ") << to_string(component) << " "
+            << std::fixed << std::setprecision(1) << to_mb(_memory.peak(component));
+    }
+    out << "; total " << to_mb(_memory.peak());
+    if (_memory.budget() > 0)
+    {
+        out << " of " << to_mb(_memory.budget());
+    }
+    stream << out.str() << std::endl;
+}
+
+size_t ipk::peak_rss()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    /// Bytes on macOS
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    /// Kilobytes on Linux
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
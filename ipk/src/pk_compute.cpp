@@ -10,8 +10,7 @@ bool kmer_score_comparator(const uphylo_kmer& k1, const uphylo_kmer& k2)
     return k1.score > k2.score;
 }
 
-/// Creates a vector of 1-mers from a column of PP matrix
-std::vector<uphylo_kmer> as_column(const window& window, size_t j, phylo_kmer::score_type eps)
+std::vector<uphylo_kmer> ipk::as_column(const window& window, size_t j, phylo_kmer::score_type eps)
 {
     std::vector<uphylo_kmer> column;
     for (size_t i = 0; i < seq_traits::alphabet_size; ++i)
@@ -203,7 +202,7 @@ void DCCW::run(phylo_kmer::score_type eps)
                     break;
                 }
 
-                const auto score = a_score * b_score;
+                const auto score = a_score + b_score;
                 if (score <= eps)
                 {
                     break;
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <stdexcept>
 #include "proba_matrix.h"
 #include "ar.h"
 
@@ -8,53 +10,175 @@ proba_matrix::proba_matrix(std::unique_ptr<ipk::ar::reader> reader)
 {
 }
 
-size_t proba_matrix::num_branches() const
+proba_matrix::proba_matrix(proba_matrix&& other) noexcept
+    : _data(std::move(other._data))
+    , _loaded(std::move(other._loaded))
+    , _labels(std::move(other._labels))
+    , _reader(std::move(other._reader))
 {
-    return _data.size();
 }
 
-size_t proba_matrix::num_sites() const
+void proba_matrix::index(const ar::mapping& mapping)
 {
-    return std::begin(_data)->second.width();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _labels = mapping.ar_labels;
+    _data.clear();
+    _data.resize(_labels.size());
+    _loaded.assign(_labels.size(), false);
 }
 
-proba_matrix::mapped_type& proba_matrix::operator[](const std::string& ar_label)
+size_t proba_matrix::num_branches() const
 {
-    return _data[ar_label];
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::count(_loaded.begin(), _loaded.end(), true);
 }
 
-const proba_matrix::mapped_type& proba_matrix::at(const std::string& ar_label) const
+size_t proba_matrix::num_sites() const
 {
-    return _data.at(ar_label);
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto it = std::find(_loaded.begin(), _loaded.end(), true);
+    return it == _loaded.end() ? 0 : _data[it - _loaded.begin()].width();
 }
 
-proba_matrix::iterator proba_matrix::find(const std::string& ar_label)
+proba_matrix::mapped_type& proba_matrix::get(ar::node_id id)
 {
-    auto it = _data.find(ar_label);
-    if (it == _data.end())
     {
-        _data[ar_label] = _reader->read_node(ar_label);
-        it = _data.find(ar_label);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (id >= _labels.size() || _labels[id].empty())
+        {
+            throw std::runtime_error("Internal error: no node of ancestral reconstruction for the node id " +
+                                     std::to_string(id) + ". Make sure it is in the ARTree_id_mapping file.");
+        }
+
+        if (_loaded[id])
+        {
+            return _data[id];
+        }
+    }
+
+    /// Parse without holding _mutex, so that other threads can get loaded matrices.
+    /// Another thread could have loaded the matrix while we waited for the reader
+    std::lock_guard<std::mutex> reader_lock(_reader_mutex);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_loaded[id])
+        {
+            return _data[id];
+        }
     }
-    return it;
+
+    auto node_matrix = _reader->read_node(_labels[id]);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _data[id] = std::move(node_matrix);
+    _loaded[id] = true;
+    return _data[id];
 }
 
-proba_matrix::iterator proba_matrix::begin()
+void proba_matrix::release(ar::node_id id)
 {
-    return std::begin(_data);
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (id < _data.size())
+    {
+        _data[id] = matrix();
+        _loaded[id] = false;
+    }
 }
 
-proba_matrix::iterator proba_matrix::end()
+matrix_loader::matrix_loader(proba_matrix& matrix, std::vector<group> groups, const std::vector<size_t>& order,
+                             size_t max_ahead, load_callback on_load)
+    : _matrix{ matrix }
+    , _groups{ std::move(groups) }
+    , _max_ahead{ std::max<size_t>(max_ahead, 1) }
+    , _on_load{ std::move(on_load) }
+    , _states(_groups.size(), group_state::pending)
 {
-    return std::end(_data);
+    _thread = std::thread(&matrix_loader::run, this, order);
 }
 
-proba_matrix::const_iterator proba_matrix::begin() const
+matrix_loader::~matrix_loader() noexcept
 {
-    return _data.cbegin();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopped = true;
+    }
+    _taken.notify_all();
+    _thread.join();
 }
 
-proba_matrix::const_iterator proba_matrix::end() const
+bool matrix_loader::take(size_t group_index)
 {
-    return std::end(_data);
+    std::unique_lock<std::mutex> lock(_mutex);
+    _loaded.wait(lock, [this, group_index]() { return _states[group_index] != group_state::loading; });
+
+    const auto state = _states[group_index];
+    _states[group_index] = group_state::taken;
+    if (state != group_state::loaded)
+    {
+        return false;
+    }
+
+    --_num_ready;
+    lock.unlock();
+    _taken.notify_one();
+    return true;
+}
+
+void matrix_loader::run(std::vector<size_t> order)
+{
+    for (const auto group_index : order)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _taken.wait(lock, [this]() { return _stopped || _num_ready < _max_ahead; });
+            if (_stopped)
+            {
+                return;
+            }
+
+            /// Taken by a consumer before the loader got to it
+            if (_states[group_index] != group_state::pending)
+            {
+                continue;
+            }
+            _states[group_index] = group_state::loading;
+        }
+
+        size_t bytes = 0;
+        bool failed = false;
+        try
+        {
+            for (const auto id : _groups[group_index])
+            {
+                const auto& node_matrix = _matrix.get(id);
+                bytes += node_matrix.get_data().size() * sizeof(node_matrix.get_data()[0]);
+            }
+            _on_load(bytes);
+        }
+        catch (...)
+        {
+            /// The consumer will load the group and get the error
+            failed = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (failed)
+            {
+                _states[group_index] = group_state::pending;
+                _stopped = true;
+            }
+            else
+            {
+                _states[group_index] = group_state::loaded;
+                ++_num_ready;
+            }
+        }
+        _loaded.notify_all();
+
+        if (failed)
+        {
+            return;
+        }
+    }
 }
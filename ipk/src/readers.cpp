@@ -0,0 +1,467 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <boost/algorithm/string.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/process.hpp>
+#include <i2l/seq.h>
+#include "readers.h"
+
+namespace bp = boost::process;
+
+namespace ipk::ar
+{
+    /// log10 of every probability of the columns
+    memory_reader::columns log_transform(memory_reader::columns probabilities)
+    {
+        for (auto& column : probabilities)
+        {
+            for (auto& value : column)
+            {
+                value = std::log10(value);
+            }
+        }
+        return probabilities;
+    }
+
+    memory_reader::memory_reader(std::unordered_map<std::string, columns> probabilities)
+    {
+        for (auto& [node_label, node_probabilities] : probabilities)
+        {
+            add(node_label, std::move(node_probabilities));
+        }
+    }
+
+    void memory_reader::add(const std::string& node_label, columns probabilities)
+    {
+        _scores[node_label] = log_transform(std::move(probabilities));
+    }
+
+    ipk::matrix memory_reader::read_node(const std::string& node_label)
+    {
+        const auto it = _scores.find(node_label);
+        if (it == _scores.end())
+        {
+            throw std::runtime_error("Could not read the AR matrix for the node " + node_label);
+        }
+        return { it->second, node_label };
+    }
+
+    /// \brief Reads the binary matrix cache. Reads are independent, as the file is memory-mapped
+    class matrix_cache_reader : public reader
+    {
+    public:
+        explicit matrix_cache_reader(const std::string& filename);
+        matrix_cache_reader(const matrix_cache_reader&) = delete;
+        matrix_cache_reader(matrix_cache_reader&&) = delete;
+        matrix_cache_reader& operator=(const matrix_cache_reader&) = delete;
+        matrix_cache_reader& operator=(matrix_cache_reader&&) = delete;
+        ~matrix_cache_reader() noexcept override = default;
+
+        ipk::matrix read_node(const std::string& node_label) override;
+
+    private:
+        boost::iostreams::mapped_file_source _file;
+
+        /// The offset and the width of every matrix by node label
+        std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> _index;
+    };
+
+    matrix_cache_reader::matrix_cache_reader(const std::string& filename)
+        : _file(filename)
+    {
+        if (_file.size() < sizeof(cache::header))
+        {
+            throw std::runtime_error("Not a matrix cache: " + filename);
+        }
+
+        cache::header header{};
+        std::memcpy(&header, _file.data(), sizeof(header));
+        if (std::memcmp(header.magic, cache::magic, sizeof(cache::magic)) != 0)
+        {
+            throw std::runtime_error("Not a matrix cache: " + filename);
+        }
+
+        if (header.version != cache::version || header.alphabet_size != i2l::seq_traits::alphabet_size)
+        {
+            throw std::runtime_error("Unsupported version or sequence type of the matrix cache: " + filename);
+        }
+
+        size_t position = header.index_offset;
+        const auto read = [this, &position, &filename](void* value, size_t size) {
+            if (position + size > _file.size())
+            {
+                throw std::runtime_error("The matrix cache is truncated: " + filename);
+            }
+            std::memcpy(value, _file.data() + position, size);
+            position += size;
+        };
+
+        for (size_t i = 0; i < header.num_nodes; ++i)
+        {
+            uint32_t label_size = 0;
+            read(&label_size, sizeof(label_size));
+            std::string node_label(label_size, '\0');
+            read(node_label.data(), label_size);
+
+            uint64_t offset = 0;
+            uint64_t width = 0;
+            read(&offset, sizeof(offset));
+            read(&width, sizeof(width));
+            if (offset + width * sizeof(matrix::column) > header.index_offset)
+            {
+                throw std::runtime_error("The matrix cache is corrupted: " + filename);
+            }
+            _index[node_label] = { offset, width };
+        }
+    }
+
+    ipk::matrix matrix_cache_reader::read_node(const std::string& node_label)
+    {
+        const auto it = _index.find(node_label);
+        if (it == _index.end())
+        {
+            throw std::runtime_error("Could not read the AR matrix for the node " + node_label);
+        }
+
+        const auto [offset, width] = it->second;
+        std::vector<matrix::column> data(width);
+        std::memcpy(data.data(), _file.data() + offset, width * sizeof(matrix::column));
+        return { std::move(data), node_label };
+    }
+
+    size_t save_matrix_cache(const std::string& filename, reader& source, const std::vector<std::string>& node_labels)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out)
+        {
+            throw std::runtime_error("Could not open the matrix cache for writing: " + filename);
+        }
+
+        cache::header header{};
+        std::memcpy(header.magic, cache::magic, sizeof(cache::magic));
+        header.version = cache::version;
+        header.alphabet_size = i2l::seq_traits::alphabet_size;
+        header.num_nodes = node_labels.size();
+
+        /// The header is written again once the index offset is known
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<std::pair<uint64_t, uint64_t>> index;
+        index.reserve(node_labels.size());
+        uint64_t offset = sizeof(header);
+        for (const auto& node_label : node_labels)
+        {
+            const auto node_matrix = source.read_node(node_label);
+            const auto& data = node_matrix.get_data();
+            out.write(reinterpret_cast<const char*>(data.data()),
+                      static_cast<std::streamsize>(data.size() * sizeof(matrix::column)));
+            index.emplace_back(offset, data.size());
+            offset += data.size() * sizeof(matrix::column);
+        }
+
+        header.index_offset = offset;
+        for (size_t i = 0; i < node_labels.size(); ++i)
+        {
+            const auto label_size = static_cast<uint32_t>(node_labels[i].size());
+            out.write(reinterpret_cast<const char*>(&label_size), sizeof(label_size));
+            out.write(node_labels[i].data(), label_size);
+            out.write(reinterpret_cast<const char*>(&index[i].first), sizeof(index[i].first));
+            out.write(reinterpret_cast<const char*>(&index[i].second), sizeof(index[i].second));
+        }
+        const auto size = static_cast<size_t>(out.tellp());
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!out.flush())
+        {
+            throw std::runtime_error("Could not write the matrix cache: " + filename);
+        }
+        return size;
+    }
+
+    std::unique_ptr<reader> make_matrix_cache_reader(const std::string& filename)
+    {
+        return std::make_unique<matrix_cache_reader>(filename);
+    }
+
+    /// \brief Reads matrices in the RAxML-NG format sequentially from a stream. See make_stream_reader
+    class stream_reader : public reader
+    {
+    public:
+        explicit stream_reader(std::string name) noexcept;
+        stream_reader(const stream_reader&) = delete;
+        stream_reader(stream_reader&&) = delete;
+        stream_reader& operator=(const stream_reader&) = delete;
+        stream_reader& operator=(stream_reader&&) = delete;
+        ~stream_reader() noexcept override = default;
+
+        ipk::matrix read_node(const std::string& node_label) override;
+
+    protected:
+        /// The stream to read from. Owned by the derived classes
+        virtual std::istream& stream() = 0;
+
+        /// Called once the stream is read to the end
+        virtual void finish() {}
+
+    private:
+        /// Reads the columns of the next node of the stream to _matrices.
+        /// Returns false if the stream is over
+        bool read_next_node();
+
+        std::string _name;
+
+        /// The first line of the next node, read ahead
+        std::string _line;
+        bool _finished = false;
+
+        /// log-transformed columns of the nodes read so far
+        std::unordered_map<std::string, std::vector<matrix::column>> _matrices;
+    };
+
+    stream_reader::stream_reader(std::string name) noexcept
+        : _name{ std::move(name) }
+    {}
+
+    ipk::matrix stream_reader::read_node(const std::string& node_label)
+    {
+        auto it = _matrices.find(node_label);
+        while (it == _matrices.end() && read_next_node())
+        {
+            it = _matrices.find(node_label);
+        }
+
+        if (it == _matrices.end())
+        {
+            throw std::runtime_error("Could not read the AR matrix for the node " + node_label + " from " + _name);
+        }
+        return { it->second, node_label };
+    }
+
+    /// Splits a line of the RAxML-NG format: Node, Site, State, and the probabilities of states.
+    /// Returns false for empty lines and the header
+    bool parse_line(const std::string& line, std::string& node_label, matrix::column& column)
+    {
+        std::vector<std::string> fields;
+        boost::split(fields, line, boost::is_any_of("\t"));
+        if (line.empty() || line[0] == '.' || fields[0] == "Node")
+        {
+            return false;
+        }
+
+        if (fields.size() != 3 + i2l::seq_traits::alphabet_size)
+        {
+            throw std::runtime_error("Parsing error: could not parse the line " + line);
+        }
+
+#if defined(SEQ_TYPE_DNA)
+        /// The order of nucleotides is the same as in the encoding of IPK
+        constexpr std::array<size_t, 4> order = { 0, 1, 2, 3 };
+#elif defined(SEQ_TYPE_AA)
+        /// The order of acids in the RAxML-ng format is not the same as
+        /// in the encoding of RAPPAS and IPK, see raxmlng_reader
+        constexpr std::array<size_t, 20> order = {
+            1, 8, 11, 3, 6, 15, 16, 2, 5, 4, 7, 14, 0, 9, 10, 12, 13, 17, 18, 19
+        };
+#else
+        static_assert(false, """Make sure the sequence type is defined. Supported types:\n"""
+                             """SEQ_TYPE_DNA"""
+                             """SEQ_TYPE_AA""");
+#endif
+        node_label = boost::trim_copy(fields[0]);
+        for (size_t i = 0; i < column.size(); ++i)
+        {
+            const auto& field = fields[3 + order[i]];
+            char* end = nullptr;
+            const auto value = std::strtof(field.c_str(), &end);
+            if (end == field.c_str())
+            {
+                throw std::runtime_error("Parsing error: could not parse the line " + line);
+            }
+            column[i] = std::log10(value);
+        }
+        return true;
+    }
+
+    bool stream_reader::read_next_node()
+    {
+        if (_finished)
+        {
+            return false;
+        }
+
+        std::string node_label;
+        std::string current_node;
+        std::vector<matrix::column> columns;
+        matrix::column column{};
+
+        auto& in = stream();
+        do
+        {
+            if (_line.empty() || !parse_line(_line, node_label, column))
+            {
+                continue;
+            }
+
+            if (!columns.empty() && node_label != current_node)
+            {
+                /// The line starts the next node. Keep it for the next call
+                _matrices[current_node] = std::move(columns);
+                return true;
+            }
+            current_node = node_label;
+            columns.push_back(column);
+        }
+        while (std::getline(in, _line));
+
+        if (in.bad())
+        {
+            throw std::runtime_error("Could not read ancestral reconstruction results from " + _name);
+        }
+
+        _finished = true;
+        finish();
+        if (!columns.empty())
+        {
+            _matrices[current_node] = std::move(columns);
+            return true;
+        }
+        return false;
+    }
+
+    /// Reads a file, a named pipe or the standard input
+    class file_stream_reader : public stream_reader
+    {
+    public:
+        explicit file_stream_reader(const std::string& filename)
+            : stream_reader{ filename }
+        {
+            if (filename != "-")
+            {
+                _file.open(filename);
+                if (!_file)
+                {
+                    throw std::runtime_error("Could not open " + filename);
+                }
+            }
+        }
+
+    protected:
+        std::istream& stream() override
+        {
+            return _file.is_open() ? _file : std::cin;
+        }
+
+    private:
+        std::ifstream _file;
+    };
+
+    /// Reads the standard output of a command
+    class process_reader : public stream_reader
+    {
+    public:
+        explicit process_reader(const std::string& command)
+            : stream_reader{ command }
+            , _command{ command }
+        {
+            std::vector<std::string> args;
+            boost::split(args, command, boost::is_any_of(" "), boost::token_compress_on);
+            if (args.empty() || args[0].empty())
+            {
+                throw std::runtime_error("No command to read ancestral reconstruction results from.");
+            }
+
+            const auto binary = args[0];
+            args.erase(args.begin());
+            try
+            {
+                _process = bp::child(bp::search_path(binary).string(), bp::args(args), bp::std_out > _output);
+            }
+            catch (const std::system_error& error)
+            {
+                throw std::runtime_error("Could not run " + command + ": " + error.what());
+            }
+        }
+
+    protected:
+        std::istream& stream() override
+        {
+            return _output;
+        }
+
+        void finish() override
+        {
+            _process.wait();
+            if (_process.exit_code() != 0)
+            {
+                throw std::runtime_error("The command " + _command + " failed with the exit code " +
+                                         std::to_string(_process.exit_code()));
+            }
+        }
+
+    private:
+        std::string _command;
+
+        /// The output is declared before the process, so that it is destroyed after it
+        bp::ipstream _output;
+        bp::child _process;
+    };
+
+    std::unique_ptr<reader> make_stream_reader(const std::string& filename)
+    {
+        return std::make_unique<file_stream_reader>(filename);
+    }
+
+    std::unique_ptr<reader> make_process_reader(const std::string& command)
+    {
+        return std::make_unique<process_reader>(command);
+    }
+
+    /// \brief Reads the matrices of column partitions of the same alignment and concatenates them
+    class partitioned_reader : public reader
+    {
+    public:
+        explicit partitioned_reader(std::vector<std::unique_ptr<reader>> partitions)
+            : _partitions{ std::move(partitions) }
+        {
+        }
+
+        partitioned_reader(const partitioned_reader&) = delete;
+        partitioned_reader(partitioned_reader&&) = delete;
+        partitioned_reader& operator=(const partitioned_reader&) = delete;
+        partitioned_reader& operator=(partitioned_reader&&) = delete;
+        ~partitioned_reader() noexcept override = default;
+
+        ipk::matrix read_node(const std::string& node_label) override
+        {
+            std::vector<matrix::column> columns;
+            for (auto& partition : _partitions)
+            {
+                auto part = partition->read_node(node_label);
+                auto& data = part.get_data();
+                columns.insert(columns.end(),
+                               std::make_move_iterator(data.begin()), std::make_move_iterator(data.end()));
+            }
+            return { std::move(columns), node_label };
+        }
+
+    private:
+        /// Readers of the partitions, in the order of the columns
+        std::vector<std::unique_ptr<reader>> _partitions;
+    };
+
+    std::unique_ptr<reader> make_partitioned_reader(std::vector<std::unique_ptr<reader>> partitions)
+    {
+        if (partitions.empty())
+        {
+            throw std::runtime_error("No partitions of ancestral reconstruction results to read.");
+        }
+        return std::make_unique<partitioned_reader>(std::move(partitions));
+    }
+}
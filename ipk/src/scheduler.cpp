@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <i2l/seq.h>
+#include "scheduler.h"
+#include "window.h"
+
+using namespace ipk;
+
+schedule_policy ipk::parse_schedule_policy(const std::string& name)
+{
+    if (name == "tree")
+    {
+        return schedule_policy::tree;
+    }
+    else if (name == "longest-first")
+    {
+        return schedule_policy::longest_first;
+    }
+    throw std::runtime_error("Unknown scheduling policy: " + name + ". Supported: tree, longest-first.");
+}
+
+double ipk::estimate_cost(const matrix& matrix, size_t kmer_size, i2l::phylo_kmer::score_type log_threshold)
+{
+    if (matrix.width() < kmer_size || kmer_size == 0)
+    {
+        return 0.0;
+    }
+
+    /// log10 of the number of possible k-mers
+    const auto log_num_kmers = static_cast<double>(kmer_size) * std::log10(i2l::seq_traits::alphabet_size);
+
+    double cost = 0.0;
+    for (size_t j = 0; j + kmer_size <= matrix.width(); ++j)
+    {
+        /// Every window costs something, even if nothing is found
+        cost += 1.0;
+
+        /// The log-score of the best k-mer of the window
+        const auto best_score = static_cast<double>(matrix.range_max_sum(j, kmer_size));
+        if (best_score < log_threshold)
+        {
+            continue;
+        }
+
+        const auto log_count = std::min({ -best_score, -static_cast<double>(log_threshold), log_num_kmers });
+        cost += std::pow(10.0, log_count);
+    }
+    return cost;
+}
+
+group_scheduler::group_scheduler(const std::vector<double>& costs, size_t num_workers, schedule_policy policy,
+                                 size_t window)
+    : _queues(std::max<size_t>(num_workers, 1))
+{
+    const auto num_queues = _queues.size();
+    if (policy == schedule_policy::tree)
+    {
+        for (size_t i = 0; i < costs.size(); ++i)
+        {
+            _queues[i % num_queues].tasks.push_back(i);
+        }
+        return;
+    }
+
+    /// Sort tasks by decreasing cost, window by window. Ties are broken by the task index
+    /// to keep the schedule deterministic
+    std::vector<size_t> order(costs.size());
+    std::iota(order.begin(), order.end(), 0);
+    const auto window_size = window > 0 ? window : std::max<size_t>(order.size(), 1);
+    for (size_t first = 0; first < order.size(); first += window_size)
+    {
+        const auto last = std::min(first + window_size, order.size());
+        std::stable_sort(order.begin() + first, order.begin() + last,
+                         [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+    }
+
+    /// Give every task to the least loaded worker
+    using load = std::pair<double, size_t>;
+    std::priority_queue<load, std::vector<load>, std::greater<>> loads;
+    for (size_t worker_id = 0; worker_id < num_queues; ++worker_id)
+    {
+        loads.push({ 0.0, worker_id });
+    }
+
+    for (const auto task : order)
+    {
+        auto [worker_load, worker_id] = loads.top();
+        loads.pop();
+
+        _queues[worker_id].tasks.push_back(task);
+        loads.push({ worker_load + costs[task], worker_id });
+    }
+}
+
+std::optional<size_t> group_scheduler::next(size_t worker_id)
+{
+    {
+        auto& own = _queues[worker_id];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            const auto task = own.tasks.front();
+            own.tasks.pop_front();
+            return task;
+        }
+    }
+
+    /// Steal from the other end of the queue of another worker
+    for (size_t i = 1; i < _queues.size(); ++i)
+    {
+        auto& other = _queues[(worker_id + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty())
+        {
+            const auto task = other.tasks.back();
+            other.tasks.pop_back();
+            return task;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<size_t> group_scheduler::dispatch_order() const
+{
+    std::vector<size_t> order;
+    for (size_t position = 0; ; ++position)
+    {
+        bool found = false;
+        for (auto& queue : _queues)
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (position < queue.tasks.size())
+            {
+                order.push_back(queue.tasks[position]);
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            return order;
+        }
+    }
+}
@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+
+"""
+Offline end-to-end benchmark of the database construction.
+
+Runs ipk-dna / ipk-aa on the test datasets with pre-computed ancestral reconstruction
+results (--ar-dir), so neither raxml-ng nor network access is needed. For every
+combination of k, omega, --on-disk and the number of threads it records
+the per-stage times reported by IPK, the peak RSS of the process and the size
+of the output database. The report is written in JSON.
+
+AR fixtures are looked up in tests/data/<DATASET>/ar/. If they are missing,
+they can be generated once with --raxml-ng, which runs IPK with --ar-only and
+copies the results there.
+"""
+
+__author__ = "Nikolai Romashchenko"
+__license__ = "MIT"
+
+
+import os
+import re
+import sys
+import json
+import time
+import shutil
+import platform
+import argparse
+import tempfile
+import itertools
+import subprocess
+from pathlib import Path
+
+
+SCRIPT_DIR = Path(__file__).resolve().parent
+DATA_DIR = SCRIPT_DIR / "data"
+
+AR_PROBS_SUFFIX = ".raxml.ancestralProbs"
+AR_TREE_SUFFIX = ".raxml.ancestralTree"
+
+DATASETS = {
+    "D652": {
+        "binary": "ipk-dna",
+        "reference": "reference.fasta",
+        "tree": "tree.rooted.newick",
+        "model": "GTR",
+        "k": [7],
+        "omega": [2.0],
+        "arguments": [],
+    },
+    "D140": {
+        "binary": "ipk-aa",
+        "reference": "reference.fasta",
+        "tree": "tree.newick",
+        "model": "LG",
+        "k": [4],
+        "omega": [10.0],
+        "arguments": ["--use-unrooted"],
+    },
+}
+
+# Lines of the IPK output with stage times (ms)
+STAGE_PATTERNS = {
+    "computation_ms": re.compile(r"^Computation time: (\d+)"),
+    "filtering_ms": re.compile(r"^Filtering time: (\d+)"),
+    "filtering_and_merge_ms": re.compile(r"^Filtering and merge time: (\d+)"),
+    "merge_ms": re.compile(r"^Merge time: (\d+)"),
+    "total_ms": re.compile(r"^Total time \(ms\): (\d+)"),
+}
+
+# ar_guesser runs the AR binary with --help and looks for its name in the output.
+# With --ar-dir, that is the only thing the binary is used for
+STUB_AR_BINARY = """#!/bin/sh
+echo "raxml-ng stub for offline IPK benchmarks"
+"""
+
+
+def parse_list(value, cast):
+    return [cast(v) for v in value.split(",") if v]
+
+
+def parse_on_disk(value):
+    choices = {"off": [False], "on": [True], "both": [False, True]}
+    if value not in choices:
+        raise argparse.ArgumentTypeError("must be one of: off, on, both")
+    return choices[value]
+
+
+def make_stub_ar_binary(directory):
+    directory.mkdir(parents=True, exist_ok=True)
+    stub = directory / "raxml-ng"
+    stub.write_text(STUB_AR_BINARY)
+    stub.chmod(0o755)
+    return stub
+
+
+def fixture_dir(dataset):
+    return DATA_DIR / dataset / "ar"
+
+
+def has_fixtures(directory):
+    if not directory.is_dir():
+        return False
+    files = [f.name for f in directory.iterdir() if f.is_file()]
+    return any(f.endswith(AR_PROBS_SUFFIX) for f in files) and any(f.endswith(AR_TREE_SUFFIX) for f in files)
+
+
+def generate_fixtures(dataset, config, bin_dir, raxml_ng, workdir):
+    """Runs ancestral reconstruction once and stores the results as fixtures"""
+    data = DATA_DIR / dataset
+    ar_workdir = workdir / f"{dataset}_ar"
+    command = [
+        str(bin_dir / config["binary"]),
+        "--ar-binary", str(raxml_ng),
+        "--refalign", str(data / config["reference"]),
+        "-t", str(data / config["tree"]),
+        "-w", str(ar_workdir),
+        "--model", config["model"],
+        "--ar-only",
+    ] + config["arguments"]
+
+    print("Generating AR fixtures:", " ".join(command), file=sys.stderr)
+    subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+
+    target = fixture_dir(dataset)
+    target.mkdir(parents=True, exist_ok=True)
+    for suffix in (AR_PROBS_SUFFIX, AR_TREE_SUFFIX):
+        source = ar_workdir / "extended_trees" / f"extended_align.phylip{suffix}"
+        shutil.copy(source, target / source.name)
+    shutil.rmtree(ar_workdir, ignore_errors=True)
+
+
+def run_and_measure(command):
+    """Runs the command, returns its exit code, stdout, wall time (s) and peak RSS (bytes)"""
+    begin = time.monotonic()
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    output = process.stdout.read().decode(errors="replace")
+    _, status, usage = os.wait4(process.pid, 0)
+    wall_time = time.monotonic() - begin
+
+    # Tell Popen the process is gone
+    process.returncode = os.waitstatus_to_exitcode(status)
+
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    peak_rss = usage.ru_maxrss if sys.platform == "darwin" else usage.ru_maxrss * 1024
+    return process.returncode, output, wall_time, peak_rss
+
+
+def parse_stage_times(output):
+    stages = {}
+    for line in output.splitlines():
+        line = line.strip()
+        for name, pattern in STAGE_PATTERNS.items():
+            match = pattern.match(line)
+            if match:
+                stages[name] = int(match.group(1))
+    return stages
+
+
+def run_benchmark(dataset, config, bin_dir, stub, workdir, k, omega, on_disk, threads, repeat):
+    data = DATA_DIR / dataset
+    run_name = f"{dataset}_k{k}_o{omega}_{'disk' if on_disk else 'ram'}_j{threads}_r{repeat}"
+    run_workdir = workdir / run_name
+    output_file = run_workdir / "DB.ipk"
+    metrics_file = run_workdir / "metrics.json"
+
+    shutil.rmtree(run_workdir, ignore_errors=True)
+    run_workdir.mkdir(parents=True)
+
+    command = [
+        str(bin_dir / config["binary"]),
+        "--ar-binary", str(stub),
+        "--ar-dir", str(fixture_dir(dataset)),
+        "--refalign", str(data / config["reference"]),
+        "-t", str(data / config["tree"]),
+        "-w", str(run_workdir),
+        "-o", str(output_file),
+        "--model", config["model"],
+        "-k", str(k),
+        "--omega", str(omega),
+        "-j", str(threads),
+        "--metrics-json", str(metrics_file),
+    ] + config["arguments"]
+    if on_disk:
+        command.append("--on-disk")
+
+    print("Running:", " ".join(command), file=sys.stderr)
+    exit_code, output, wall_time, peak_rss = run_and_measure(command)
+    if exit_code != 0:
+        print(output, file=sys.stderr)
+
+    result = {
+        "dataset": dataset,
+        "binary": config["binary"],
+        "k": k,
+        "omega": omega,
+        "on_disk": on_disk,
+        "threads": threads,
+        "repeat": repeat,
+        "exit_code": exit_code,
+        "wall_time_s": wall_time,
+        "peak_rss_bytes": peak_rss,
+        "output_size_bytes": output_file.stat().st_size if output_file.exists() else None,
+        "stages": parse_stage_times(output),
+        "metrics": json.loads(metrics_file.read_text()) if metrics_file.exists() else None,
+    }
+
+    shutil.rmtree(run_workdir, ignore_errors=True)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--bin-dir", required=True, type=Path,
+                        help="Directory with ipk-dna and ipk-aa binaries")
+    parser.add_argument("-w", "--workdir", type=Path, default=Path(tempfile.gettempdir()) / "ipk-bench",
+                        help="Working directory for temporary files")
+    parser.add_argument("-o", "--output", type=Path,
+                        help="Output JSON report. Printed to stdout if not set")
+    parser.add_argument("--datasets", type=lambda v: parse_list(v, str), default=list(DATASETS),
+                        help="Comma-separated list of datasets (default: all)")
+    parser.add_argument("-k", type=lambda v: parse_list(v, int),
+                        help="Comma-separated values of k (default: dataset-specific)")
+    parser.add_argument("--omega", type=lambda v: parse_list(v, float),
+                        help="Comma-separated values of omega (default: dataset-specific)")
+    parser.add_argument("--on-disk", type=parse_on_disk, default=[False, True],
+                        help="Whether to run with --on-disk: off, on or both (default)")
+    parser.add_argument("-j", "--threads", type=lambda v: parse_list(v, int), default=[1],
+                        help="Comma-separated numbers of threads (default: 1)")
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="Number of runs for every combination of parameters")
+    parser.add_argument("--raxml-ng", type=Path,
+                        help="RAxML-ng binary, used only to generate missing AR fixtures")
+    args = parser.parse_args()
+
+    for dataset in args.datasets:
+        if dataset not in DATASETS:
+            parser.error(f"Unknown dataset: {dataset}. Supported: {', '.join(DATASETS)}")
+
+    bin_dir = args.bin_dir.resolve()
+    workdir = args.workdir.resolve()
+    workdir.mkdir(parents=True, exist_ok=True)
+    stub = make_stub_ar_binary(workdir / "stub")
+
+    runs = []
+    for dataset in args.datasets:
+        config = DATASETS[dataset]
+
+        if not has_fixtures(fixture_dir(dataset)):
+            if not args.raxml_ng:
+                parser.error(f"AR fixtures for {dataset} are missing in {fixture_dir(dataset)}. "
+                             f"Provide --raxml-ng to generate them")
+            generate_fixtures(dataset, config, bin_dir, args.raxml_ng.resolve(), workdir)
+
+        ks = args.k or config["k"]
+        omegas = args.omega or config["omega"]
+        for k, omega, on_disk, threads, repeat in itertools.product(ks, omegas, args.on_disk,
+                                                                    args.threads, range(args.repeat)):
+            runs.append(run_benchmark(dataset, config, bin_dir, stub, workdir,
+                                      k, omega, on_disk, threads, repeat))
+
+    report = {
+        "benchmark": "ipk-db-build",
+        "host": {
+            "platform": platform.platform(),
+            "machine": platform.machine(),
+            "cpu_count": os.cpu_count(),
+        },
+        "runs": runs,
+    }
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+
+    return 0 if all(run["exit_code"] == 0 for run in runs) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
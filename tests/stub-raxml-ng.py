@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+A stand-in for raxml-ng --ancestral, used by the tests of the ancestral reconstruction
+wrappers and readers. It writes <msa>.raxml.ancestralProbs and <msa>.raxml.ancestralTree
+as RAxML-NG does, without computing anything: at every site, the state of the first
+sequence of the alignment has the probability 0.7 in every inner node.
+
+Every run is appended to raxml-ng-stub.log next to the alignment.
+"""
+import os
+import re
+import sys
+
+
+STATES = "ACGT"
+
+
+def get_option(args, name):
+    return args[args.index(name) + 1] if name in args else None
+
+
+def read_phylip(filename):
+    """Returns the sequences of a PHYLIP file written by IPK"""
+    with open(filename) as f:
+        lines = f.read().splitlines()
+    sequences = []
+    for line in lines[1:]:
+        if line.strip():
+            _, *chunks = line.split()
+            sequences.append("".join(chunks))
+    return sequences
+
+
+def name_inner_nodes(newick):
+    """Names inner nodes Node1, Node2... in the order of their closing parentheses"""
+    counter = iter(range(1, sys.maxsize))
+    labels = []
+
+    def rename(match):
+        labels.append(f"Node{next(counter)}")
+        return ")" + labels[-1]
+
+    return re.sub(r"\)[^:,;()]*", rename, newick), labels
+
+
+def probabilities(state):
+    if state.upper() not in STATES:
+        return [0.25] * len(STATES)
+    return [0.7 if s == state.upper() else 0.1 for s in STATES]
+
+
+def main(args):
+    if "--help" in args:
+        print("RAxML-NG stub for the tests of IPK")
+        return 0
+
+    msa = get_option(args, "--msa")
+    tree = get_option(args, "--tree")
+    if not msa or not tree:
+        print("Usage: stub-raxml-ng.py --ancestral --msa MSA --tree TREE [...]", file=sys.stderr)
+        return 1
+
+    with open(os.path.join(os.path.dirname(os.path.abspath(msa)), "raxml-ng-stub.log"), "a") as log:
+        log.write(" ".join(args) + "\n")
+
+    with open(tree) as f:
+        ar_tree, inner_nodes = name_inner_nodes(f.read().strip())
+    with open(msa + ".raxml.ancestralTree", "w") as f:
+        f.write(ar_tree + "\n")
+
+    first_sequence = read_phylip(msa)[0]
+    with open(msa + ".raxml.ancestralProbs", "w") as f:
+        f.write("Node\tSite\tState\t" + "\t".join(f"p_{s}" for s in STATES) + "\n")
+        for node in inner_nodes:
+            for site, state in enumerate(first_sequence, 1):
+                values = "\t".join(f"{p:.6f}" for p in probabilities(state))
+                f.write(f"{node}\t{site}\t{state.upper()}\t{values}\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+
+# Checks that the readers of ancestral reconstruction results give the matrices of a full parse
+
+SCRIPT_DIR=$( cd -- "$( dirname -- "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )
+
+if [ $# -eq 2 ]; then
+    BIN_DIR=`realpath $1`
+    WORKING_DIR=`realpath $2`
+else
+    BIN_DIR=`realpath "${SCRIPT_DIR}"/..`
+    WORKING_DIR="${BIN_DIR}"/output
+fi
+
+IPK_ARDUMP_BIN="${BIN_DIR}"/ipkardump-dna
+
+echo "Bin dir: ${BIN_DIR}"
+echo
+
+if [ ! -f "${IPK_ARDUMP_BIN}" ]
+then
+    echo "Error: could not find tools: ${IPK_ARDUMP_BIN}. Please make sure to compile it separately, i.e. do 'make ardump-dna' or 'cmake --build DIR --target ardump-dna"
+    exit 1
+fi
+
+mkdir -p "${WORKING_DIR}"
+
+# PhyML. Nodes are read out of the order of the file, so that the index is used
+# to seek to every node, including the last node and the last site
+PHYML_DATA="${SCRIPT_DIR}"/data/phyml
+PHYML_OUTPUT="${WORKING_DIR}"/phyml_matrices.txt
+
+rm -f "${PHYML_OUTPUT}"
+"${IPK_ARDUMP_BIN}" "${PHYML_OUTPUT}" phyml "${PHYML_DATA}"/ancestral_seq.txt Node4 Node1 Node3 Node2
+
+if [ $? -ne 0 ]; then
+    echo "Error: could not read ${PHYML_DATA}/ancestral_seq.txt"
+    exit 2
+fi
+
+diff "${PHYML_DATA}"/expected.txt "${PHYML_OUTPUT}"
+
+if [ $? -ne 0 ]; then
+    echo "Error: the PhyML reader differs from the full parse of ${PHYML_DATA}/ancestral_seq.txt"
+    exit 3
+fi
+
+echo "PhyML reader: OK"
+
+# RAxML-NG on column partitions. The stub writes the results of every partition, which must
+# read as the results of the whole alignment: columns are concatenated in partition order
+PARTITION_DATA="${SCRIPT_DIR}"/data/partitions
+PARTITION_DIR="${WORKING_DIR}"/partitions
+RAXML_STUB="${SCRIPT_DIR}"/stub-raxml-ng.py
+
+rm -rf "${PARTITION_DIR}"
+mkdir -p "${PARTITION_DIR}"
+cp "${PARTITION_DATA}"/* "${PARTITION_DIR}"
+
+for MSA in alignment.phylip alignment.phylip.part0 alignment.phylip.part1
+do
+    "${RAXML_STUB}" --ancestral --msa "${PARTITION_DIR}"/${MSA} --tree "${PARTITION_DIR}"/tree.newick
+done
+
+"${IPK_ARDUMP_BIN}" "${PARTITION_DIR}"/whole.txt raxml-ng \
+    "${PARTITION_DIR}"/alignment.phylip.raxml.ancestralProbs Node1 Node2 Node3
+
+if [ $? -ne 0 ]; then
+    echo "Error: could not read ${PARTITION_DIR}/alignment.phylip.raxml.ancestralProbs"
+    exit 4
+fi
+
+"${IPK_ARDUMP_BIN}" "${PARTITION_DIR}"/partitioned.txt raxml-ng \
+    "${PARTITION_DIR}"/alignment.phylip.part0.raxml.ancestralProbs,"${PARTITION_DIR}"/alignment.phylip.part1.raxml.ancestralProbs \
+    Node1 Node2 Node3
+
+if [ $? -ne 0 ]; then
+    echo "Error: could not read the partitions of ${PARTITION_DIR}/alignment.phylip"
+    exit 5
+fi
+
+diff "${PARTITION_DIR}"/whole.txt "${PARTITION_DIR}"/partitioned.txt
+
+if [ $? -ne 0 ]; then
+    echo "Error: the partitioned reader differs from the reader of the whole alignment"
+    exit 6
+fi
+
+echo "Partitioned RAxML-NG reader: OK"
@@ -22,6 +22,7 @@ IPK_BIN="${BIN_DIR}"/ipk-dna
 IPK_SCRIPT="${ROOT_DIR}"/ipk.py
 IPK_DIFF_BIN="${BIN_DIR}"/ipkdiff-dna
 IPK_DIFF_AA_BIN="${BIN_DIR}"/ipkdiff-aa
+IPK_FORMAT_DIFF_BIN="${BIN_DIR}"/ipkformatdiff-dna
 
 echo "Pwd: `pwd`"
 echo "Root dir: ${ROOT_DIR}"
@@ -41,6 +42,10 @@ elif [ ! -f "${IPK_DIFF_BIN}" ]
 then
     echo "Error: could not find tools: ${IPK_DIFF_BIN}. Please make sure to compile it separately, i.e. do 'make diff-dna' or 'cmake --build DIR --target diff-dna"
     exit 3
+elif [ ! -f "${IPK_FORMAT_DIFF_BIN}" ]
+then
+    echo "Error: could not find tools: ${IPK_FORMAT_DIFF_BIN}. Please make sure to compile it separately, i.e. do 'make formatdiff-dna' or 'cmake --build DIR --target formatdiff-dna"
+    exit 3
 elif [ ! "${RAXML_NG}" ]
 then
     echo "Error: could not find raxml-ng."
@@ -73,6 +78,222 @@ else
         exit 6
     fi
 
+    # D652 on-disk builds: every way of building on disk must give the database
+    # of the full rebuild above, bit for bit
+    D652_BUILD=(python3 "${IPK_SCRIPT}" build -r "${REFERENCE}" -t "${TREE}" -m GTR -k 7 --omega 2.0 -b "${RAXML_NG}")
+
+    # Compares a database to the full rebuild. Exits with the given code if they differ
+    check_same() {
+        if [ ! -f "$1" ]
+        then
+            echo "Error: could not find $1. Something went wrong"
+            exit $2
+        fi
+
+        $IPK_DIFF_BIN 0 "${DATABASE_BUILD}" "$1"
+
+        if [ $? -ne 0 ]; then
+            echo "Error: $1 differs from ${DATABASE_BUILD}. See the ipkdiff log"
+            exit $2
+        fi
+    }
+
+    # The flat layout: every k-mer must have the entries of the ipk layout
+    FLAT_DIR="${WORKING_DIR}"/flat
+    rm -rf "${FLAT_DIR}"
+    "${D652_BUILD[@]}" -w "${FLAT_DIR}" -o "${FLAT_DIR}"/DB.flat --format flat
+    if [ ! -f "${FLAT_DIR}"/DB.flat ] || ! $IPK_FORMAT_DIFF_BIN "${DATABASE_BUILD}" "${FLAT_DIR}"/DB.flat
+    then
+        echo "Error: ${FLAT_DIR}/DB.flat differs from ${DATABASE_BUILD}"
+        exit 19
+    fi
+
+    # The blocks layout, stored and compressed. Blocks are compressed by several threads
+    # and must be written in order
+    BLOCKS_DIR="${WORKING_DIR}"/blocks
+    rm -rf "${BLOCKS_DIR}"
+    for LEVEL in 0 6
+    do
+        "${D652_BUILD[@]}" -w "${BLOCKS_DIR}" -o "${BLOCKS_DIR}"/DB_${LEVEL}.blocks \
+            --format blocks --compression-level ${LEVEL} --threads 4
+        if [ ! -f "${BLOCKS_DIR}"/DB_${LEVEL}.blocks ] || ! $IPK_FORMAT_DIFF_BIN "${DATABASE_BUILD}" "${BLOCKS_DIR}"/DB_${LEVEL}.blocks
+        then
+            echo "Error: ${BLOCKS_DIR}/DB_${LEVEL}.blocks differs from ${DATABASE_BUILD}"
+            exit 20
+        fi
+    done
+
+    # Several k and omega in one run: every database must be the one of the build of its
+    # k and omega alone. The ancestral reconstruction of the full rebuild is reused
+    MULTI_DIR="${WORKING_DIR}"/multi-target
+    rm -rf "${MULTI_DIR}"
+    python3 "${IPK_SCRIPT}" build -r "${REFERENCE}" -t "${TREE}" -m GTR -k 6,7 --omega 1.5,2.0 -b "${RAXML_NG}" \
+        --ar-dir "${WORKING_DIR}"/extended_trees -w "${MULTI_DIR}"/all -o "${MULTI_DIR}"/DB.ipk \
+        --metrics-json "${MULTI_DIR}"/metrics.json
+
+    for TARGET in k6_o1.5 k6_o2 k7_o1.5 k7_o2
+    do
+        K=`echo ${TARGET} | sed 's/k\([0-9]*\)_o.*/\1/'`
+        OMEGA=`echo ${TARGET} | sed 's/.*_o//'`
+        python3 "${IPK_SCRIPT}" build -r "${REFERENCE}" -t "${TREE}" -m GTR -k ${K} --omega ${OMEGA} -b "${RAXML_NG}" \
+            --ar-dir "${WORKING_DIR}"/extended_trees -w "${MULTI_DIR}"/${TARGET} -o "${MULTI_DIR}"/${TARGET}.ipk
+
+        if [ ! -f "${MULTI_DIR}"/DB_${TARGET}.ipk ] || ! $IPK_DIFF_BIN 0 "${MULTI_DIR}"/${TARGET}.ipk "${MULTI_DIR}"/DB_${TARGET}.ipk
+        then
+            echo "Error: ${MULTI_DIR}/DB_${TARGET}.ipk differs from the build of k=${K}, omega=${OMEGA} alone"
+            exit 21
+        fi
+    done
+
+    # The metrics have the counters of every database
+    python3 -c 'import json, sys; targets = json.load(open(sys.argv[1]))["targets"]; sys.exit(sorted(targets) != sys.argv[2:])' \
+        "${MULTI_DIR}"/metrics.json k6_o1.5 k6_o2 k7_o1.5 k7_o2
+    if [ $? -ne 0 ]; then
+        echo "Error: expected the metrics of four databases in ${MULTI_DIR}/metrics.json"
+        exit 22
+    fi
+
+    # --keep-groups, then --update-from with the same parameters: all groups are reused
+    KEEP_DIR="${WORKING_DIR}"/keep-groups
+    UPDATE_DIR="${WORKING_DIR}"/update-from
+    rm -rf "${KEEP_DIR}" "${UPDATE_DIR}"
+    "${D652_BUILD[@]}" -w "${KEEP_DIR}" -o "${KEEP_DIR}"/DB.ipk --on-disk --keep-groups
+    check_same "${KEEP_DIR}"/DB.ipk 9
+    "${D652_BUILD[@]}" -w "${UPDATE_DIR}" -o "${UPDATE_DIR}"/DB.ipk --on-disk --update-from "${KEEP_DIR}"
+    check_same "${UPDATE_DIR}"/DB.ipk 10
+
+    # --update-from after a change in one node: the ancestral reconstruction of --keep-groups
+    # with two states swapped in that node. Only the groups of that node are explored again,
+    # and the database must be the full rebuild of the changed input
+    CHANGED_AR_DIR="${WORKING_DIR}"/changed-ar
+    CHANGED_DIR="${WORKING_DIR}"/changed-full
+    rm -rf "${CHANGED_AR_DIR}" "${CHANGED_DIR}" "${UPDATE_DIR}"
+    mkdir -p "${CHANGED_AR_DIR}"
+    AR_PROBS=`ls "${KEEP_DIR}"/extended_trees/*.raxml.ancestralProbs`
+    cp "${KEEP_DIR}"/extended_trees/*.raxml.ancestralTree "${CHANGED_AR_DIR}"
+    CHANGED_NODE=`awk 'NR == 2 { print $1 }' "${AR_PROBS}"`
+    awk -v node="${CHANGED_NODE}" 'BEGIN { FS = OFS = "\t" } $1 == node { t = $4; $4 = $7; $7 = t } { print }' \
+        "${AR_PROBS}" > "${CHANGED_AR_DIR}"/`basename "${AR_PROBS}"`
+
+    "${D652_BUILD[@]}" -w "${CHANGED_DIR}" -o "${CHANGED_DIR}"/DB.ipk --ar-dir "${CHANGED_AR_DIR}"
+    "${D652_BUILD[@]}" -w "${UPDATE_DIR}" -o "${UPDATE_DIR}"/DB.ipk --ar-dir "${CHANGED_AR_DIR}" \
+        --on-disk --update-from "${KEEP_DIR}" | tee "${WORKING_DIR}"/update-from.log
+
+    if [ ! -f "${UPDATE_DIR}"/DB.ipk ] || ! $IPK_DIFF_BIN 0 "${CHANGED_DIR}"/DB.ipk "${UPDATE_DIR}"/DB.ipk
+    then
+        echo "Error: the update of ${KEEP_DIR} differs from the full rebuild ${CHANGED_DIR}/DB.ipk"
+        exit 15
+    fi
+
+    NUM_GROUPS=`sed -n 's/.*: \([0-9]*\) groups can be reused.*/\1/p' "${WORKING_DIR}"/update-from.log`
+    NUM_REUSED=`sed -n 's/.*Reused \([0-9]*\) groups of.*/\1/p' "${WORKING_DIR}"/update-from.log`
+    if [ -z "${NUM_REUSED}" ] || [ "${NUM_REUSED}" -eq 0 ] || [ "${NUM_REUSED}" -ge "${NUM_GROUPS}" ]
+    then
+        echo "Error: expected some of ${NUM_GROUPS} groups to be reused and some explored, reused: ${NUM_REUSED}"
+        exit 16
+    fi
+
+    # Groups spilled with a lossy codec must not be reused by a lossless build
+    QUANTIZED_DIR="${WORKING_DIR}"/keep-groups-quantized
+    rm -rf "${QUANTIZED_DIR}" "${UPDATE_DIR}"
+    "${D652_BUILD[@]}" -w "${QUANTIZED_DIR}" -o "${QUANTIZED_DIR}"/DB.ipk --on-disk --keep-groups --spill-codec quantized
+    "${D652_BUILD[@]}" -w "${UPDATE_DIR}" -o "${UPDATE_DIR}"/DB.ipk --on-disk --update-from "${QUANTIZED_DIR}"
+    if [ -f "${UPDATE_DIR}"/DB.ipk ]
+    then
+        echo "Error: a lossless build reused the groups of a --spill-codec quantized build"
+        exit 13
+    fi
+
+    # A tiny memory budget. The build in RAM switches to disk after the first group, and
+    # batches of the on-disk build are merged in parts
+    MAX_RAM_DIR="${WORKING_DIR}"/max-ram
+    rm -rf "${MAX_RAM_DIR}"
+    "${D652_BUILD[@]}" -w "${MAX_RAM_DIR}"/ram -o "${MAX_RAM_DIR}"/ram/DB.ipk --max-ram 1M \
+        | tee "${WORKING_DIR}"/max-ram.log
+    check_same "${MAX_RAM_DIR}"/ram/DB.ipk 17
+    if ! grep -q "The memory budget is exceeded" "${WORKING_DIR}"/max-ram.log
+    then
+        echo "Error: the build in RAM did not switch to disk with --max-ram 1M"
+        exit 17
+    fi
+
+    "${D652_BUILD[@]}" -w "${MAX_RAM_DIR}"/disk -o "${MAX_RAM_DIR}"/disk/DB.ipk --max-ram 1M --on-disk --keep-groups
+    check_same "${MAX_RAM_DIR}"/disk/DB.ipk 18
+    if [ `awk '$1 == "batch" && $5 > 1' "${MAX_RAM_DIR}"/disk/hashmaps/journal | wc -l` -eq 0 ]
+    then
+        echo "Error: no batch was merged in parts with --max-ram 1M"
+        exit 18
+    fi
+
+    # An on-disk build killed once it has journaled a few groups, then resumed. The last
+    # lines of the journal and of the spill files are left half-written, as if the build
+    # was killed in the middle of them
+    RESUME_DIR="${WORKING_DIR}"/resume
+    RESUME_JOURNAL="${RESUME_DIR}"/hashmaps/journal
+    rm -rf "${RESUME_DIR}"
+
+    count_groups() {
+        cat "$1" 2> /dev/null | grep -c "^group "
+    }
+
+    # With job control, the build runs in its own process group, so that IPK is killed
+    # with the script that runs it
+    set -m
+    "${D652_BUILD[@]}" -w "${RESUME_DIR}" -o "${RESUME_DIR}"/DB.ipk --on-disk --threads 1 &
+    BUILD_PID=$!
+    set +m
+    while kill -0 ${BUILD_PID} 2> /dev/null && [ `count_groups "${RESUME_JOURNAL}"` -lt 5 ]
+    do
+        sleep 0.05
+    done
+    kill -KILL -- -${BUILD_PID} 2> /dev/null
+    wait ${BUILD_PID} 2> /dev/null
+
+    if [ -f "${RESUME_DIR}"/DB.ipk ] || [ `count_groups "${RESUME_JOURNAL}"` -lt 5 ]
+    then
+        echo "Error: the build was not interrupted during the exploration. See ${RESUME_JOURNAL}"
+        exit 11
+    fi
+
+    printf "group 1" >> "${RESUME_JOURNAL}"
+    for SPILL in "${RESUME_DIR}"/hashmaps/*.spill
+    do
+        printf "partial" >> "${SPILL}"
+        printf "12 3456 7" >> "${SPILL}".index
+    done
+
+    "${D652_BUILD[@]}" -w "${RESUME_DIR}" -o "${RESUME_DIR}"/DB.ipk --on-disk --resume
+    check_same "${RESUME_DIR}"/DB.ipk 11
+
+    # Two shards, merged
+    SHARDS_DIR="${WORKING_DIR}"/shards
+    rm -rf "${SHARDS_DIR}"
+    for i in 0 1
+    do
+        "${D652_BUILD[@]}" -w "${SHARDS_DIR}"/shard$i --on-disk --shard $i/2
+    done
+    python3 "${IPK_SCRIPT}" merge-shards -w "${SHARDS_DIR}"/merged -o "${SHARDS_DIR}"/DB.ipk \
+        "${SHARDS_DIR}"/shard0 "${SHARDS_DIR}"/shard1
+    check_same "${SHARDS_DIR}"/DB.ipk 12
+
+    # Ancestral reconstruction on two partitions, by a stub RAxML-NG that logs its runs.
+    # A resumed build finds the results of both partitions and must not run it again
+    AR_RESUME_DIR="${WORKING_DIR}"/ar-resume
+    AR_STUB_LOG="${AR_RESUME_DIR}"/extended_trees/raxml-ng-stub.log
+    rm -rf "${AR_RESUME_DIR}"
+    for RESUME in "" --resume
+    do
+        python3 "${IPK_SCRIPT}" build -r "${REFERENCE}" -t "${TREE}" -m GTR -k 7 --omega 2.0 \
+            -b "${SCRIPT_DIR}"/stub-raxml-ng.py -w "${AR_RESUME_DIR}" -o "${AR_RESUME_DIR}"/DB.ipk \
+            --on-disk --ar-only --ar-partitions 2 ${RESUME}
+    done
+
+    if [ ! -f "${AR_STUB_LOG}" ] || [ `wc -l < "${AR_STUB_LOG}"` -ne 2 ]
+    then
+        echo "Error: expected two runs of the stub RAxML-NG, one per partition. See ${AR_STUB_LOG}"
+        exit 14
+    fi
+
 
     # D140
     D140_REFERENCE="${SCRIPT_DIR}"/data/D140/reference.fasta
@@ -0,0 +1,61 @@
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <i2l/seq.h>
+#include "ar.h"
+#include "readers.h"
+
+/// Prints the matrices of the nodes, as the reader reads them, to the output file: a row
+/// for every site with the node label, the site (from 1) and the probabilities of the states.
+/// Several comma-separated files are read as column partitions, see make_partitioned_reader
+int main(int argc, char** argv)
+{
+    if (argc < 5)
+    {
+        std::cout << "Usage: " << argv[0] << " OUTPUT READER FILE[,FILE...] NODE..." << std::endl
+                  << "Readers: " << boost::algorithm::join(ipk::ar::reader_names(), ", ") << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        const std::string file_list = argv[3];
+        std::vector<std::string> files;
+        boost::split(files, file_list, boost::is_any_of(","));
+
+        std::vector<std::unique_ptr<ipk::ar::reader>> readers;
+        for (const auto& file : files)
+        {
+            readers.push_back(ipk::ar::make_reader(argv[2], file));
+        }
+        auto reader = readers.size() == 1 ? std::move(readers.front())
+                                          : ipk::ar::make_partitioned_reader(std::move(readers));
+
+        std::ofstream out(argv[1]);
+        out << std::fixed << std::setprecision(6);
+        for (int i = 4; i < argc; ++i)
+        {
+            const auto matrix = reader->read_node(argv[i]);
+            for (size_t site = 0; site < matrix.width(); ++site)
+            {
+                out << argv[i] << '\t' << site + 1;
+                for (size_t state = 0; state < i2l::seq_traits::alphabet_size; ++state)
+                {
+                    out << '\t' << std::pow(10.0, matrix.get(state, site));
+                }
+                out << '\n';
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
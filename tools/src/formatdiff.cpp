@@ -0,0 +1,173 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <i2l/phylo_kmer_db.h>
+#include <i2l/serialization.h>
+#include "block_db.h"
+#include "flat_db.h"
+
+using branch_scores = std::unordered_map<i2l::phylo_kmer::branch_type, i2l::phylo_kmer::score_type>;
+
+/// Compares the entries of a k-mer with the entries read from another layout.
+/// Scores are stored as they are in all layouts, so they must be equal
+template<class Entries>
+bool same_entries(const branch_scores& expected, const Entries& entries)
+{
+    if (expected.size() != entries.size())
+    {
+        return false;
+    }
+
+    for (const auto& entry : entries)
+    {
+        const auto it = expected.find(entry.branch);
+        if (it == expected.end() || it->second != entry.score)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Reads the magic bytes of a database
+std::string read_magic(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic(8, '\0');
+    in.read(magic.data(), static_cast<std::streamsize>(magic.size()));
+    return magic;
+}
+
+/// The entries of a k-mer of the database in the ipk layout
+template<class Entries>
+branch_scores get_scores(const Entries& entries)
+{
+    branch_scores scores;
+#ifdef KEEP_POSITIONS
+    for (const auto& [branch, score, position] : entries)
+#else
+    for (const auto& [branch, score] : entries)
+#endif
+    {
+        scores[branch] = score;
+    }
+    return scores;
+}
+
+/// Checks that every k-mer of the database in the ipk layout has the same entries in the flat
+/// database, and that the flat database has nothing else
+size_t check_flat(const i2l::phylo_kmer_db& db, const std::string& filename)
+{
+    const ipk::flat_db flat(filename);
+
+    size_t num_diffs = 0;
+    size_t num_entries = 0;
+    for (const auto& [kmer, entries] : db)
+    {
+        const auto expected = get_scores(entries);
+        num_entries += expected.size();
+
+        if (!same_entries(expected, flat.search(kmer)))
+        {
+            std::cout << "K-mer " << kmer << ": different entries" << std::endl;
+            ++num_diffs;
+        }
+    }
+
+    if (flat.size() != db.size() || flat.entries().size() != num_entries)
+    {
+        std::cout << "Number of k-mers: " << db.size() << "\t" << flat.size() << std::endl
+                  << "Number of phylo-k-mers: " << num_entries << "\t" << flat.entries().size() << std::endl;
+        ++num_diffs;
+    }
+    return num_diffs;
+}
+
+/// Decodes every block of the block database and checks the k-mers against the database
+/// in the ipk layout. Every k-mer of the ipk layout must be found once
+size_t check_blocks(const i2l::phylo_kmer_db& db, const std::string& filename)
+{
+    const ipk::block_db blocks(filename);
+
+    size_t num_diffs = 0;
+    std::unordered_map<i2l::phylo_kmer::key_type, std::vector<ipk::flat::entry>> decoded;
+    for (size_t block_index = 0; block_index < blocks.num_blocks(); ++block_index)
+    {
+        auto records = blocks.read_block(block_index);
+        if (records.size() != blocks.block(block_index).num_kmers)
+        {
+            std::cout << "Block " << block_index << ": " << records.size() << " k-mers instead of "
+                      << blocks.block(block_index).num_kmers << std::endl;
+            ++num_diffs;
+        }
+
+        for (auto& record : records)
+        {
+            if (!decoded.emplace(record.key, std::move(record.entries)).second)
+            {
+                std::cout << "K-mer " << record.key << ": found twice" << std::endl;
+                ++num_diffs;
+            }
+        }
+    }
+
+    for (const auto& [kmer, entries] : db)
+    {
+        const auto it = decoded.find(kmer);
+        if (it == decoded.end() || !same_entries(get_scores(entries), it->second))
+        {
+            std::cout << "K-mer " << kmer << ": different entries" << std::endl;
+            ++num_diffs;
+        }
+    }
+
+    if (decoded.size() != db.size() || blocks.size() != db.size())
+    {
+        std::cout << "Number of k-mers: " << db.size() << "\t" << decoded.size() << std::endl;
+        ++num_diffs;
+    }
+    return num_diffs;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        std::cout << "Usage: " << argv[0] << " IPK_DATABASE DATABASE" << std::endl
+                  << "Compares a database in another layout (flat or blocks) with the same database "
+                  << "in the ipk layout" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        const auto db = i2l::load(argv[1]);
+        const auto magic = read_magic(argv[2]);
+
+        size_t num_diffs = 0;
+        if (std::memcmp(magic.data(), ipk::flat::magic, sizeof(ipk::flat::magic)) == 0)
+        {
+            num_diffs = check_flat(db, argv[2]);
+        }
+        else if (std::memcmp(magic.data(), ipk::blocks::magic, sizeof(ipk::blocks::magic)) == 0)
+        {
+            num_diffs = check_blocks(db, argv[2]);
+        }
+        else
+        {
+            std::cerr << "Error: unknown layout of " << argv[2] << std::endl;
+            return 1;
+        }
+
+        std::cout << (num_diffs == 0 ? "OK" : "DIFF") << std::endl;
+        return num_diffs == 0 ? 0 : 2;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}